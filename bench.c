@@ -0,0 +1,296 @@
+/*
+ * Storage throughput benchmark
+ *
+ * An entry with "benchmark <file>" in loader.conf boots nothing: it
+ * reads the file from the ESP over and over, once per read size and
+ * access method, and prints a table of throughputs in MiB/s. Methods
+ * are the firmware's file system driver (SimpleFileSystem Read),
+ * DiskIo and BlockIo reads of the file's extents, and BlockIo2 reads
+ * with 1, 4 and 16 in flight. The table is what decides which read
+ * path suits a board's boot media.
+ *
+ * Each pass reads the first BENCH_MAX bytes of the file into the same
+ * buffer and is checked against what SimpleFileSystem read, so a
+ * method that fails or returns wrong data shows up as "bad" instead
+ * of as a fast read. Caches are not dropped between passes: a device or
+ * driver cache shows up as later passes running faster.
+ */
+
+#include "loader.h"
+
+#define BENCH_MAX          0x1000000      /* Bytes read per pass, at most */
+#define BENCH_MIN_CHUNK    0x1000         /* Smallest read size, growing 4x per row */
+#define BENCH_CHUNKS       6              /* 4 KiB to 4 MiB */
+#define BENCH_MAX_DEPTH    16
+
+enum {
+    BENCH_FILE,
+    BENCH_DISK_IO,
+    BENCH_BLOCK_IO,
+    BENCH_QUEUE_1,
+    BENCH_QUEUE_4,
+    BENCH_QUEUE_16,
+    BENCH_METHODS,
+};
+
+static CONST CHAR16 *MethodNames[BENCH_METHODS] = {
+    [BENCH_FILE]     = L"File",
+    [BENCH_DISK_IO]  = L"DiskIo",
+    [BENCH_BLOCK_IO] = L"BlockIo",
+    [BENCH_QUEUE_1]  = L"BIo2x1",
+    [BENCH_QUEUE_4]  = L"BIo2x4",
+    [BENCH_QUEUE_16] = L"BIo2x16",
+};
+
+static CONST UINTN Depths[BENCH_METHODS] = {
+    [BENCH_QUEUE_1]  = 1,
+    [BENCH_QUEUE_4]  = 4,
+    [BENCH_QUEUE_16] = 16,
+};
+
+typedef struct {
+    EFI_FILE_HANDLE File;
+    FAT_VOLUME *Vol;            /* NULL if the file cannot be read directly */
+    FAT_FILE Fat;
+    EFI_DISK_IO *DiskIo;        /* NULL if the ESP has none */
+    UINT8 *Buffer;
+    UINT8 *Reference;           /* The file as SimpleFileSystem read it */
+    UINTN Size;                 /* Bytes read per pass */
+} BENCH;
+
+static BLOCK_REQUEST Requests[BENCH_MAX_DEPTH];
+
+/*
+ * Where byte Offset of the file is on the volume; Size is cut to what
+ * is contiguous there
+ */
+static UINT64 DiskOffset(FAT_FILE *File, UINT64 Offset, UINTN *Size)
+{
+    UINTN i;
+
+    for (i = 0; i < File->ExtentCount; i++) {
+        FAT_EXTENT *Ext = &File->Extents[i];
+
+        if (Offset >= Ext->Length) {
+            Offset -= Ext->Length;
+            continue;
+        }
+        if (*Size > Ext->Length - Offset)
+            *Size = Ext->Length - Offset;
+        return Ext->Offset + Offset;
+    }
+    return 0;
+}
+
+static EFI_STATUS PassFile(BENCH *b, UINTN Chunk)
+{
+    EFI_STATUS status;
+    UINTN Offset, n;
+
+    status = b->File->SetPosition(b->File, 0);
+    for (Offset = 0; !EFI_ERROR(status) && Offset < b->Size; Offset += n) {
+        n = b->Size - Offset < Chunk ? b->Size - Offset : Chunk;
+        status = b->File->Read(b->File, &n, b->Buffer + Offset);
+        if (!EFI_ERROR(status) && n == 0)
+            status = EFI_END_OF_FILE;
+    }
+    return status;
+}
+
+static EFI_STATUS PassDiskIo(BENCH *b, UINTN Chunk)
+{
+    EFI_STATUS status = EFI_SUCCESS;
+    UINTN Offset, n;
+    UINT64 Disk;
+
+    for (Offset = 0; !EFI_ERROR(status) && Offset < b->Size; Offset += n) {
+        n = b->Size - Offset < Chunk ? b->Size - Offset : Chunk;
+        Disk = DiskOffset(&b->Fat, Offset, &n);
+        status = b->DiskIo->ReadDisk(b->DiskIo, b->Vol->Dev.MediaId, Disk, n,
+                                     b->Buffer + Offset);
+    }
+    return status;
+}
+
+static EFI_STATUS PassBlockIo(BENCH *b, UINTN Chunk)
+{
+    EFI_STATUS status = EFI_SUCCESS;
+    UINTN Offset, n;
+    UINT64 Disk;
+
+    for (Offset = 0; !EFI_ERROR(status) && Offset < b->Size; Offset += n) {
+        n = b->Size - Offset < Chunk ? b->Size - Offset : Chunk;
+        Disk = DiskOffset(&b->Fat, Offset, &n);
+        status = BlockRead(&b->Vol->Dev, Disk, b->Buffer + Offset, n);
+    }
+    return status;
+}
+
+/*
+ * Keep Depth reads in flight. After a failure nothing more is queued,
+ * but reads still in flight are waited for before returning.
+ */
+static EFI_STATUS PassQueue(BENCH *b, UINTN Chunk, UINTN Depth)
+{
+    EFI_STATUS status = EFI_SUCCESS;
+    UINTN Offset = 0, Head = 0, Count = 0, n;
+    UINT64 Disk;
+
+    while (Count || (!EFI_ERROR(status) && Offset < b->Size)) {
+        while (!EFI_ERROR(status) && Count < Depth && Offset < b->Size) {
+            n = b->Size - Offset < Chunk ? b->Size - Offset : Chunk;
+            Disk = DiskOffset(&b->Fat, Offset, &n);
+            status = BlockReadAsync(&b->Vol->Dev, Disk, b->Buffer + Offset, n,
+                                    &Requests[(Head + Count) % BENCH_MAX_DEPTH]);
+            if (!EFI_ERROR(status)) {
+                Offset += n;
+                Count++;
+            }
+        }
+        if (Count && BlockRequestDone(&Requests[Head])) {
+            if (EFI_ERROR(Requests[Head].Status) && !EFI_ERROR(status))
+                status = Requests[Head].Status;
+            Head = (Head + 1) % BENCH_MAX_DEPTH;
+            Count--;
+        }
+    }
+    return status;
+}
+
+static BOOLEAN MethodUsable(BENCH *b, UINTN Method)
+{
+    switch (Method) {
+    case BENCH_FILE:
+        return TRUE;
+    case BENCH_DISK_IO:
+        return b->Vol && b->DiskIo;
+    case BENCH_BLOCK_IO:
+        return b->Vol != NULL;
+    default:
+        return b->Vol && b->Vol->Dev.BlockIo2;
+    }
+}
+
+/*
+ * Time one pass, in MiB/s
+ */
+static EFI_STATUS RunPass(BENCH *b, UINTN Method, UINTN Chunk, UINT64 Timebase, UINT64 *Rate)
+{
+    EFI_STATUS status;
+    UINT64 Start, Ticks;
+
+    SetMem(b->Buffer, b->Size, 0);
+    Start = ReadTime();
+    switch (Method) {
+    case BENCH_FILE:
+        status = PassFile(b, Chunk);
+        break;
+    case BENCH_DISK_IO:
+        status = PassDiskIo(b, Chunk);
+        break;
+    case BENCH_BLOCK_IO:
+        status = PassBlockIo(b, Chunk);
+        break;
+    default:
+        status = PassQueue(b, Chunk, Depths[Method]);
+        break;
+    }
+    Ticks = ReadTime() - Start;
+    if (EFI_ERROR(status))
+        return status;
+    if (CompareMem(b->Buffer, b->Reference, b->Size) != 0)
+        return EFI_CRC_ERROR;
+    *Rate = ((UINT64)b->Size * Timebase / (Ticks ? Ticks : 1)) >> 20;
+    return EFI_SUCCESS;
+}
+
+/*
+ * Benchmark reads of the open file File of FileSize bytes, found at
+ * Path on the ESP that Vol describes. Timebase is the frequency of
+ * ReadTime(), 0 if not known.
+ */
+EFI_STATUS Benchmark(EFI_FILE_HANDLE File, UINTN FileSize, CHAR16 *Path,
+                     EFI_HANDLE Device, FAT_VOLUME *Vol, UINT64 Timebase)
+{
+    EFI_PHYSICAL_ADDRESS Addr;
+    EFI_STATUS status;
+    UINTN SavedMaxTransfer, Pages, Method, Row, Chunk, i;
+    IO_TUNE *SavedTune;
+    UINT64 Rate;
+    BENCH b;
+
+    ZeroMem(&b, sizeof(b));
+    b.File = File;
+    b.Size = FileSize < BENCH_MAX ? FileSize : BENCH_MAX;
+    if (!b.Size)
+        return EFI_END_OF_FILE;
+    Pages = EFI_SIZE_TO_PAGES(b.Size);
+    status = BS->AllocatePages(AllocateAnyPages, EfiLoaderData, 2 * Pages, &Addr);
+    if (EFI_ERROR(status))
+        return status;
+    b.Buffer = (UINT8 *)Addr;
+    b.Reference = b.Buffer + Pages * EFI_PAGE_SIZE;
+
+    if (Vol->Dev.BlockIo && !EFI_ERROR(FatLookup(Vol, Path, &b.Fat)) &&
+        b.Fat.Size == FileSize)
+        b.Vol = Vol;
+    if (EFI_ERROR(BS->HandleProtocol(Device, &gEfiDiskIoProtocolGuid, (VOID **)&b.DiskIo)))
+        b.DiskIo = NULL;
+
+    /* Every transfer is as issued: no tuned cap, no tuning */
+    SavedMaxTransfer = Vol->Dev.MaxTransfer;
+    SavedTune = Vol->Dev.Tune;
+    Vol->Dev.MaxTransfer = 0;
+    Vol->Dev.Tune = NULL;
+
+    LogPrint(L"Benchmarking %s, %d of %d bytes per pass%s\r\n", Path, b.Size, FileSize,
+             b.Vol ? L"" : L" (file reads only: not read directly from FAT32)");
+    if (!Timebase) {
+        LogPrint(L"No timebase-frequency in the device tree: rates assume 10 MHz\r\n");
+        Timebase = 10000000;
+    }
+
+    /* The reference copy; this also brings the file into any cache */
+    status = b.File->SetPosition(b.File, 0);
+    if (!EFI_ERROR(status)) {
+        UINTN n = b.Size;
+
+        status = b.File->Read(b.File, &n, b.Reference);
+        if (!EFI_ERROR(status) && n != b.Size)
+            status = EFI_END_OF_FILE;
+    }
+    if (EFI_ERROR(status))
+        goto out;
+
+    LogPrint(L"\r\n   Chunk");
+    for (Method = 0; Method < BENCH_METHODS; Method++)
+        LogPrint(L" %8s", MethodNames[Method]);
+    LogPrint(L"   (MiB/s)\r\n");
+    for (Row = 0; Row < BENCH_CHUNKS; Row++) {
+        Chunk = (UINTN)BENCH_MIN_CHUNK << (2 * Row);
+        if (Chunk >= 0x100000)
+            LogPrint(L"%6dM ", Chunk >> 20);
+        else
+            LogPrint(L"%6dK ", Chunk >> 10);
+        for (Method = 0; Method < BENCH_METHODS; Method++) {
+            if (!MethodUsable(&b, Method)) {
+                LogPrint(L"        -");
+                continue;
+            }
+            if (EFI_ERROR(RunPass(&b, Method, Chunk, Timebase, &Rate)))
+                LogPrint(L"      bad");
+            else
+                LogPrint(L" %8ld", Rate);
+        }
+        LogPrint(L"\r\n");
+        LogFlush();
+    }
+
+out:
+    for (i = 0; i < BENCH_MAX_DEPTH; i++)
+        BlockRequestFree(&Requests[i]);
+    Vol->Dev.MaxTransfer = SavedMaxTransfer;
+    Vol->Dev.Tune = SavedTune;
+    BS->FreePages(Addr, 2 * Pages);
+    return status;
+}
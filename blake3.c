@@ -0,0 +1,217 @@
+/*
+ * BLAKE3
+ *
+ * Used to verify large initrds. BLAKE3 hashes its input as a binary
+ * tree over 1 KiB chunks, so the work splits cleanly across harts:
+ * the input is cut into UNIT_LEN units, each a complete subtree, and
+ * the harts claim units and compute their chaining values
+ * independently (see smp.c). The boot hart then combines the unit
+ * values up to the root, which takes only one parent compression per
+ * unit.
+ *
+ * Only the plain C compression function is provided. An RVV version
+ * would need vector state enabled and preserved under UEFI, which the
+ * loader does not do.
+ */
+
+#include "loader.h"
+
+#define CHUNK_LEN          1024
+#define BLOCK_LEN          64
+#define UNIT_LEN           (256 * CHUNK_LEN)  /* Must be a power-of-two number of chunks */
+
+/* Domain flags */
+#define CHUNK_START        1
+#define CHUNK_END          2
+#define PARENT             4
+#define ROOT               8
+
+static CONST UINT32 IV[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+/* Message word order for each of the 7 rounds */
+static CONST UINT8 Schedule[7][16] = {
+    { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+    { 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 },
+    { 3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1 },
+    { 10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6 },
+    { 12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4 },
+    { 9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7 },
+    { 11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13 },
+};
+
+/*
+ * A hash job shared by all harts. Units are claimed through Next;
+ * Done counts the chaining values written to Cvs.
+ */
+typedef struct {
+    CONST UINT8 *Data;
+    UINTN Size;
+    UINTN Units;
+    UINTN Next;
+    UINTN Done;
+    UINT32 (*Cvs)[8];
+} BLAKE3_JOB;
+
+#define ROR(x, n)          (((x) >> (n)) | ((x) << (32 - (n))))
+
+#define G(a, b, c, d, x, y)                 \
+    do {                                    \
+        v[a] += v[b] + (x);                 \
+        v[d] = ROR(v[d] ^ v[a], 16);        \
+        v[c] += v[d];                       \
+        v[b] = ROR(v[b] ^ v[c], 12);        \
+        v[a] += v[b] + (y);                 \
+        v[d] = ROR(v[d] ^ v[a], 8);         \
+        v[c] += v[d];                       \
+        v[b] = ROR(v[b] ^ v[c], 7);         \
+    } while (0)
+
+/*
+ * Compress one block into a new chaining value. Out may alias Cv.
+ */
+static VOID Compress(CONST UINT32 *Cv, CONST UINT32 *m, UINT64 Counter,
+                     UINT32 BlockLen, UINT32 Flags, UINT32 *Out)
+{
+    UINT32 v[16];
+    UINTN i;
+
+    for (i = 0; i < 8; i++)
+        v[i] = Cv[i];
+    for (i = 0; i < 4; i++)
+        v[8 + i] = IV[i];
+    v[12] = (UINT32)Counter;
+    v[13] = (UINT32)(Counter >> 32);
+    v[14] = BlockLen;
+    v[15] = Flags;
+
+    for (i = 0; i < 7; i++) {
+        CONST UINT8 *s = Schedule[i];
+
+        G(0, 4, 8, 12, m[s[0]], m[s[1]]);
+        G(1, 5, 9, 13, m[s[2]], m[s[3]]);
+        G(2, 6, 10, 14, m[s[4]], m[s[5]]);
+        G(3, 7, 11, 15, m[s[6]], m[s[7]]);
+        G(0, 5, 10, 15, m[s[8]], m[s[9]]);
+        G(1, 6, 11, 12, m[s[10]], m[s[11]]);
+        G(2, 7, 8, 13, m[s[12]], m[s[13]]);
+        G(3, 4, 9, 14, m[s[14]], m[s[15]]);
+    }
+    for (i = 0; i < 8; i++)
+        Out[i] = v[i] ^ v[i + 8];
+}
+
+/*
+ * Chaining value of one chunk (up to CHUNK_LEN bytes, possibly none)
+ */
+static VOID ChunkCv(CONST UINT8 *Data, UINTN Len, UINT64 Counter, UINT32 Flags, UINT32 *Out)
+{
+    UINT32 Block[16];
+    UINT32 Start = CHUNK_START;
+    UINTN i, n;
+
+    for (i = 0; i < 8; i++)
+        Out[i] = IV[i];
+    do {
+        n = Len < BLOCK_LEN ? Len : BLOCK_LEN;
+        for (i = 0; i < 16; i++)
+            Block[i] = 0;
+        for (i = 0; i < n; i++)
+            Block[i / 4] |= (UINT32)Data[i] << (8 * (i % 4));
+        Compress(Out, Block, Counter, (UINT32)n,
+                 Start | (Len <= BLOCK_LEN ? CHUNK_END | Flags : 0), Out);
+        Data += n;
+        Len -= n;
+        Start = 0;
+    } while (Len > 0);
+}
+
+/*
+ * Chaining value of the subtree over Len bytes starting at chunk
+ * Counter. The left subtree always holds the largest power-of-two
+ * number of chunks that leaves something for the right one. If Units
+ * is given, unit-sized subtrees are taken from it instead of hashed.
+ */
+static VOID Subtree(CONST UINT8 *Data, UINTN Len, UINT64 Counter, UINT32 Flags,
+                    UINT32 (*Units)[8], UINT32 *Out)
+{
+    UINT32 Block[16];
+    UINTN LeftLen, i;
+
+    if (Units && Len <= UNIT_LEN) {
+        for (i = 0; i < 8; i++)
+            Out[i] = Units[Counter / (UNIT_LEN / CHUNK_LEN)][i];
+        return;
+    }
+    if (Len <= CHUNK_LEN) {
+        ChunkCv(Data, Len, Counter, Flags, Out);
+        return;
+    }
+
+    for (LeftLen = CHUNK_LEN; 2 * LeftLen < Len; LeftLen *= 2)
+        ;
+    Subtree(Data, LeftLen, Counter, 0, Units, Block);
+    Subtree(Data + LeftLen, Len - LeftLen, Counter + LeftLen / CHUNK_LEN, 0,
+            Units, Block + 8);
+    Compress(IV, Block, 0, BLOCK_LEN, PARENT | Flags, Out);
+}
+
+/*
+ * Runs on every participating hart: must not call UEFI services
+ */
+static VOID Blake3Worker(VOID *Arg)
+{
+    BLAKE3_JOB *Job = Arg;
+    UINTN i;
+
+    while ((i = __atomic_fetch_add(&Job->Next, 1, __ATOMIC_RELAXED)) < Job->Units) {
+        UINTN Offset = i * UNIT_LEN;
+        UINTN Len = Job->Size - Offset < UNIT_LEN ? Job->Size - Offset : UNIT_LEN;
+
+        Subtree(Job->Data + Offset, Len, Offset / CHUNK_LEN, 0, NULL, Job->Cvs[i]);
+        __atomic_fetch_add(&Job->Done, 1, __ATOMIC_RELEASE);
+    }
+}
+
+/*
+ * Hash Size bytes at Data, spreading the work over the harts found in
+ * Dtb. Harts is set to the number of harts that took part.
+ */
+EFI_STATUS Blake3Hash(CONST VOID *Data, UINTN Size, VOID *Dtb, UINTN BootHartId,
+                      UINT8 *Digest, UINTN *Harts)
+{
+    /* Static, so a hart that overran SmpRun's wait never sees a dead stack frame */
+    static BLAKE3_JOB Job;
+    UINT32 Root[8];
+    UINTN i;
+
+    *Harts = 1;
+    if (Size <= UNIT_LEN) {
+        Subtree(Data, Size, 0, ROOT, NULL, Root);
+    } else {
+        Job.Data = Data;
+        Job.Size = Size;
+        Job.Units = (Size + UNIT_LEN - 1) / UNIT_LEN;
+        Job.Next = 0;
+        Job.Done = 0;
+        Job.Cvs = AllocatePool(Job.Units * sizeof(*Job.Cvs));
+        if (!Job.Cvs)
+            return EFI_OUT_OF_RESOURCES;
+
+        *Harts = SmpRun(Dtb, BootHartId, Blake3Worker, &Job);
+        if (__atomic_load_n(&Job.Done, __ATOMIC_ACQUIRE) != Job.Units)
+            return EFI_TIMEOUT;     /* Cvs may still be written: leave it allocated */
+        Subtree(Data, Size, 0, ROOT, Job.Cvs, Root);
+        FreePool(Job.Cvs);
+    }
+
+    for (i = 0; i < 8; i++) {
+        Digest[4 * i] = (UINT8)Root[i];
+        Digest[4 * i + 1] = (UINT8)(Root[i] >> 8);
+        Digest[4 * i + 2] = (UINT8)(Root[i] >> 16);
+        Digest[4 * i + 3] = (UINT8)(Root[i] >> 24);
+    }
+    return EFI_SUCCESS;
+}
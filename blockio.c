@@ -0,0 +1,180 @@
+/*
+ * Byte-addressed reads over BlockIo
+ *
+ * Used by the direct FAT32 and raw partition readers. Whole blocks
+ * are read straight into the caller's buffer, as one ReadBlocks per
+ * call unless MaxTransfer limits it; only partial blocks at either
+ * end of a range go through the bounce buffer. MaxTransfer is found
+ * by timing the first reads from the device (see iotune.c).
+ *
+ * Where the device also has BlockIo2, whole-block reads can be queued
+ * instead, so the device works while the loader gets on with something
+ * else (see sched.c).
+ */
+
+#include "loader.h"
+
+EFI_STATUS BlockOpen(EFI_BLOCK_IO *BlockIo, UINT64 Base, BLOCK_DEVICE *Dev)
+{
+    EFI_STATUS status;
+    EFI_PHYSICAL_ADDRESS Bounce;
+
+    ZeroMem(Dev, sizeof(*Dev));
+    if (!BlockIo->Media->MediaPresent || BlockIo->Media->BlockSize < 512)
+        return EFI_NO_MEDIA;
+
+    status = BS->AllocatePages(AllocateAnyPages, EfiLoaderData,
+                               EFI_SIZE_TO_PAGES(BlockIo->Media->BlockSize), &Bounce);
+    if (EFI_ERROR(status))
+        return status;
+    Dev->BlockIo = BlockIo;
+    Dev->MediaId = BlockIo->Media->MediaId;
+    Dev->BlockSize = BlockIo->Media->BlockSize;
+    Dev->Base = Base;
+    Dev->Bounce = (UINT8 *)Bounce;
+    return EFI_SUCCESS;
+}
+
+/*
+ * Look for BlockIo2 on the device's handle, for BlockReadAsync
+ */
+VOID BlockOpenQueue(BLOCK_DEVICE *Dev, EFI_HANDLE Handle)
+{
+    static EFI_GUID BlockIo2ProtocolGuid = {
+        0xa77b2472, 0xe282, 0x4e9f,
+        {0xa2, 0x45, 0xc2, 0xc0, 0xe2, 0x7b, 0xbc, 0xc1}
+    };
+    BLOCK_IO2_PROTOCOL *BlockIo2;
+
+    if (!EFI_ERROR(BS->HandleProtocol(Handle, &BlockIo2ProtocolGuid, (VOID **)&BlockIo2)) &&
+        BlockIo2->Media->MediaId == Dev->MediaId &&
+        BlockIo2->Media->BlockSize == Dev->BlockSize)
+        Dev->BlockIo2 = BlockIo2;
+}
+
+VOID BlockClose(BLOCK_DEVICE *Dev)
+{
+    if (Dev->Bounce)
+        BS->FreePages((EFI_PHYSICAL_ADDRESS)Dev->Bounce, EFI_SIZE_TO_PAGES(Dev->BlockSize));
+    ZeroMem(Dev, sizeof(*Dev));
+}
+
+/*
+ * Read Size bytes at Offset (relative to Dev->Base). Buffers that do
+ * not meet the device's IoAlign are read through the bounce buffer.
+ * Sink, if set, is given each transfer as it completes, so it can use
+ * the data while it is still in cache.
+ */
+EFI_STATUS BlockReadSink(BLOCK_DEVICE *Dev, UINT64 Offset, VOID *Buffer, UINTN Size,
+                         BLOCK_SINK Sink, VOID *Context)
+{
+    EFI_BLOCK_IO *BlockIo = Dev->BlockIo;
+    UINT32 BlockSize = Dev->BlockSize;
+    UINTN Align = BlockIo->Media->IoAlign;
+    UINT8 *Dst = Buffer;
+    EFI_STATUS status;
+    UINTN Limit;
+    UINT64 Start;
+
+    Offset += Dev->Base;
+    while (Size > 0) {
+        EFI_LBA Lba = Offset / BlockSize;
+        UINTN Skip = Offset % BlockSize;
+        BOOLEAN Aligned = Align <= 1 || ((UINTN)Dst & (Align - 1)) == 0;
+        UINTN Chunk;
+
+        if (Skip == 0 && Size >= BlockSize && Aligned) {
+            Chunk = Size - Size % BlockSize;
+            Limit = IoTuneLimit(Dev, Chunk);
+            if (Limit >= BlockSize && Chunk > Limit)
+                Chunk = Limit - Limit % BlockSize;
+            Start = ReadTime();
+            status = PROF_CALL(PROF_READ_BLOCKS, Chunk,
+                               BlockIo->ReadBlocks(BlockIo, Dev->MediaId, Lba, Chunk, Dst));
+            if (EFI_ERROR(status))
+                return status;
+            IoTuneSample(Dev, Chunk, ReadTime() - Start);
+        } else {
+            Chunk = BlockSize - Skip;
+            if (Chunk > Size)
+                Chunk = Size;
+            status = PROF_CALL(PROF_READ_BLOCKS, BlockSize,
+                               BlockIo->ReadBlocks(BlockIo, Dev->MediaId, Lba, BlockSize,
+                                                   Dev->Bounce));
+            if (EFI_ERROR(status))
+                return status;
+            CopyMem(Dst, Dev->Bounce + Skip, Chunk);
+        }
+        if (Sink)
+            Sink(Context, Dst, Chunk);
+        Dst += Chunk;
+        Offset += Chunk;
+        Size -= Chunk;
+    }
+    return EFI_SUCCESS;
+}
+
+EFI_STATUS BlockRead(BLOCK_DEVICE *Dev, UINT64 Offset, VOID *Buffer, UINTN Size)
+{
+    return BlockReadSink(Dev, Offset, Buffer, Size, NULL, NULL);
+}
+
+/*
+ * Queue a read of Size bytes at Offset. Reads that are not whole,
+ * aligned blocks, or that would exceed MaxTransfer, are done at once
+ * with BlockRead instead. Either way Req tells when it is done.
+ */
+EFI_STATUS BlockReadAsync(BLOCK_DEVICE *Dev, UINT64 Offset, VOID *Buffer, UINTN Size,
+                          BLOCK_REQUEST *Req)
+{
+    BLOCK_IO2_PROTOCOL *BlockIo2 = Dev->BlockIo2;
+    UINT32 BlockSize = Dev->BlockSize;
+    UINTN Align;
+    EFI_STATUS status;
+
+    Req->Pending = FALSE;
+    Align = BlockIo2 ? BlockIo2->Media->IoAlign : 0;
+    if (!BlockIo2 || (Offset + Dev->Base) % BlockSize || Size % BlockSize ||
+        (Align > 1 && ((UINTN)Buffer & (Align - 1))) ||
+        (Dev->MaxTransfer && Size > Dev->MaxTransfer)) {
+        Req->Status = BlockRead(Dev, Offset, Buffer, Size);
+        return Req->Status;
+    }
+
+    if (!Req->Token.Event) {
+        status = BS->CreateEvent(0, 0, NULL, NULL, &Req->Token.Event);
+        if (EFI_ERROR(status))
+            return status;
+    }
+    Req->Token.TransactionStatus = EFI_SUCCESS;
+    status = PROF_CALL(PROF_READ_BLOCKS, Size,
+                       BlockIo2->ReadBlocksEx(BlockIo2, Dev->MediaId,
+                                              (Offset + Dev->Base) / BlockSize,
+                                              &Req->Token, Size, Buffer));
+    if (EFI_ERROR(status))
+        return status;
+    Req->Pending = TRUE;
+    return EFI_SUCCESS;
+}
+
+/*
+ * Check on a read without waiting for it; Req->Status is its outcome
+ * once this returns TRUE
+ */
+BOOLEAN BlockRequestDone(BLOCK_REQUEST *Req)
+{
+    if (!Req->Pending)
+        return TRUE;
+    if (BS->CheckEvent(Req->Token.Event) != EFI_SUCCESS)
+        return FALSE;
+    Req->Pending = FALSE;
+    Req->Status = Req->Token.TransactionStatus;
+    return TRUE;
+}
+
+VOID BlockRequestFree(BLOCK_REQUEST *Req)
+{
+    if (Req->Token.Event)
+        BS->CloseEvent(Req->Token.Event);
+    Req->Token.Event = NULL;
+}
@@ -0,0 +1,106 @@
+/*
+ * Persisted boot plan
+ *
+ * After a successful boot the resolved decisions (which file on which
+ * device, its size and mtime, where it was loaded, its format and
+ * compression, where the DTB was found) are kept in a non-volatile
+ * EFI variable. On the next boot the key is checked against the
+ * kernel's GetInfo, which the loader needs anyway, and on a match the
+ * header probing, gzip peek and allocation fallbacks are skipped.
+ * Kernels read directly from a FAT32 ESP also keep their extents, so
+ * a warm boot only needs to re-read the directory entry to know the
+ * file is unchanged.
+ *
+ * The variable is only rewritten when the plan changes, so repeated
+ * boots of the same kernel do not wear the variable store.
+ */
+
+#include "loader.h"
+
+#define PLAN_VARIABLE      L"LoaderBootPlan"
+
+/* The plan as loaded, to avoid rewriting an identical variable */
+static BOOT_PLAN StoredPlan;
+static BOOLEAN StoredValid;
+
+BOOLEAN LoadBootPlan(BOOT_PLAN *Plan)
+{
+    EFI_STATUS status;
+    UINTN Size = sizeof(StoredPlan);
+
+    ZeroMem(Plan, sizeof(*Plan));
+    Plan->Magic = PLAN_MAGIC;
+    Plan->Version = PLAN_VERSION;
+    Plan->DtbIndex = PLAN_DTB_NONE;
+
+    status = RT->GetVariable(PLAN_VARIABLE, &LoaderVendorGuid, NULL, &Size, &StoredPlan);
+    StoredValid = !EFI_ERROR(status) && Size == sizeof(StoredPlan) &&
+                  StoredPlan.Magic == PLAN_MAGIC && StoredPlan.Version == PLAN_VERSION;
+    if (StoredValid)
+        CopyMem(Plan, &StoredPlan, sizeof(*Plan));
+    return StoredValid;
+}
+
+static UINTN PlanDevicePathSize(EFI_DEVICE_PATH *FilePath)
+{
+    UINTN DpSize = FilePath ? DevicePathSize(FilePath) : 0;
+
+    return DpSize > PLAN_MAX_DEVICE_PATH ? 0 : DpSize;
+}
+
+/*
+ * Check the file and entry part of the key, without touching the plan
+ */
+BOOLEAN BootPlanMatchesPath(BOOT_PLAN *Plan, EFI_DEVICE_PATH *FilePath,
+                            CONFIG_ENTRY *Entry)
+{
+    UINTN DpSize = PlanDevicePathSize(FilePath);
+
+    return DpSize != 0 &&
+           Plan->RequestedAddr == Entry->LoadAddr &&
+           Plan->RequestedCompression == Entry->Compression &&
+           Plan->DevicePathSize == DpSize &&
+           CompareMem(Plan->DevicePath, FilePath, DpSize) == 0;
+}
+
+/*
+ * Store the key for the kernel about to be loaded. Returns TRUE if it
+ * matches the key of the plan already held, i.e. the plan's decisions
+ * still apply.
+ */
+BOOLEAN BootPlanSetKey(BOOT_PLAN *Plan, EFI_DEVICE_PATH *FilePath,
+                       CONFIG_ENTRY *Entry, UINT64 FileSize, EFI_TIME *FileTime)
+{
+    UINTN DpSize = PlanDevicePathSize(FilePath);
+    BOOLEAN Match;
+
+    Match = BootPlanMatchesPath(Plan, FilePath, Entry) &&
+            Plan->FileSize == FileSize &&
+            CompareMem(&Plan->FileTime, FileTime, sizeof(EFI_TIME)) == 0;
+
+    Plan->FileSize = FileSize;
+    Plan->FileTime = *FileTime;
+    Plan->RequestedAddr = Entry->LoadAddr;
+    Plan->RequestedCompression = Entry->Compression;
+    Plan->DevicePathSize = DpSize;
+    ZeroMem(Plan->DevicePath, sizeof(Plan->DevicePath));
+    if (DpSize)
+        CopyMem(Plan->DevicePath, FilePath, DpSize);
+    return Match;
+}
+
+/*
+ * Persist the plan if it differs from the stored one. Plans without a
+ * usable device path key are never stored.
+ */
+VOID SaveBootPlan(BOOT_PLAN *Plan)
+{
+    if (Plan->DevicePathSize == 0)
+        return;
+    if (StoredValid && CompareMem(Plan, &StoredPlan, sizeof(*Plan)) == 0)
+        return;
+
+    RT->SetVariable(PLAN_VARIABLE, &LoaderVendorGuid,
+                    EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS,
+                    sizeof(*Plan), Plan);
+}
@@ -0,0 +1,508 @@
+/*
+ * Boot configuration file
+ *
+ * \loader.conf describes one or more boot entries:
+ *
+ *   # comment
+ *   default linux
+ *   warm-cache 0xc0000000 0x8000000
+ *   quiet
+ *   stats
+ *   devicetree \dtbs\visionfive2.dtb.gz starfive,visionfive-2-v1.3b
+ *   devicetree \dtbs\generic.dtb
+ *   dtb-cache
+ *
+ *   entry linux
+ *       kernel      \Image
+ *       initrd      \initrd.img
+ *       cmdline     console=ttyS0 root=/dev/vda2
+ *       load-addr   0x80200000
+ *       compression auto          (auto, none or gzip)
+ *       sha256      <64 hex digits>
+ *       initrd-blake3 <64 hex digits>
+ *       dtbo        \overlays\uart1.dtbo \overlays\spi0.dtbo
+ *
+ *   entry raw
+ *       kernel-partition 0fc63daf-8483-4772-8e79-3d69d8477de4
+ *
+ *   entry uki
+ *       uki         \EFI\Linux\linux.efi
+ *
+ *   entry bench
+ *       benchmark   \Image
+ *
+ * kernel-partition boots a kernel stored in a raw GPT partition of the
+ * given type instead of a file (see rawpart.c). uki boots a unified
+ * kernel image (see uki.c); its initrd, device tree and command line
+ * sections take the place of the entry's initrd and cmdline, which
+ * are only used for sections the image lacks, and its sha256, .sha256
+ * and .sig are those of the whole image. Without sha256, a
+ * kernel file is verified against \<kernel>.sha256 if that exists;
+ * likewise the initrd against initrd-blake3 or \<initrd>.b3.
+ * benchmark boots nothing: it prints how fast the given file reads by
+ * each method the firmware offers (see bench.c).
+ * dtbo lists device tree overlays applied, in order, to the tree
+ * handed to a flat kernel (see overlay.c).
+ * warm-cache gives the address and size of a RAM region that keeps
+ * the last kernel and initrd across warm resets (see warmcache.c).
+ * quiet keeps the loader's log off the console unless booting fails.
+ * stats appends a record of each boot to \loader-stats.log (see stats.c).
+ * devicetree names a device tree file, optionally gzipped, for boards
+ * whose firmware has none: the first whose board (a compatible string
+ * or SMBIOS product name) matches, or that names no board, is used.
+ * dtb-cache keeps the tree prepared from it and the overlays on the
+ * ESP (see dtbcache.c).
+ *
+ * The file is parsed in a single pass straight into a LOADER_CONFIG
+ * with no allocation. The compiled result is stored in an EFI
+ * variable keyed by the file's size and modification time, so as
+ * long as the file is unchanged later boots only need its GetInfo.
+ */
+
+#include "loader.h"
+
+#define CONFIG_VARIABLE    L"LoaderConfig"
+#define CONFIG_MAX_SIZE    8192
+
+/* Config text is read here rather than into an allocation */
+static CHAR8 ConfigText[CONFIG_MAX_SIZE];
+
+VOID AsciiToUnicode(CHAR16 *Dst, CONST CHAR8 *Src, UINTN DstLen)
+{
+    UINTN i;
+
+    for (i = 0; i + 1 < DstLen && Src[i]; i++)
+        Dst[i] = Src[i];
+    Dst[i] = 0;
+}
+
+static BOOLEAN IsSpace(CHAR8 c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+static BOOLEAN TokenEq(CONST CHAR8 *Tok, UINTN Len, CONST char *Word)
+{
+    UINTN i;
+
+    for (i = 0; i < Len; i++) {
+        if (Tok[i] != Word[i])
+            return FALSE;
+    }
+    return Word[Len] == '\0';
+}
+
+/*
+ * Copy a string into the pool; offset 0 is reserved for "unset"
+ */
+static UINT16 PoolAdd(LOADER_CONFIG *Cfg, CONST CHAR8 *Str, UINTN Len)
+{
+    UINT16 Off = Cfg->PoolUsed;
+
+    if (Len == 0 || Off + Len + 1 > CONFIG_POOL_SIZE)
+        return 0;
+    CopyMem(&Cfg->Pool[Off], (VOID *)Str, Len);
+    Cfg->Pool[Off + Len] = '\0';
+    Cfg->PoolUsed += Len + 1;
+    return Off;
+}
+
+static BOOLEAN ParseNumber(CONST CHAR8 *s, UINTN Len, UINT64 *Val)
+{
+    UINT64 v = 0;
+    UINTN Base = 10, i = 0;
+
+    if (Len > 2 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+        Base = 16;
+        i = 2;
+    }
+    if (i == Len)
+        return FALSE;
+    for (; i < Len; i++) {
+        CHAR8 c = s[i];
+        UINTN d;
+
+        if (c >= '0' && c <= '9')
+            d = c - '0';
+        else if (Base == 16 && c >= 'a' && c <= 'f')
+            d = c - 'a' + 10;
+        else if (Base == 16 && c >= 'A' && c <= 'F')
+            d = c - 'A' + 10;
+        else
+            return FALSE;
+        if (v > (~0ULL - d) / Base)
+            return FALSE;
+        v = v * Base + d;
+    }
+    *Val = v;
+    return TRUE;
+}
+
+static BOOLEAN ParseHex(CONST CHAR8 *s, UINTN Len, UINT64 *Val)
+{
+    CHAR8 Buf[19] = { '0', 'x' };
+
+    if (Len == 0 || Len > 16)
+        return FALSE;
+    CopyMem(Buf + 2, (VOID *)s, Len);
+    return ParseNumber(Buf, Len + 2, Val);
+}
+
+/*
+ * Parse a GUID in its usual xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx form
+ */
+static BOOLEAN ParseGuid(CONST CHAR8 *s, UINTN Len, EFI_GUID *Guid)
+{
+    UINT64 a, b, c, d, e;
+    UINTN i;
+
+    if (Len != 36 || s[8] != '-' || s[13] != '-' || s[18] != '-' || s[23] != '-')
+        return FALSE;
+    if (!ParseHex(s, 8, &a) || !ParseHex(s + 9, 4, &b) || !ParseHex(s + 14, 4, &c) ||
+        !ParseHex(s + 19, 4, &d) || !ParseHex(s + 24, 12, &e))
+        return FALSE;
+    Guid->Data1 = (UINT32)a;
+    Guid->Data2 = (UINT16)b;
+    Guid->Data3 = (UINT16)c;
+    Guid->Data4[0] = (UINT8)(d >> 8);
+    Guid->Data4[1] = (UINT8)d;
+    for (i = 0; i < 6; i++)
+        Guid->Data4[2 + i] = (UINT8)(e >> (40 - 8 * i));
+    return TRUE;
+}
+
+/*
+ * Parse "<addr> <size>"
+ */
+static BOOLEAN ParseRegion(CONST CHAR8 *s, UINTN Len, UINT64 *Addr, UINT64 *Size)
+{
+    UINTN i;
+
+    for (i = 0; i < Len && !IsSpace(s[i]); i++)
+        ;
+    if (!ParseNumber(s, i, Addr))
+        return FALSE;
+    while (i < Len && IsSpace(s[i]))
+        i++;
+    return ParseNumber(s + i, Len - i, Size);
+}
+
+/*
+ * Length of the longest path in a value: the whole value for keys
+ * naming one file, each word of a dtbo list, the first word of a
+ * devicetree line. Paths are turned into CHAR16 buffers of
+ * CONFIG_MAX_PATH, and one cut short there would name another file.
+ */
+static UINTN LongestPath(CONST CHAR8 *Key, UINTN KeyLen, CONST CHAR8 *Val, UINTN ValLen)
+{
+    UINTN i = 0, Start, Longest = 0;
+
+    if (TokenEq(Key, KeyLen, "kernel") || TokenEq(Key, KeyLen, "uki") ||
+        TokenEq(Key, KeyLen, "benchmark") || TokenEq(Key, KeyLen, "initrd"))
+        return ValLen;
+    if (!TokenEq(Key, KeyLen, "dtbo") && !TokenEq(Key, KeyLen, "devicetree"))
+        return 0;
+    while (i < ValLen) {
+        while (i < ValLen && IsSpace(Val[i]))
+            i++;
+        for (Start = i; i < ValLen && !IsSpace(Val[i]); i++)
+            ;
+        if (i - Start > Longest)
+            Longest = i - Start;
+        if (TokenEq(Key, KeyLen, "devicetree"))
+            break;
+    }
+    return Longest;
+}
+
+/*
+ * Handle one "key value" line of the current entry
+ */
+static BOOLEAN ParseEntryKey(LOADER_CONFIG *Cfg, CONFIG_ENTRY *Entry,
+                             CONST CHAR8 *Key, UINTN KeyLen,
+                             CONST CHAR8 *Val, UINTN ValLen)
+{
+    if (TokenEq(Key, KeyLen, "kernel")) {
+        Entry->Kernel = PoolAdd(Cfg, Val, ValLen);
+        return Entry->Kernel != 0;
+    }
+    if (TokenEq(Key, KeyLen, "kernel-partition"))
+        return ParseGuid(Val, ValLen, &Entry->Partition);
+    if (TokenEq(Key, KeyLen, "uki")) {
+        Entry->Uki = PoolAdd(Cfg, Val, ValLen);
+        return Entry->Uki != 0;
+    }
+    if (TokenEq(Key, KeyLen, "benchmark")) {
+        Entry->Benchmark = PoolAdd(Cfg, Val, ValLen);
+        return Entry->Benchmark != 0;
+    }
+    if (TokenEq(Key, KeyLen, "initrd")) {
+        Entry->Initrd = PoolAdd(Cfg, Val, ValLen);
+        return Entry->Initrd != 0;
+    }
+    if (TokenEq(Key, KeyLen, "cmdline")) {
+        Entry->Cmdline = PoolAdd(Cfg, Val, ValLen);
+        return Entry->Cmdline != 0;
+    }
+    if (TokenEq(Key, KeyLen, "sha256")) {
+        UINT8 Digest[SHA256_DIGEST_SIZE];
+
+        if (ValLen != 2 * SHA256_DIGEST_SIZE || !ParseHexDigest(Val, ValLen, Digest))
+            return FALSE;
+        Entry->Sha256 = PoolAdd(Cfg, Val, ValLen);
+        return Entry->Sha256 != 0;
+    }
+    if (TokenEq(Key, KeyLen, "initrd-blake3")) {
+        UINT8 Digest[BLAKE3_DIGEST_SIZE];
+
+        if (ValLen != 2 * BLAKE3_DIGEST_SIZE || !ParseHexDigest(Val, ValLen, Digest))
+            return FALSE;
+        Entry->InitrdBlake3 = PoolAdd(Cfg, Val, ValLen);
+        return Entry->InitrdBlake3 != 0;
+    }
+    if (TokenEq(Key, KeyLen, "dtbo")) {
+        Entry->Dtbo = PoolAdd(Cfg, Val, ValLen);
+        return Entry->Dtbo != 0;
+    }
+    if (TokenEq(Key, KeyLen, "load-addr"))
+        return ParseNumber(Val, ValLen, &Entry->LoadAddr);
+    if (TokenEq(Key, KeyLen, "compression")) {
+        if (TokenEq(Val, ValLen, "auto"))
+            Entry->Compression = COMPRESSION_AUTO;
+        else if (TokenEq(Val, ValLen, "none"))
+            Entry->Compression = COMPRESSION_NONE;
+        else if (TokenEq(Val, ValLen, "gzip"))
+            Entry->Compression = COMPRESSION_GZIP;
+        else
+            return FALSE;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/*
+ * Single pass over the text: each line is split into a key and the
+ * rest of the line as its value, and stored as soon as it is seen.
+ */
+static EFI_STATUS ParseConfig(CONST CHAR8 *Text, UINTN Size, LOADER_CONFIG *Cfg)
+{
+    static CONST EFI_GUID NoPartition;
+    CONST CHAR8 *p = Text, *End = Text + Size;
+    CONST CHAR8 *Default = NULL;
+    UINTN DefaultLen = 0;
+    CONFIG_ENTRY *Entry = NULL;
+    UINTN Line = 0;
+    UINTN i;
+
+    while (p < End) {
+        CONST CHAR8 *Key, *Val, *Eol;
+        UINTN KeyLen, ValLen;
+
+        Line++;
+        for (Eol = p; Eol < End && *Eol != '\n'; Eol++)
+            ;
+        while (p < Eol && IsSpace(*p))
+            p++;
+        if (p == Eol || *p == '#') {
+            p = Eol + 1;
+            continue;
+        }
+
+        Key = p;
+        while (p < Eol && !IsSpace(*p))
+            p++;
+        KeyLen = p - Key;
+        while (p < Eol && IsSpace(*p))
+            p++;
+        Val = p;
+        ValLen = Eol - Val;
+        while (ValLen && IsSpace(Val[ValLen - 1]))
+            ValLen--;
+        p = Eol + 1;
+
+        if (LongestPath(Key, KeyLen, Val, ValLen) >= CONFIG_MAX_PATH) {
+            LogPrint(L"loader.conf:%d: path longer than %d characters\r\n", Line,
+                     CONFIG_MAX_PATH - 1);
+            return EFI_INVALID_PARAMETER;
+        }
+        if (TokenEq(Key, KeyLen, "entry")) {
+            if (Cfg->EntryCount == CONFIG_MAX_ENTRIES) {
+                LogPrint(L"loader.conf:%d: too many entries\r\n", Line);
+                return EFI_OUT_OF_RESOURCES;
+            }
+            Entry = &Cfg->Entries[Cfg->EntryCount++];
+            Entry->Name = PoolAdd(Cfg, Val, ValLen);
+            if (!Entry->Name)
+                goto bad;
+        } else if (TokenEq(Key, KeyLen, "default")) {
+            Default = Val;
+            DefaultLen = ValLen;
+        } else if (TokenEq(Key, KeyLen, "quiet")) {
+            Cfg->Flags |= CONFIG_QUIET;
+        } else if (TokenEq(Key, KeyLen, "stats")) {
+            Cfg->Flags |= CONFIG_STATS;
+        } else if (TokenEq(Key, KeyLen, "dtb-cache")) {
+            Cfg->Flags |= CONFIG_DTB_CACHE;
+        } else if (TokenEq(Key, KeyLen, "devicetree")) {
+            if (Cfg->DtbCount == CONFIG_MAX_DTBS) {
+                LogPrint(L"loader.conf:%d: too many device trees\r\n", Line);
+                return EFI_OUT_OF_RESOURCES;
+            }
+            Cfg->Dtbs[Cfg->DtbCount] = PoolAdd(Cfg, Val, ValLen);
+            if (!Cfg->Dtbs[Cfg->DtbCount++])
+                goto bad;
+        } else if (TokenEq(Key, KeyLen, "warm-cache")) {
+            if (!ParseRegion(Val, ValLen, &Cfg->WarmCacheAddr, &Cfg->WarmCacheSize))
+                goto bad;
+        } else if (!Entry) {
+            LogPrint(L"loader.conf:%d: key outside of an entry\r\n", Line);
+            return EFI_INVALID_PARAMETER;
+        } else if (!ParseEntryKey(Cfg, Entry, Key, KeyLen, Val, ValLen)) {
+            goto bad;
+        }
+        continue;
+bad:
+        LogPrint(L"loader.conf:%d: invalid line\r\n", Line);
+        return EFI_INVALID_PARAMETER;
+    }
+
+    if (Cfg->EntryCount == 0) {
+        LogPrint(L"loader.conf: no entries\r\n");
+        return EFI_NOT_FOUND;
+    }
+    for (i = 0; i < Cfg->EntryCount; i++) {
+        Entry = &Cfg->Entries[i];
+        BOOLEAN Raw = CompareMem(&Entry->Partition, &NoPartition, sizeof(EFI_GUID)) != 0;
+
+        if ((Entry->Kernel != 0) + (Entry->Uki != 0) + (Entry->Benchmark != 0) + Raw != 1) {
+            LogPrint(L"loader.conf: entry %d needs exactly one of kernel, kernel-partition, uki and benchmark\r\n", i);
+            return EFI_INVALID_PARAMETER;
+        }
+        if (!Entry->LoadAddr)
+            Entry->LoadAddr = KERNEL_LOAD_ADDR;
+        if (Default && TokenEq(Default, DefaultLen, (char *)CONFIG_STR(Cfg, Entry->Name)))
+            Cfg->Default = i;
+    }
+    return EFI_SUCCESS;
+}
+
+static VOID InitConfig(LOADER_CONFIG *Cfg)
+{
+    ZeroMem(Cfg, sizeof(*Cfg));
+    Cfg->Magic = CONFIG_MAGIC;
+    Cfg->Version = CONFIG_VERSION;
+    Cfg->PoolUsed = 1;
+}
+
+/*
+ * Single entry equivalent to the compile-time defaults
+ */
+VOID BuiltinConfig(LOADER_CONFIG *Cfg)
+{
+    CHAR8 Path[CONFIG_MAX_PATH];
+    CHAR16 *Src = KERNEL_PATH;
+    UINTN i;
+
+    InitConfig(Cfg);
+    for (i = 0; Src[i] && i + 1 < CONFIG_MAX_PATH; i++)
+        Path[i] = (CHAR8)Src[i];
+    Cfg->EntryCount = 1;
+    Cfg->Entries[0].Name = PoolAdd(Cfg, (CHAR8 *)"default", 7);
+    Cfg->Entries[0].Kernel = PoolAdd(Cfg, Path, i);
+    Cfg->Entries[0].LoadAddr = KERNEL_LOAD_ADDR;
+}
+
+/*
+ * Load the boot configuration, preferring the compiled copy cached
+ * in an EFI variable. Falls back to the built-in defaults (and
+ * returns an error) if there is no usable config file.
+ */
+EFI_STATUS LoadConfig(EFI_FILE_HANDLE Root, LOADER_CONFIG *Cfg, BOOLEAN *Cached)
+{
+    EFI_STATUS status;
+    EFI_FILE_HANDLE File;
+    EFI_FILE_INFO *Info;
+    UINT8 InfoBuffer[SIZE_OF_EFI_FILE_INFO + 64];
+    UINTN InfoSize, Size;
+
+    *Cached = FALSE;
+    status = PROF_CALL(PROF_FILE_OPEN, 0,
+                       Root->Open(Root, &File, CONFIG_PATH, EFI_FILE_MODE_READ, 0));
+    if (EFI_ERROR(status)) {
+        BuiltinConfig(Cfg);
+        return status;
+    }
+
+    InfoSize = sizeof(InfoBuffer);
+    status = PROF_CALL(PROF_FILE_GET_INFO, 0,
+                       File->GetInfo(File, &gEfiFileInfoGuid, &InfoSize, InfoBuffer));
+    if (EFI_ERROR(status))
+        goto fallback;
+    Info = (EFI_FILE_INFO *)InfoBuffer;
+    if (Info->FileSize > CONFIG_MAX_SIZE) {
+        status = EFI_BAD_BUFFER_SIZE;
+        goto fallback;
+    }
+
+    /* A cached copy is valid if the file's size and mtime still match */
+    Size = sizeof(*Cfg);
+    status = RT->GetVariable(CONFIG_VARIABLE, &LoaderVendorGuid, NULL, &Size, Cfg);
+    if (!EFI_ERROR(status) && Cfg->Magic == CONFIG_MAGIC &&
+        Cfg->Version == CONFIG_VERSION && Cfg->SourceSize == Info->FileSize &&
+        CompareMem(&Cfg->SourceTime, &Info->ModificationTime, sizeof(EFI_TIME)) == 0) {
+        File->Close(File);
+        *Cached = TRUE;
+        return EFI_SUCCESS;
+    }
+
+    Size = Info->FileSize;
+    status = PROF_CALL(PROF_FILE_READ, Size, File->Read(File, &Size, ConfigText));
+    if (EFI_ERROR(status))
+        goto fallback;
+
+    InitConfig(Cfg);
+    status = ParseConfig(ConfigText, Size, Cfg);
+    if (EFI_ERROR(status))
+        goto fallback;
+    File->Close(File);
+
+    Cfg->SourceSize = Info->FileSize;
+    Cfg->SourceTime = Info->ModificationTime;
+    RT->SetVariable(CONFIG_VARIABLE, &LoaderVendorGuid,
+                    EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS,
+                    (UINT8 *)Cfg->Pool - (UINT8 *)Cfg + Cfg->PoolUsed, Cfg);
+    return EFI_SUCCESS;
+
+fallback:
+    File->Close(File);
+    BuiltinConfig(Cfg);
+    return status;
+}
+
+/*
+ * Pick the boot entry: the last word of the loader's load options
+ * if it names an entry, otherwise the configured default
+ */
+CONFIG_ENTRY *SelectEntry(LOADER_CONFIG *Cfg, EFI_LOADED_IMAGE *LoadedImage)
+{
+    CHAR16 *Opts = LoadedImage->LoadOptions;
+    UINTN Len = LoadedImage->LoadOptionsSize / sizeof(CHAR16);
+    UINTN Start, i, j;
+
+    while (Opts && Len && (Opts[Len - 1] == 0 || Opts[Len - 1] == ' '))
+        Len--;
+    if (!Opts || !Len)
+        return &Cfg->Entries[Cfg->Default];
+
+    for (Start = Len; Start > 0 && Opts[Start - 1] != ' '; Start--)
+        ;
+    for (i = 0; i < Cfg->EntryCount; i++) {
+        CHAR8 *Name = CONFIG_STR(Cfg, Cfg->Entries[i].Name);
+
+        for (j = 0; Start + j < Len && Name[j] && Name[j] == Opts[Start + j]; j++)
+            ;
+        if (Start + j == Len && Name[j] == '\0')
+            return &Cfg->Entries[i];
+    }
+    return &Cfg->Entries[Cfg->Default];
+}
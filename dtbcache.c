@@ -0,0 +1,123 @@
+/*
+ * Device tree cache
+ *
+ * With "dtb-cache" in loader.conf, the device tree prepared from a
+ * devicetree file and an entry's overlays is kept in
+ * \loader-dtb.cache on the ESP, with the SHA-256 of what it was made
+ * from as its key. A boot with the same inputs then reads one small
+ * file instead of decompressing and checking the devicetree file and
+ * every overlay, and applying the overlays again.
+ *
+ * The key is computed by the caller (see loader.c), from the contents
+ * of the files, so the digests it measures are those of the files on
+ * the ESP, not of whatever the tree was once made from.
+ *
+ * What the loader adds on every boot, /chosen and the regions it hands
+ * over, is not cached: it depends on where things were allocated.
+ */
+
+#include "loader.h"
+
+#define DTB_CACHE_PATH     L"\\loader-dtb.cache"
+#define DTB_CACHE_MAGIC    0x43544c44     /* "DLTC" */
+#define DTB_CACHE_VERSION  2
+#define DTB_CACHE_MAX      0x100000       /* Bytes of device tree */
+
+typedef struct {
+    UINT32 Magic;
+    UINT32 Version;
+    UINT8 Key[SHA256_DIGEST_SIZE];
+    UINT32 Size;            /* Bytes of device tree, after the header */
+} DTB_CACHE_HEADER;
+
+static DTB_CACHE_HEADER Header;
+
+/*
+ * Read the cached tree into pool memory if it was made from the inputs
+ * Key stands for
+ */
+EFI_STATUS DtbCacheLoad(EFI_FILE_HANDLE Root, CONST UINT8 *Key, VOID **Dtb)
+{
+    EFI_FILE_HANDLE File;
+    EFI_STATUS status;
+    UINTN Size;
+    VOID *Buffer;
+
+    status = PROF_CALL(PROF_FILE_OPEN, 0,
+                       Root->Open(Root, &File, DTB_CACHE_PATH, EFI_FILE_MODE_READ, 0));
+    if (EFI_ERROR(status))
+        return status;
+
+    Size = sizeof(Header);
+    status = PROF_CALL(PROF_FILE_READ, Size, File->Read(File, &Size, &Header));
+    if (!EFI_ERROR(status) &&
+        (Size != sizeof(Header) || Header.Magic != DTB_CACHE_MAGIC ||
+         Header.Version != DTB_CACHE_VERSION || Header.Size > DTB_CACHE_MAX ||
+         CompareMem(Header.Key, (VOID *)Key, SHA256_DIGEST_SIZE) != 0))
+        status = EFI_NOT_FOUND;
+    if (EFI_ERROR(status))
+        goto out;
+
+    Buffer = AllocatePool(Header.Size);
+    if (!Buffer) {
+        status = EFI_OUT_OF_RESOURCES;
+        goto out;
+    }
+    Size = Header.Size;
+    status = PROF_CALL(PROF_FILE_READ, Size, File->Read(File, &Size, Buffer));
+    if (!EFI_ERROR(status) && (Size != Header.Size || !FdtCheckHeader(Buffer, Size)))
+        status = EFI_NOT_FOUND;
+    if (EFI_ERROR(status)) {
+        FreePool(Buffer);
+        goto out;
+    }
+    *Dtb = Buffer;
+out:
+    File->Close(File);
+    return status;
+}
+
+/*
+ * Replace the cache with Dtb, which need not be packed: only the
+ * blocks in use are written
+ */
+EFI_STATUS DtbCacheStore(EFI_FILE_HANDLE Root, CONST UINT8 *Key, VOID *Dtb)
+{
+    CONST UINT64 Mode = EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE | EFI_FILE_MODE_CREATE;
+    UINT32 *Fdt = Dtb, FdtHeader[10];
+    EFI_FILE_HANDLE File;
+    EFI_STATUS status;
+    UINTN Size;
+
+    /* Totalsize is rewritten to the end of the strings block, as FdtPack does */
+    CopyMem(FdtHeader, Fdt, sizeof(FdtHeader));
+    FdtHeader[1] = cpu_to_fdt32(fdt32_to_cpu(Fdt[3]) + fdt32_to_cpu(Fdt[8]));
+    if (fdt32_to_cpu(FdtHeader[1]) > DTB_CACHE_MAX)
+        return EFI_BAD_BUFFER_SIZE;
+
+    ZeroMem(&Header, sizeof(Header));
+    Header.Magic = DTB_CACHE_MAGIC;
+    Header.Version = DTB_CACHE_VERSION;
+    CopyMem(Header.Key, (VOID *)Key, SHA256_DIGEST_SIZE);
+    Header.Size = fdt32_to_cpu(FdtHeader[1]);
+
+    /* Start from an empty file; Delete closes the handle either way */
+    if (!EFI_ERROR(Root->Open(Root, &File, DTB_CACHE_PATH, Mode, 0)))
+        File->Delete(File);
+    status = Root->Open(Root, &File, DTB_CACHE_PATH, Mode, 0);
+    if (EFI_ERROR(status))
+        return status;
+
+    Size = sizeof(Header);
+    status = File->Write(File, &Size, &Header);
+    if (!EFI_ERROR(status)) {
+        Size = sizeof(FdtHeader);
+        status = File->Write(File, &Size, FdtHeader);
+    }
+    if (!EFI_ERROR(status)) {
+        Size = Header.Size - sizeof(FdtHeader);
+        status = File->Write(File, &Size, (UINT8 *)Dtb + sizeof(FdtHeader));
+    }
+    File->Close(File);
+    return status;
+}
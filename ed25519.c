@@ -0,0 +1,551 @@
+/*
+ * Ed25519 signature verification (RFC 8032)
+ *
+ * Payloads are signed over their SHA-256 digest, so the expensive part
+ * (hashing hundreds of MB) is already done by the streamed read, and a
+ * signature check is a single fixed-size verification on top.
+ *
+ * Only verification is needed and every input is public, so nothing
+ * here tries to be constant-time. Field elements use five 51-bit limbs
+ * with 128-bit products; points use extended coordinates.
+ */
+
+#include "loader.h"
+
+/*
+ * SHA-512, needed for the challenge hash H(R || A || M)
+ */
+static CONST UINT64 K512[80] = {
+    0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL, 0xb5c0fbcfec4d3b2fULL, 0xe9b5dba58189dbbcULL,
+    0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL, 0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL,
+    0xd807aa98a3030242ULL, 0x12835b0145706fbeULL, 0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+    0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL, 0x9bdc06a725c71235ULL, 0xc19bf174cf692694ULL,
+    0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL, 0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL,
+    0x2de92c6f592b0275ULL, 0x4a7484aa6ea6e483ULL, 0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+    0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL, 0xb00327c898fb213fULL, 0xbf597fc7beef0ee4ULL,
+    0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL, 0x06ca6351e003826fULL, 0x142929670a0e6e70ULL,
+    0x27b70a8546d22ffcULL, 0x2e1b21385c26c926ULL, 0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+    0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL, 0x81c2c92e47edaee6ULL, 0x92722c851482353bULL,
+    0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL, 0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL,
+    0xd192e819d6ef5218ULL, 0xd69906245565a910ULL, 0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+    0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL, 0x2748774cdf8eeb99ULL, 0x34b0bcb5e19b48a8ULL,
+    0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL, 0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL,
+    0x748f82ee5defb2fcULL, 0x78a5636f43172f60ULL, 0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+    0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL, 0xbef9a3f7b2c67915ULL, 0xc67178f2e372532bULL,
+    0xca273eceea26619cULL, 0xd186b8c721c0c207ULL, 0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL,
+    0x06f067aa72176fbaULL, 0x0a637dc5a2c898a6ULL, 0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+    0x28db77f523047d84ULL, 0x32caab7b40c72493ULL, 0x3c9ebe0a15c9bebcULL, 0x431d67c49c100d4cULL,
+    0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL, 0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL,
+};
+
+typedef struct {
+    UINT64 State[8];
+    UINT8 Buffer[128];
+    UINTN Used;
+    UINT64 Length;
+} SHA512_CTX;
+
+#define ROR64(x, n)        (((x) >> (n)) | ((x) << (64 - (n))))
+
+static VOID Sha512Block(UINT64 *State, CONST UINT8 *Data)
+{
+    UINT64 W[80], v[8], t1, t2;
+    UINTN i, j;
+
+    for (i = 0; i < 16; i++) {
+        W[i] = 0;
+        for (j = 0; j < 8; j++)
+            W[i] = (W[i] << 8) | Data[8 * i + j];
+    }
+    for (; i < 80; i++)
+        W[i] = (ROR64(W[i - 2], 19) ^ ROR64(W[i - 2], 61) ^ (W[i - 2] >> 6)) + W[i - 7] +
+               (ROR64(W[i - 15], 1) ^ ROR64(W[i - 15], 8) ^ (W[i - 15] >> 7)) + W[i - 16];
+
+    for (i = 0; i < 8; i++)
+        v[i] = State[i];
+    for (i = 0; i < 80; i++) {
+        t1 = v[7] + (ROR64(v[4], 14) ^ ROR64(v[4], 18) ^ ROR64(v[4], 41)) +
+             ((v[4] & v[5]) ^ (~v[4] & v[6])) + K512[i] + W[i];
+        t2 = (ROR64(v[0], 28) ^ ROR64(v[0], 34) ^ ROR64(v[0], 39)) +
+             ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+        v[7] = v[6]; v[6] = v[5]; v[5] = v[4]; v[4] = v[3] + t1;
+        v[3] = v[2]; v[2] = v[1]; v[1] = v[0]; v[0] = t1 + t2;
+    }
+    for (i = 0; i < 8; i++)
+        State[i] += v[i];
+}
+
+static VOID Sha512Init(SHA512_CTX *Ctx)
+{
+    static CONST UINT64 H0[8] = {
+        0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL, 0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+        0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL, 0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL,
+    };
+    UINTN i;
+
+    for (i = 0; i < 8; i++)
+        Ctx->State[i] = H0[i];
+    Ctx->Used = 0;
+    Ctx->Length = 0;
+}
+
+static VOID Sha512Update(SHA512_CTX *Ctx, CONST UINT8 *Data, UINTN Size)
+{
+    Ctx->Length += Size;
+    while (Size--) {
+        Ctx->Buffer[Ctx->Used++] = *Data++;
+        if (Ctx->Used == 128) {
+            Sha512Block(Ctx->State, Ctx->Buffer);
+            Ctx->Used = 0;
+        }
+    }
+}
+
+static VOID Sha512Final(SHA512_CTX *Ctx, UINT8 *Digest)
+{
+    UINT64 Bits = Ctx->Length * 8;
+    UINTN i;
+
+    Ctx->Buffer[Ctx->Used++] = 0x80;
+    if (Ctx->Used > 112) {
+        SetMem(Ctx->Buffer + Ctx->Used, 128 - Ctx->Used, 0);
+        Sha512Block(Ctx->State, Ctx->Buffer);
+        Ctx->Used = 0;
+    }
+    SetMem(Ctx->Buffer + Ctx->Used, 120 - Ctx->Used, 0);
+    for (i = 0; i < 8; i++)
+        Ctx->Buffer[120 + i] = (UINT8)(Bits >> (56 - 8 * i));
+    Sha512Block(Ctx->State, Ctx->Buffer);
+    for (i = 0; i < 64; i++)
+        Digest[i] = (UINT8)(Ctx->State[i / 8] >> (56 - 8 * (i % 8)));
+}
+
+/*
+ * Field arithmetic modulo p = 2^255 - 19
+ */
+typedef struct {
+    UINT64 v[5];
+} FE;
+
+typedef unsigned __int128 UINT128;
+
+#define MASK51             ((1ULL << 51) - 1)
+
+static VOID FeSet(FE *h, UINT64 n)
+{
+    h->v[0] = n;
+    h->v[1] = h->v[2] = h->v[3] = h->v[4] = 0;
+}
+
+/*
+ * Bring every limb back under 2^51 (plus a little in limb 0)
+ */
+static VOID FeCarry(FE *h)
+{
+    UINT64 c;
+    UINTN i;
+
+    for (i = 0; i < 4; i++) {
+        c = h->v[i] >> 51;
+        h->v[i] &= MASK51;
+        h->v[i + 1] += c;
+    }
+    c = h->v[4] >> 51;
+    h->v[4] &= MASK51;
+    h->v[0] += 19 * c;
+}
+
+static VOID FeAdd(FE *h, CONST FE *f, CONST FE *g)
+{
+    UINTN i;
+
+    for (i = 0; i < 5; i++)
+        h->v[i] = f->v[i] + g->v[i];
+    FeCarry(h);
+}
+
+/* f + 2p - g, so limbs never go negative */
+static VOID FeSub(FE *h, CONST FE *f, CONST FE *g)
+{
+    UINTN i;
+
+    h->v[0] = f->v[0] + 0xfffffffffffdaULL - g->v[0];
+    for (i = 1; i < 5; i++)
+        h->v[i] = f->v[i] + 0xffffffffffffeULL - g->v[i];
+    FeCarry(h);
+}
+
+static VOID FeMul(FE *h, CONST FE *f, CONST FE *g)
+{
+    UINT64 f0 = f->v[0], f1 = f->v[1], f2 = f->v[2], f3 = f->v[3], f4 = f->v[4];
+    UINT64 g0 = g->v[0], g1 = g->v[1], g2 = g->v[2], g3 = g->v[3], g4 = g->v[4];
+    UINT64 g1_19 = 19 * g1, g2_19 = 19 * g2, g3_19 = 19 * g3, g4_19 = 19 * g4;
+    UINT128 r0, r1, r2, r3, r4;
+    UINT64 c;
+
+    r0 = (UINT128)f0 * g0 + (UINT128)f1 * g4_19 + (UINT128)f2 * g3_19 +
+         (UINT128)f3 * g2_19 + (UINT128)f4 * g1_19;
+    r1 = (UINT128)f0 * g1 + (UINT128)f1 * g0 + (UINT128)f2 * g4_19 +
+         (UINT128)f3 * g3_19 + (UINT128)f4 * g2_19;
+    r2 = (UINT128)f0 * g2 + (UINT128)f1 * g1 + (UINT128)f2 * g0 +
+         (UINT128)f3 * g4_19 + (UINT128)f4 * g3_19;
+    r3 = (UINT128)f0 * g3 + (UINT128)f1 * g2 + (UINT128)f2 * g1 +
+         (UINT128)f3 * g0 + (UINT128)f4 * g4_19;
+    r4 = (UINT128)f0 * g4 + (UINT128)f1 * g3 + (UINT128)f2 * g2 +
+         (UINT128)f3 * g1 + (UINT128)f4 * g0;
+
+    r1 += (UINT64)(r0 >> 51);
+    r2 += (UINT64)(r1 >> 51);
+    r3 += (UINT64)(r2 >> 51);
+    r4 += (UINT64)(r3 >> 51);
+    c = (UINT64)(r4 >> 51);
+    h->v[0] = ((UINT64)r0 & MASK51) + 19 * c;
+    h->v[1] = (UINT64)r1 & MASK51;
+    h->v[2] = (UINT64)r2 & MASK51;
+    h->v[3] = (UINT64)r3 & MASK51;
+    h->v[4] = (UINT64)r4 & MASK51;
+    h->v[1] += h->v[0] >> 51;
+    h->v[0] &= MASK51;
+}
+
+/*
+ * h = f^e for a little-endian 256-bit exponent
+ */
+static VOID FePow(FE *h, CONST FE *f, CONST UINT8 *e)
+{
+    FE r, b = *f;
+    INTN i;
+
+    FeSet(&r, 1);
+    for (i = 255; i >= 0; i--) {
+        FeMul(&r, &r, &r);
+        if ((e[i / 8] >> (i % 8)) & 1)
+            FeMul(&r, &r, &b);
+    }
+    *h = r;
+}
+
+static VOID FeFromBytes(FE *h, CONST UINT8 *s)
+{
+    UINT64 w[4];
+    UINTN i, j;
+
+    for (i = 0; i < 4; i++) {
+        w[i] = 0;
+        for (j = 0; j < 8; j++)
+            w[i] |= (UINT64)s[8 * i + j] << (8 * j);
+    }
+    h->v[0] = w[0] & MASK51;
+    h->v[1] = ((w[0] >> 51) | (w[1] << 13)) & MASK51;
+    h->v[2] = ((w[1] >> 38) | (w[2] << 26)) & MASK51;
+    h->v[3] = ((w[2] >> 25) | (w[3] << 39)) & MASK51;
+    h->v[4] = (w[3] >> 12) & MASK51;
+}
+
+/*
+ * Canonical encoding, fully reduced below p
+ */
+static VOID FeToBytes(UINT8 *s, CONST FE *f)
+{
+    FE t = *f;
+    UINT64 q, w[4];
+    UINTN i, j;
+
+    FeCarry(&t);
+    FeCarry(&t);
+    /* q = 1 if t >= p */
+    q = (t.v[0] + 19) >> 51;
+    for (i = 1; i < 5; i++)
+        q = (t.v[i] + q) >> 51;
+    t.v[0] += 19 * q;
+    for (i = 0; i < 4; i++) {
+        t.v[i + 1] += t.v[i] >> 51;
+        t.v[i] &= MASK51;
+    }
+    t.v[4] &= MASK51;
+
+    w[0] = t.v[0] | (t.v[1] << 51);
+    w[1] = (t.v[1] >> 13) | (t.v[2] << 38);
+    w[2] = (t.v[2] >> 26) | (t.v[3] << 25);
+    w[3] = (t.v[3] >> 39) | (t.v[4] << 12);
+    for (i = 0; i < 4; i++) {
+        for (j = 0; j < 8; j++)
+            s[8 * i + j] = (UINT8)(w[i] >> (8 * j));
+    }
+}
+
+static BOOLEAN FeEqual(CONST FE *f, CONST FE *g)
+{
+    UINT8 a[32], b[32];
+
+    FeToBytes(a, f);
+    FeToBytes(b, g);
+    return CompareMem(a, b, 32) == 0;
+}
+
+/*
+ * Exponents as little-endian bytes: all 0xff between the ends
+ */
+static VOID Exponent(UINT8 *e, UINT8 Low, UINT8 High)
+{
+    SetMem(e, 32, 0xff);
+    e[0] = Low;
+    e[31] = High;
+}
+
+/*
+ * Curve: -x^2 + y^2 = 1 + d x^2 y^2, points in extended coordinates
+ * (X:Y:Z:T) with x = X/Z, y = Y/Z, xy = T/Z
+ */
+typedef struct {
+    FE X, Y, Z, T;
+} POINT;
+
+static FE D, D2, SqrtM1;
+static POINT Base;
+static BOOLEAN CurveReady;
+
+static VOID PointAdd(POINT *r, CONST POINT *p, CONST POINT *q)
+{
+    FE a, b, c, d, e, f, g, h, t;
+
+    FeSub(&a, &p->Y, &p->X);
+    FeSub(&t, &q->Y, &q->X);
+    FeMul(&a, &a, &t);
+    FeAdd(&b, &p->Y, &p->X);
+    FeAdd(&t, &q->Y, &q->X);
+    FeMul(&b, &b, &t);
+    FeMul(&c, &p->T, &q->T);
+    FeMul(&c, &c, &D2);
+    FeMul(&d, &p->Z, &q->Z);
+    FeAdd(&d, &d, &d);
+    FeSub(&e, &b, &a);
+    FeSub(&f, &d, &c);
+    FeAdd(&g, &d, &c);
+    FeAdd(&h, &b, &a);
+    FeMul(&r->X, &e, &f);
+    FeMul(&r->Y, &g, &h);
+    FeMul(&r->T, &e, &h);
+    FeMul(&r->Z, &f, &g);
+}
+
+static VOID PointDouble(POINT *r, CONST POINT *p)
+{
+    FE a, b, c, e, f, g, h;
+
+    FeMul(&a, &p->X, &p->X);
+    FeMul(&b, &p->Y, &p->Y);
+    FeMul(&c, &p->Z, &p->Z);
+    FeAdd(&c, &c, &c);
+    FeAdd(&h, &a, &b);
+    FeAdd(&e, &p->X, &p->Y);
+    FeMul(&e, &e, &e);
+    FeSub(&e, &h, &e);
+    FeSub(&g, &a, &b);
+    FeAdd(&f, &c, &g);
+    FeMul(&r->X, &e, &f);
+    FeMul(&r->Y, &g, &h);
+    FeMul(&r->T, &e, &h);
+    FeMul(&r->Z, &f, &g);
+}
+
+/*
+ * Decode a point (RFC 8032 5.1.3), rejecting non-canonical y
+ */
+static BOOLEAN PointDecode(POINT *p, CONST UINT8 *s)
+{
+    UINT8 e[32], Check[32];
+    FE u, v, v3, t, x2;
+
+    FeFromBytes(&p->Y, s);
+    FeToBytes(Check, &p->Y);
+    if (CompareMem(Check, s, 31) != 0 || Check[31] != (s[31] & 0x7f))
+        return FALSE;
+
+    /* x = u v^3 (u v^7)^((p-5)/8), with u = y^2 - 1, v = d y^2 + 1 */
+    FeSet(&p->Z, 1);
+    FeMul(&u, &p->Y, &p->Y);
+    FeMul(&v, &u, &D);
+    FeSub(&u, &u, &p->Z);
+    FeAdd(&v, &v, &p->Z);
+    FeMul(&v3, &v, &v);
+    FeMul(&v3, &v3, &v);
+    FeMul(&t, &v3, &v3);
+    FeMul(&t, &t, &v);
+    FeMul(&t, &t, &u);
+    Exponent(e, 0xfd, 0x0f);
+    FePow(&t, &t, e);
+    FeMul(&t, &t, &v3);
+    FeMul(&p->X, &t, &u);
+
+    FeMul(&x2, &p->X, &p->X);
+    FeMul(&x2, &x2, &v);
+    if (!FeEqual(&x2, &u)) {
+        FeSet(&t, 0);
+        FeSub(&u, &t, &u);
+        if (!FeEqual(&x2, &u))
+            return FALSE;
+        FeMul(&p->X, &p->X, &SqrtM1);
+    }
+
+    FeToBytes(Check, &p->X);
+    if ((Check[0] & 1) != (s[31] >> 7)) {
+        FeSet(&t, 0);
+        if (FeEqual(&p->X, &t))
+            return FALSE;
+        FeSub(&p->X, &t, &p->X);
+    }
+    FeMul(&p->T, &p->X, &p->Y);
+    return TRUE;
+}
+
+static VOID PointEncode(UINT8 *s, CONST POINT *p)
+{
+    UINT8 e[32], XBytes[32];
+    FE Zi, x, y;
+
+    Exponent(e, 0xeb, 0x7f);            /* p - 2 */
+    FePow(&Zi, &p->Z, e);
+    FeMul(&x, &p->X, &Zi);
+    FeMul(&y, &p->Y, &Zi);
+    FeToBytes(s, &y);
+    FeToBytes(XBytes, &x);
+    s[31] |= (XBytes[0] & 1) << 7;
+}
+
+static BOOLEAN CurveInit(VOID)
+{
+    static CONST UINT8 BaseY[32] = {
+        0x58, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66,
+        0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66,
+    };
+    UINT8 e[32];
+    FE t;
+
+    if (CurveReady)
+        return TRUE;
+    /* d = -121665 / 121666, sqrt(-1) = 2^((p-1)/4) */
+    FeSet(&t, 121666);
+    Exponent(e, 0xeb, 0x7f);
+    FePow(&D, &t, e);
+    FeSet(&t, 121665);
+    FeMul(&D, &D, &t);
+    FeSet(&t, 0);
+    FeSub(&D, &t, &D);
+    FeAdd(&D2, &D, &D);
+    FeSet(&t, 2);
+    Exponent(e, 0xfb, 0x1f);
+    FePow(&SqrtM1, &t, e);
+    CurveReady = PointDecode(&Base, BaseY);
+    return CurveReady;
+}
+
+/*
+ * Scalars modulo the group order L = 2^252 + 27742317777372353535851937790883648493
+ */
+static CONST UINT64 L[4] = {
+    0x5812631a5cf5d3edULL, 0x14def9dea2f79cd6ULL, 0, 0x1000000000000000ULL,
+};
+
+static BOOLEAN ScalarBelowL(CONST UINT64 *s)
+{
+    INTN i;
+
+    for (i = 3; i >= 0; i--) {
+        if (s[i] != L[i])
+            return s[i] < L[i];
+    }
+    return FALSE;
+}
+
+static VOID ScalarSubL(UINT64 *s)
+{
+    UINT64 Borrow = 0, t;
+    UINTN i;
+
+    for (i = 0; i < 4; i++) {
+        t = s[i] - L[i] - Borrow;
+        Borrow = s[i] < L[i] + Borrow;      /* No L[i] is all ones */
+        s[i] = t;
+    }
+}
+
+static VOID ScalarFromBytes(UINT64 *s, CONST UINT8 *b)
+{
+    UINTN i, j;
+
+    for (i = 0; i < 4; i++) {
+        s[i] = 0;
+        for (j = 0; j < 8; j++)
+            s[i] |= (UINT64)b[8 * i + j] << (8 * j);
+    }
+}
+
+/*
+ * Reduce a 512-bit little-endian value modulo L, one bit at a time.
+ * Once per signature, so simplicity wins over speed.
+ */
+static VOID ScalarReduce(UINT64 *s, CONST UINT8 *b)
+{
+    INTN i;
+
+    s[0] = s[1] = s[2] = s[3] = 0;
+    for (i = 511; i >= 0; i--) {
+        s[3] = (s[3] << 1) | (s[2] >> 63);
+        s[2] = (s[2] << 1) | (s[1] >> 63);
+        s[1] = (s[1] << 1) | (s[0] >> 63);
+        s[0] = (s[0] << 1) | ((b[i / 8] >> (i % 8)) & 1);
+        if (!ScalarBelowL(s))
+            ScalarSubL(s);
+    }
+}
+
+/*
+ * Check Sig over Msg against the 32-byte PublicKey
+ */
+BOOLEAN Ed25519Verify(CONST UINT8 *PublicKey, CONST UINT8 *Sig,
+                      CONST VOID *Msg, UINTN MsgLen)
+{
+    SHA512_CTX Ctx;
+    UINT8 Hash[64], Check[32];
+    UINT64 S[4], K[4];
+    POINT A, BA, R;
+    FE Zero;
+    INTN i;
+
+    if (!CurveInit() || !PointDecode(&A, PublicKey))
+        return FALSE;
+    ScalarFromBytes(S, Sig + 32);
+    if (!ScalarBelowL(S))
+        return FALSE;
+
+    Sha512Init(&Ctx);
+    Sha512Update(&Ctx, Sig, 32);
+    Sha512Update(&Ctx, PublicKey, 32);
+    Sha512Update(&Ctx, Msg, MsgLen);
+    Sha512Final(&Ctx, Hash);
+    ScalarReduce(K, Hash);
+
+    /* R = [S]B - [k]A, both scalars walked together */
+    FeSet(&Zero, 0);
+    FeSub(&A.X, &Zero, &A.X);
+    FeSub(&A.T, &Zero, &A.T);
+    PointAdd(&BA, &Base, &A);
+    FeSet(&R.X, 0);
+    FeSet(&R.Y, 1);
+    FeSet(&R.Z, 1);
+    FeSet(&R.T, 0);
+    for (i = 252; i >= 0; i--) {
+        UINTN Bits = ((S[i / 64] >> (i % 64)) & 1) | (((K[i / 64] >> (i % 64)) & 1) << 1);
+
+        PointDouble(&R, &R);
+        if (Bits == 1)
+            PointAdd(&R, &R, &Base);
+        else if (Bits == 2)
+            PointAdd(&R, &R, &A);
+        else if (Bits == 3)
+            PointAdd(&R, &R, &BA);
+    }
+    PointEncode(Check, &R);
+    return CompareMem(Check, Sig, 32) == 0;
+}
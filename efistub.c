@@ -0,0 +1,222 @@
+/*
+ * Linux EFI stub handoff
+ *
+ * Kernels built with CONFIG_EFI_STUB are PE/COFF images behind a
+ * RISC-V Image header. They are started through the firmware's
+ * LoadImage/StartImage from the buffer the loader already read, and
+ * an initrd is offered to them through the LINUX_EFI_INITRD_MEDIA
+ * LoadFile2 protocol, so neither file is read twice.
+ */
+
+#include "loader.h"
+
+/* EFI_LOAD_FILE2_PROTOCOL_GUID */
+static EFI_GUID LoadFile2ProtocolGuid = {
+    0x4006c0c1, 0xfcb3, 0x403e,
+    {0x99, 0x6d, 0x4a, 0x6c, 0x87, 0x24, 0xe0, 0x6d}
+};
+
+typedef struct _INITRD_LOAD_FILE2 {
+    EFI_STATUS (EFIAPI *LoadFile)(struct _INITRD_LOAD_FILE2 *This,
+                                  EFI_DEVICE_PATH *FilePath, BOOLEAN BootPolicy,
+                                  UINTN *BufferSize, VOID *Buffer);
+} INITRD_LOAD_FILE2;
+
+/* Vendor media node (LINUX_EFI_INITRD_MEDIA_GUID) followed by an end node */
+typedef struct {
+    UINT8 Type;
+    UINT8 SubType;
+    UINT8 Length[2];
+    EFI_GUID Guid;
+    UINT8 EndType;
+    UINT8 EndSubType;
+    UINT8 EndLength[2];
+} __attribute__((packed)) INITRD_DEVICE_PATH;
+
+static INITRD_DEVICE_PATH InitrdDevicePath = {
+    MEDIA_DEVICE_PATH, 3, { 20, 0 },
+    { 0x5568e427, 0x68fc, 0x4f3d,
+      {0xac, 0x74, 0xca, 0x55, 0x52, 0x31, 0xcc, 0x68} },
+    END_DEVICE_PATH_TYPE, 0xff, { 4, 0 }
+};
+
+static PAYLOAD *InitrdPayload;
+static EFI_HANDLE InitrdHandle;
+
+/*
+ * Check for a RISC-V Linux Image header
+ */
+BOOLEAN IsRiscvImage(RISCV_IMAGE_HEADER *Hdr, UINTN Size)
+{
+    return Size >= sizeof(*Hdr) && Hdr->magic2 == RISCV_IMAGE_MAGIC2;
+}
+
+/*
+ * Check whether the kernel is an EFI stub image: an Image header
+ * whose code0 starts with "MZ" and whose res3 points at a PE header
+ */
+BOOLEAN IsEfiStubImage(RISCV_IMAGE_HEADER *Hdr, UINTN Size, VOID *Buffer)
+{
+    UINT32 PeOffset;
+
+    if (!IsRiscvImage(Hdr, Size) || (Hdr->code0 & 0xffff) != PE_DOS_MAGIC)
+        return FALSE;
+
+    /* Only validate the PE signature if it has been read already */
+    PeOffset = Hdr->res3;
+    if (Buffer && Size >= 4 && PeOffset <= Size - 4)
+        return *(UINT32 *)((UINT8 *)Buffer + PeOffset) == PE_NT_MAGIC;
+    return TRUE;
+}
+
+/*
+ * LoadFile2 for the initrd: copy it out of the buffer it was read into
+ */
+static EFI_STATUS EFIAPI InitrdLoadFile(INITRD_LOAD_FILE2 *This,
+                                        EFI_DEVICE_PATH *FilePath, BOOLEAN BootPolicy,
+                                        UINTN *BufferSize, VOID *Buffer)
+{
+    (VOID)This;
+    (VOID)FilePath;
+
+    if (BootPolicy)
+        return EFI_UNSUPPORTED;
+    if (!BufferSize)
+        return EFI_INVALID_PARAMETER;
+    if (!Buffer || *BufferSize < InitrdPayload->Size) {
+        *BufferSize = InitrdPayload->Size;
+        return EFI_BUFFER_TOO_SMALL;
+    }
+    CopyMem(Buffer, (VOID *)InitrdPayload->Addr, InitrdPayload->Size);
+    *BufferSize = InitrdPayload->Size;
+    return EFI_SUCCESS;
+}
+
+static INITRD_LOAD_FILE2 InitrdLoadFile2 = { InitrdLoadFile };
+
+static EFI_STATUS InstallInitrd(PAYLOAD *Initrd)
+{
+    EFI_HANDLE Handle = NULL;
+    EFI_STATUS status;
+
+    InitrdPayload = Initrd;
+    status = BS->InstallProtocolInterface(&Handle, &gEfiDevicePathProtocolGuid,
+                                          EFI_NATIVE_INTERFACE, &InitrdDevicePath);
+    if (EFI_ERROR(status))
+        return status;
+    status = BS->InstallProtocolInterface(&Handle, &LoadFile2ProtocolGuid,
+                                          EFI_NATIVE_INTERFACE, &InitrdLoadFile2);
+    if (EFI_ERROR(status)) {
+        BS->UninstallProtocolInterface(Handle, &gEfiDevicePathProtocolGuid, &InitrdDevicePath);
+        return status;
+    }
+    InitrdHandle = Handle;
+    return EFI_SUCCESS;
+}
+
+/*
+ * Take the initrd handle down again once the stub path has given up,
+ * so nothing finds it pointing at a buffer that is about to be freed
+ */
+static VOID UninstallInitrd(VOID)
+{
+    if (!InitrdHandle)
+        return;
+    BS->UninstallProtocolInterface(InitrdHandle, &LoadFile2ProtocolGuid, &InitrdLoadFile2);
+    BS->UninstallProtocolInterface(InitrdHandle, &gEfiDevicePathProtocolGuid, &InitrdDevicePath);
+    InitrdHandle = NULL;
+    InitrdPayload = NULL;
+}
+
+/*
+ * Hand an EFI stub kernel to the firmware image loader.
+ *
+ * The image is already in memory, so LoadImage is given it as the
+ * SourceBuffer and the file is never read a second time. The entry's
+ * command line, or failing that the loader's own LoadOptions, become
+ * the kernel's. Path is NULL for raw partition kernels. A kernel with
+ * no pages of its own lives in a unified kernel image and is left
+ * alone; otherwise the staging buffer is freed whether or not the
+ * kernel starts. Only returns on failure, with the initrd handle
+ * uninstalled again.
+ */
+EFI_STATUS BootEfiStub(EFI_HANDLE ImageHandle, EFI_LOADED_IMAGE *LoadedImage,
+                       CHAR16 *Path, PAYLOAD *Kernel, PAYLOAD *Initrd,
+                       CONST CHAR8 *Cmdline)
+{
+    EFI_STATUS status;
+    EFI_DEVICE_PATH *FilePath;
+    EFI_HANDLE KernelHandle;
+    EFI_LOADED_IMAGE *KernelImage;
+    UINTN ExitDataSize = 0;
+    CHAR16 *ExitData = NULL;
+    CHAR16 *Options = NULL;
+    UINTN Len;
+
+    if (Initrd) {
+        LogPrint(L"Registering initrd for EFI stub... ");
+        status = InstallInitrd(Initrd);
+        if (EFI_ERROR(status)) {
+            LogPrint(L"FAILED: %r\r\n", status);
+            goto out;
+        }
+        LogPrint(L"OK\r\n");
+    }
+
+    LogPrint(L"Loading EFI stub kernel... ");
+    FilePath = Path ? FileDevicePath(LoadedImage->DeviceHandle, Path) : NULL;
+    status = BS->LoadImage(FALSE, ImageHandle, FilePath, (VOID *)Kernel->Addr,
+                           Kernel->Size, &KernelHandle);
+    if (FilePath)
+        FreePool(FilePath);
+    if (EFI_ERROR(status)) {
+        LogPrint(L"FAILED: %r\r\n", status);
+        goto out;
+    }
+
+    status = BS->HandleProtocol(KernelHandle, &gEfiLoadedImageProtocolGuid,
+                                (VOID **)&KernelImage);
+    if (EFI_ERROR(status)) {
+        LogPrint(L"FAILED: %r\r\n", status);
+        BS->UnloadImage(KernelHandle);
+        goto out;
+    }
+    if (Cmdline) {
+        for (Len = 0; Cmdline[Len]; Len++)
+            ;
+        Options = AllocatePool((Len + 1) * sizeof(CHAR16));
+        if (Options) {
+            AsciiToUnicode(Options, Cmdline, Len + 1);
+            KernelImage->LoadOptions = Options;
+            KernelImage->LoadOptionsSize = (Len + 1) * sizeof(CHAR16);
+        }
+    } else {
+        KernelImage->LoadOptions = LoadedImage->LoadOptions;
+        KernelImage->LoadOptionsSize = LoadedImage->LoadOptionsSize;
+    }
+    LogPrint(L"OK at 0x%lx\r\n", (UINT64)KernelImage->ImageBase);
+
+    /* LoadImage made its own copy; the staging buffer is no longer needed */
+    if (Kernel->Pages)
+        BS->FreePages(Kernel->Addr, Kernel->Pages);
+    Kernel->Pages = 0;
+
+    LogPrint(L"Starting EFI stub kernel...\r\n");
+    ProfReport();
+    LogHandover();
+    status = BS->StartImage(KernelHandle, &ExitDataSize, &ExitData);
+    LogPrint(L"Kernel returned: %r\r\n", status);
+    if (ExitData)
+        FreePool(ExitData);
+    if (Options)
+        FreePool(Options);
+    if (!EFI_ERROR(status))
+        status = EFI_LOAD_ERROR;
+
+out:
+    UninstallInitrd();
+    if (Kernel->Pages)
+        BS->FreePages(Kernel->Addr, Kernel->Pages);
+    Kernel->Pages = 0;
+    return status;
+}
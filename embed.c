@@ -0,0 +1,103 @@
+/*
+ * Payloads built into the loader
+ *
+ * For appliances that always boot the same kernel, the Makefile can
+ * link it into the loader itself, gzipped, with an optional initrd,
+ * device tree and command line (EMBED_KERNEL, EMBED_INITRD, EMBED_DTB,
+ * EMBED_CMDLINE). Firmware loads them along with the loader, so the
+ * boot needs no file system at all: the loader uses them where they
+ * are, as the sections of a unified kernel image (see uki.c).
+ *
+ * They are placed in .data because the PE header that crt0 provides
+ * only describes .text and .data; anything outside them would not be
+ * loaded by the firmware.
+ */
+
+#include "loader.h"
+
+#ifdef EMBED_KERNEL_FILE
+
+/* Name[] to NameEnd[] holds File, from the image's .data */
+#define EMBED(Name, File)                                       \
+    __asm__(".pushsection .data.embed, \"aw\"\n"                \
+            ".balign 16\n"                                      \
+            ".globl " #Name "\n.hidden " #Name "\n"             \
+            ".globl " #Name "End\n.hidden " #Name "End\n"       \
+            #Name ":\n"                                         \
+            ".incbin \"" File "\"\n"                            \
+            #Name "End:\n"                                      \
+            ".popsection\n");                                   \
+    extern CONST UINT8 Name[] __attribute__((visibility("hidden")));      \
+    extern CONST UINT8 Name##End[] __attribute__((visibility("hidden")))
+
+EMBED(EmbeddedKernel, EMBED_KERNEL_FILE);
+#ifdef EMBED_INITRD_FILE
+EMBED(EmbeddedInitrd, EMBED_INITRD_FILE);
+#endif
+#ifdef EMBED_DTB_FILE
+EMBED(EmbeddedDtb, EMBED_DTB_FILE);
+#endif
+#ifdef EMBED_CMDLINE
+static CONST CHAR8 EmbeddedCmdline[] = EMBED_CMDLINE;
+#endif
+
+static VOID SetSection(PAYLOAD *Section, CONST UINT8 *Start, CONST UINT8 *End)
+{
+    Section->Addr = (EFI_PHYSICAL_ADDRESS)(UINTN)Start;
+    Section->Size = End - Start;
+    Section->Pages = 0;
+}
+
+/*
+ * Describe the embedded payloads as UKI sections. The kernel and
+ * initrd stay compressed: the kernel is decompressed to its load
+ * address like any gzipped kernel, and Linux unpacks a compressed
+ * initramfs itself. A gzipped device tree gets pages of its own.
+ */
+EFI_STATUS EmbedOpen(PAYLOAD *Sections)
+{
+    PAYLOAD *Dtb = &Sections[UKI_DTB];
+    EFI_PHYSICAL_ADDRESS Addr;
+    EFI_STATUS status;
+    UINTN Size, Pages;
+
+    ZeroMem(Sections, UKI_SECTIONS * sizeof(PAYLOAD));
+    SetSection(&Sections[UKI_LINUX], EmbeddedKernel, EmbeddedKernelEnd);
+#ifdef EMBED_INITRD_FILE
+    SetSection(&Sections[UKI_INITRD], EmbeddedInitrd, EmbeddedInitrdEnd);
+#endif
+#ifdef EMBED_CMDLINE
+    SetSection(&Sections[UKI_CMDLINE], EmbeddedCmdline,
+               EmbeddedCmdline + sizeof(EmbeddedCmdline) - 1);
+#endif
+#ifdef EMBED_DTB_FILE
+    SetSection(Dtb, EmbeddedDtb, EmbeddedDtbEnd);
+#endif
+    if (!Dtb->Size || !IsGzip((VOID *)Dtb->Addr, Dtb->Size))
+        return EFI_SUCCESS;
+
+    Size = GzipOriginalSize((VOID *)Dtb->Addr, Dtb->Size);
+    Pages = EFI_SIZE_TO_PAGES(Size);
+    status = BS->AllocatePages(AllocateAnyPages, EfiLoaderData, Pages, &Addr);
+    if (EFI_ERROR(status))
+        return status;
+    status = GzipDecompress((VOID *)Dtb->Addr, Dtb->Size, (VOID *)Addr, Size, &Size);
+    if (EFI_ERROR(status)) {
+        BS->FreePages(Addr, Pages);
+        return status;
+    }
+    Dtb->Addr = Addr;
+    Dtb->Size = Size;
+    Dtb->Pages = Pages;
+    return EFI_SUCCESS;
+}
+
+#else
+
+EFI_STATUS EmbedOpen(PAYLOAD *Sections)
+{
+    (VOID)Sections;
+    return EFI_NOT_FOUND;
+}
+
+#endif /* EMBED_KERNEL_FILE */
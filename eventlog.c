@@ -0,0 +1,160 @@
+/*
+ * Boot event log
+ *
+ * Records the SHA-256 of everything the loader hands to the kernel, in
+ * the TCG crypto-agile event log format (TCG PC Client Platform
+ * Firmware Profile, section 10), so attestation tools can use it as
+ * is. Files go in PCR 9 and the command line in PCR 8, as with GRUB.
+ * No TPM is involved: the log records measurements, it does not
+ * extend PCRs.
+ *
+ * The log lives in a buffer allocated once, as EfiACPIReclaimMemory so
+ * an OS booted through EFI keeps it. It is published from the start as
+ * a configuration table (LOADER_EVENT_LOG), whose Size follows the
+ * events as they are appended, and for flat kernels through /chosen.
+ */
+
+#include "loader.h"
+
+#define EV_NO_ACTION       0x00000003
+#define EV_IPL             0x0000000d
+#define TPM_ALG_SHA256     0x000b
+
+/* PCRIndex, EventType, digest count, algorithm, digest, EventSize */
+#define EVENT2_HEADER_SIZE (4 + 4 + 4 + 2 + SHA256_DIGEST_SIZE + 4)
+
+/* {b2c8a9f6-4c1d-4f0e-9a57-31e1d4a3c0e7} */
+EFI_GUID LoaderEventLogGuid = {
+    0xb2c8a9f6, 0x4c1d, 0x4f0e, { 0x9a, 0x57, 0x31, 0xe1, 0xd4, 0xa3, 0xc0, 0xe7 }
+};
+
+static LOADER_EVENT_LOG *Log;
+
+static UINT8 *Put(UINT8 *p, UINT64 Val, UINTN Size)
+{
+    UINTN i;
+
+    for (i = 0; i < Size; i++)
+        p[i] = (UINT8)(Val >> (8 * i));
+    return p + Size;
+}
+
+/*
+ * Allocate the log, write its Spec ID header event and install it as
+ * a configuration table
+ */
+EFI_STATUS EventLogInit(VOID)
+{
+    static CONST CHAR8 Signature[16] = "Spec ID Event03";
+    EFI_PHYSICAL_ADDRESS Addr;
+    EFI_STATUS status;
+    UINT8 *p;
+
+    status = BS->AllocatePages(AllocateAnyPages, EfiACPIReclaimMemory,
+                               EFI_SIZE_TO_PAGES(EVENT_LOG_SIZE), &Addr);
+    if (EFI_ERROR(status))
+        return status;
+    Log = (LOADER_EVENT_LOG *)Addr;
+    ZeroMem(Log, EVENT_LOG_SIZE);
+    Log->Version = EVENT_LOG_VERSION;
+
+    /* Header event, in the SHA-1 event format: TCG_EfiSpecIDEvent */
+    p = Put(Log->Events, 0, 4);             /* PCRIndex */
+    p = Put(p, EV_NO_ACTION, 4);
+    p += 20;                                /* Digest */
+    p = Put(p, 33, 4);                      /* EventSize */
+    CopyMem(p, (VOID *)Signature, sizeof(Signature));
+    p += sizeof(Signature);
+    p = Put(p, 0, 4);                       /* platformClass */
+    p = Put(p, 0, 1);                       /* specVersionMinor */
+    p = Put(p, 2, 1);                       /* specVersionMajor */
+    p = Put(p, 0, 1);                       /* specErrata */
+    p = Put(p, 2, 1);                       /* uintnSize: 64-bit */
+    p = Put(p, 1, 4);                       /* numberOfAlgorithms */
+    p = Put(p, TPM_ALG_SHA256, 2);
+    p = Put(p, SHA256_DIGEST_SIZE, 2);
+    p = Put(p, 0, 1);                       /* vendorInfoSize */
+    Log->Size = p - Log->Events;
+
+    status = BS->InstallConfigurationTable(&LoaderEventLogGuid, Log);
+    if (EFI_ERROR(status)) {
+        BS->FreePages(Addr, EFI_SIZE_TO_PAGES(EVENT_LOG_SIZE));
+        Log = NULL;
+    }
+    return status;
+}
+
+/*
+ * Bytes an event with DataSize bytes of event data takes in the log
+ */
+UINTN EventLogEntrySize(UINTN DataSize)
+{
+    return EVENT2_HEADER_SIZE + DataSize;
+}
+
+/*
+ * Append an EV_IPL event. Data describes what was measured.
+ */
+EFI_STATUS EventLogAppend(UINT32 Pcr, CONST UINT8 *Digest, CONST VOID *Data, UINTN DataSize)
+{
+    UINT8 *p;
+
+    if (!Log)
+        return EFI_NOT_READY;
+    if (Log->Size + EventLogEntrySize(DataSize) > EVENT_LOG_SIZE - sizeof(*Log))
+        return EFI_BUFFER_TOO_SMALL;
+
+    p = Put(Log->Events + Log->Size, Pcr, 4);
+    p = Put(p, EV_IPL, 4);
+    p = Put(p, 1, 4);                       /* Digest count */
+    p = Put(p, TPM_ALG_SHA256, 2);
+    CopyMem(p, (VOID *)Digest, SHA256_DIGEST_SIZE);
+    p += SHA256_DIGEST_SIZE;
+    p = Put(p, DataSize, 4);
+    CopyMem(p, (VOID *)Data, DataSize);
+    Log->Size = p + DataSize - Log->Events;
+    return EFI_SUCCESS;
+}
+
+/*
+ * Hash Size bytes at Buffer and append the event for them
+ */
+EFI_STATUS EventLogMeasure(UINT32 Pcr, CONST VOID *Buffer, UINTN Size,
+                           CONST VOID *Data, UINTN DataSize)
+{
+    SHA256_CTX Ctx;
+    UINT8 Digest[SHA256_DIGEST_SIZE];
+
+    Sha256Init(&Ctx);
+    Sha256Update(&Ctx, Buffer, Size);
+    Sha256Final(&Ctx, Digest);
+    return EventLogAppend(Pcr, Digest, Data, DataSize);
+}
+
+/*
+ * Point a flat kernel's device tree at the log: /chosen/linux,sml-base
+ * and linux,sml-size, as in the TPM event log binding, and a
+ * /memreserve/ entry for its pages. The published size covers the
+ * events so far plus Pending bytes of events still to be appended,
+ * such as the measurement of this device tree itself.
+ */
+EFI_STATUS EventLogPublish(VOID *Fdt, UINTN Pending)
+{
+    EFI_STATUS status;
+    UINT32 Size;
+    INTN Chosen;
+
+    if (!Log)
+        return EFI_NOT_READY;
+    Chosen = FdtChosen(Fdt);
+    if (Chosen < 0)
+        return EFI_NOT_FOUND;
+
+    Size = cpu_to_fdt32((UINT32)(Log->Size + Pending));
+    status = FdtSetPropU64(Fdt, Chosen, "linux,sml-base", (UINT64)Log->Events);
+    if (!EFI_ERROR(status))
+        status = FdtSetProp(Fdt, Chosen, "linux,sml-size", &Size, sizeof(Size));
+    if (!EFI_ERROR(status))
+        status = FdtAddMemReserve(Fdt, (UINT64)Log, EVENT_LOG_SIZE);
+    return status;
+}
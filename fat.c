@@ -0,0 +1,412 @@
+/*
+ * Direct FAT32 reader
+ *
+ * A minimal read-only FAT32 implementation on top of the boot
+ * partition's BlockIo. A file's cluster chain is walked once and
+ * collapsed into a list of contiguous extents; reads are then issued
+ * as one ReadBlocks per extent, straight into the destination buffer
+ * (see blockio.c).
+ *
+ * This avoids the firmware FAT driver, which on some EDK2 builds walks
+ * the chain per request and copies through its own cache.
+ */
+
+#include "loader.h"
+
+#define FAT_DIRENT_SIZE    32
+#define FAT_ATTR_LFN       0x0f
+#define FAT_LFN_ENTRIES    20             /* 13 characters each, up to 255 */
+#define FAT_ATTR_DIRECTORY 0x10
+#define FAT_ATTR_VOLUME_ID 0x08
+#define FAT32_EOC          0x0ffffff8
+#define FAT32_MASK         0x0fffffff
+#define FAT_CACHE_SIZE     0x4000
+
+#define LE16(p)            ((UINT16)((p)[0] | ((p)[1] << 8)))
+#define LE32(p)            ((UINT32)LE16(p) | ((UINT32)LE16((p) + 2) << 16))
+
+/* One window of the FAT, to walk chains without a read per entry */
+static UINT8 FatCache[FAT_CACHE_SIZE];
+static UINT64 FatCacheOffset = (UINT64)-1;
+static FAT_VOLUME *FatCacheVolume;
+
+static UINT64 ClusterOffset(FAT_VOLUME *Vol, UINT32 Cluster)
+{
+    return Vol->DataOffset + (UINT64)(Cluster - 2) * Vol->ClusterSize;
+}
+
+static EFI_STATUS NextCluster(FAT_VOLUME *Vol, UINT32 Cluster, UINT32 *Next)
+{
+    EFI_STATUS status;
+    UINT64 Offset = Vol->FatOffset + (UINT64)Cluster * 4;
+    UINT64 Window = Offset & ~(UINT64)(FAT_CACHE_SIZE - 1);
+
+    if (FatCacheVolume != Vol || FatCacheOffset != Window) {
+        status = BlockRead(&Vol->Dev, Window, FatCache, FAT_CACHE_SIZE);
+        if (EFI_ERROR(status)) {
+            FatCacheVolume = NULL;
+            return status;
+        }
+        FatCacheVolume = Vol;
+        FatCacheOffset = Window;
+    }
+    *Next = LE32(&FatCache[Offset - Window]) & FAT32_MASK;
+    return EFI_SUCCESS;
+}
+
+static BOOLEAN ValidCluster(FAT_VOLUME *Vol, UINT32 Cluster)
+{
+    return Cluster >= 2 && Cluster < Vol->ClusterCount + 2;
+}
+
+/*
+ * Open the FAT32 file system on a partition through BlockIo
+ */
+EFI_STATUS FatOpenVolume(EFI_HANDLE Device, FAT_VOLUME *Vol)
+{
+    EFI_STATUS status;
+    EFI_BLOCK_IO *BlockIo;
+    UINT8 *Bpb;
+    UINT32 BytesPerSector, SectorsPerCluster, Reserved, NumFats;
+    UINT32 TotalSectors, FatSectors;
+    UINT64 MetaSectors;
+
+    ZeroMem(Vol, sizeof(*Vol));
+    status = BS->HandleProtocol(Device, &gEfiBlockIoProtocolGuid, (VOID **)&BlockIo);
+    if (EFI_ERROR(status))
+        return status;
+    status = BlockOpen(BlockIo, 0, &Vol->Dev);
+    if (EFI_ERROR(status))
+        return status;
+    BlockOpenQueue(&Vol->Dev, Device);
+    IoTuneOpen(&Vol->Dev, Device);
+
+    Bpb = Vol->Dev.Bounce;
+    status = PROF_CALL(PROF_READ_BLOCKS, Vol->Dev.BlockSize,
+                       BlockIo->ReadBlocks(BlockIo, Vol->Dev.MediaId, 0, Vol->Dev.BlockSize, Bpb));
+    if (EFI_ERROR(status))
+        goto fail;
+
+    BytesPerSector = LE16(Bpb + 11);
+    SectorsPerCluster = Bpb[13];
+    Reserved = LE16(Bpb + 14);
+    NumFats = Bpb[16];
+    TotalSectors = LE16(Bpb + 19) ? LE16(Bpb + 19) : LE32(Bpb + 32);
+    FatSectors = LE16(Bpb + 22) ? LE16(Bpb + 22) : LE32(Bpb + 36);
+
+    status = EFI_UNSUPPORTED;
+    if (Bpb[510] != 0x55 || Bpb[511] != 0xaa || BytesPerSector < 512 ||
+        (BytesPerSector & (BytesPerSector - 1)) || SectorsPerCluster == 0 ||
+        NumFats == 0 || LE16(Bpb + 17) != 0 || LE16(Bpb + 22) != 0)
+        goto fail;
+
+    /*
+     * A BPB whose FATs leave no room for data, or whose FAT is too
+     * short for its clusters, is left to the firmware's driver
+     */
+    MetaSectors = Reserved + (UINT64)NumFats * FatSectors;
+    if (MetaSectors >= TotalSectors)
+        goto fail;
+    Vol->ClusterCount = (TotalSectors - (UINT32)MetaSectors) / SectorsPerCluster;
+    if (Vol->ClusterCount < 65525 ||        /* FAT12/16 */
+        (UINT64)FatSectors * BytesPerSector / 4 < (UINT64)Vol->ClusterCount + 2)
+        goto fail;
+
+    Vol->ClusterSize = BytesPerSector * SectorsPerCluster;
+    Vol->FatOffset = (UINT64)Reserved * BytesPerSector;
+    Vol->DataOffset = Vol->FatOffset + (UINT64)NumFats * FatSectors * BytesPerSector;
+    Vol->RootCluster = LE32(Bpb + 44);
+    if (!ValidCluster(Vol, Vol->RootCluster))
+        goto fail;
+    return EFI_SUCCESS;
+
+fail:
+    BlockClose(&Vol->Dev);
+    return status;
+}
+
+static CHAR16 ToUpper(CHAR16 c)
+{
+    return (c >= 'a' && c <= 'z') ? c - 'a' + 'A' : c;
+}
+
+static BOOLEAN NameEq(CONST CHAR16 *a, UINTN Len, CONST CHAR16 *b)
+{
+    UINTN i;
+
+    for (i = 0; i < Len; i++) {
+        if (ToUpper(a[i]) != ToUpper(b[i]))
+            return FALSE;
+    }
+    return b[Len] == 0;
+}
+
+/*
+ * Format an 8.3 directory entry name as "NAME.EXT"
+ */
+static VOID ShortName(CONST UINT8 *Ent, CHAR16 *Name)
+{
+    UINTN i, n = 0;
+
+    for (i = 0; i < 8 && Ent[i] != ' '; i++)
+        Name[n++] = Ent[i];
+    if (Ent[8] != ' ') {
+        Name[n++] = '.';
+        for (i = 8; i < 11 && Ent[i] != ' '; i++)
+            Name[n++] = Ent[i];
+    }
+    Name[n] = 0;
+}
+
+/*
+ * Checksum of an 8.3 name, as stored in each of its LFN entries
+ */
+static UINT8 LfnChecksum(CONST UINT8 *Ent)
+{
+    UINT8 Sum = 0;
+    UINTN i;
+
+    for (i = 0; i < 11; i++)
+        Sum = (UINT8)(((Sum & 1) << 7) + (Sum >> 1) + Ent[i]);
+    return Sum;
+}
+
+/*
+ * Search one directory for a path component. Long names are
+ * assembled from the LFN entries preceding each short entry; a long
+ * name only counts if its entries come in order, down to the first,
+ * and carry the checksum of the short entry that follows them.
+ */
+static EFI_STATUS FindInDirectory(FAT_VOLUME *Vol, UINT32 Cluster,
+                                  CONST CHAR16 *Name, UINTN NameLen,
+                                  UINT8 *Dirent, UINT64 *DirentOffset)
+{
+    EFI_STATUS status;
+    UINT8 *Buf;
+    CHAR16 Long[FAT_LFN_ENTRIES * 13 + 1], Short[13];
+    BOOLEAN HaveLong = FALSE;
+    UINT8 Checksum = 0;
+    UINTN i, j, Next = 0;
+    static CONST UINT8 LfnChars[13] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+
+    Buf = AllocatePool(Vol->ClusterSize);
+    if (!Buf)
+        return EFI_OUT_OF_RESOURCES;
+
+    status = EFI_NOT_FOUND;
+    while (ValidCluster(Vol, Cluster)) {
+        if (EFI_ERROR(BlockRead(&Vol->Dev, ClusterOffset(Vol, Cluster), Buf, Vol->ClusterSize))) {
+            status = EFI_DEVICE_ERROR;
+            break;
+        }
+        for (i = 0; i < Vol->ClusterSize; i += FAT_DIRENT_SIZE) {
+            UINT8 *Ent = Buf + i;
+
+            if (Ent[0] == 0x00)
+                goto done;
+            if (Ent[0] == 0xe5) {
+                HaveLong = FALSE;
+                continue;
+            }
+            if (Ent[11] == FAT_ATTR_LFN) {
+                UINTN Seq = (Ent[0] & 0x1f) - 1;
+
+                if (Ent[0] & 0x40) {
+                    SetMem(Long, sizeof(Long), 0);
+                    HaveLong = TRUE;
+                    Checksum = Ent[13];
+                } else if (Seq + 1 != Next || Ent[13] != Checksum) {
+                    HaveLong = FALSE;
+                }
+                if (Seq >= FAT_LFN_ENTRIES)
+                    HaveLong = FALSE;
+                Next = Seq;
+                for (j = 0; HaveLong && j < 13; j++) {
+                    CHAR16 c = LE16(Ent + LfnChars[j]);
+
+                    Long[Seq * 13 + j] = c == 0xffff ? 0 : c;
+                }
+                continue;
+            }
+            if (!(Ent[11] & FAT_ATTR_VOLUME_ID)) {
+                ShortName(Ent, Short);
+                if ((HaveLong && Next == 0 && LfnChecksum(Ent) == Checksum &&
+                     NameEq(Name, NameLen, Long)) ||
+                    NameEq(Name, NameLen, Short)) {
+                    CopyMem(Dirent, Ent, FAT_DIRENT_SIZE);
+                    *DirentOffset = ClusterOffset(Vol, Cluster) + i;
+                    status = EFI_SUCCESS;
+                    goto done;
+                }
+            }
+            HaveLong = FALSE;
+        }
+        if (EFI_ERROR(NextCluster(Vol, Cluster, &Cluster))) {
+            status = EFI_DEVICE_ERROR;
+            break;
+        }
+    }
+done:
+    FreePool(Buf);
+    return status;
+}
+
+/*
+ * Collapse the file's cluster chain into contiguous extents
+ */
+static EFI_STATUS BuildExtents(FAT_VOLUME *Vol, FAT_FILE *File, UINT32 Cluster)
+{
+    EFI_STATUS status;
+    UINT64 Remaining = File->Size;
+    UINT32 Next = 0;
+
+    File->ExtentCount = 0;
+    while (Remaining > 0) {
+        FAT_EXTENT *Ext;
+        UINT64 Length = 0;
+        UINT32 Start = Cluster;
+
+        if (!ValidCluster(Vol, Cluster))
+            return EFI_VOLUME_CORRUPTED;
+        if (File->ExtentCount == FAT_MAX_EXTENTS)
+            return EFI_UNSUPPORTED;          /* Too fragmented */
+
+        /* Extend the run while the chain stays contiguous */
+        for (;;) {
+            Length += Vol->ClusterSize;
+            if (Length >= Remaining)
+                break;
+            status = NextCluster(Vol, Cluster, &Next);
+            if (EFI_ERROR(status))
+                return status;
+            if (Next != Cluster + 1)
+                break;
+            Cluster = Next;
+        }
+        if (Length > Remaining)
+            Length = Remaining;
+
+        Ext = &File->Extents[File->ExtentCount++];
+        Ext->Offset = ClusterOffset(Vol, Start);
+        Ext->Length = Length;
+        Remaining -= Length;
+        if (Remaining > 0) {
+            if (Next >= FAT32_EOC)
+                return EFI_VOLUME_CORRUPTED;
+            Cluster = Next;
+        }
+    }
+    return EFI_SUCCESS;
+}
+
+/*
+ * Resolve a path like \EFI\linux\Image to its directory entry and
+ * extent list
+ */
+EFI_STATUS FatLookup(FAT_VOLUME *Vol, CONST CHAR16 *Path, FAT_FILE *File)
+{
+    EFI_STATUS status;
+    UINT32 Cluster = Vol->RootCluster;
+    UINT8 *Dirent = File->Dirent;
+    UINTN Len;
+
+    ZeroMem(File, sizeof(*File));
+    for (;;) {
+        while (*Path == '\\' || *Path == '/')
+            Path++;
+        for (Len = 0; Path[Len] && Path[Len] != '\\' && Path[Len] != '/'; Len++)
+            ;
+        if (Len == 0)
+            return EFI_NOT_FOUND;
+
+        status = FindInDirectory(Vol, Cluster, Path, Len, Dirent, &File->DirentOffset);
+        if (EFI_ERROR(status))
+            return status;
+        Cluster = ((UINT32)LE16(Dirent + 20) << 16) | LE16(Dirent + 26);
+        Path += Len;
+        if (!*Path)
+            break;
+        if (!(Dirent[11] & FAT_ATTR_DIRECTORY))
+            return EFI_NOT_FOUND;
+    }
+    if (Dirent[11] & FAT_ATTR_DIRECTORY)
+        return EFI_NOT_FOUND;
+
+    File->Size = LE32(Dirent + 28);
+    return BuildExtents(Vol, File, Cluster);
+}
+
+/*
+ * Cheaply check that a previously resolved file is unchanged by
+ * re-reading only its directory entry (name, attributes, times,
+ * first cluster and size)
+ */
+BOOLEAN FatFileUnchanged(FAT_VOLUME *Vol, FAT_FILE *File)
+{
+    UINT8 Dirent[FAT_DIRENT_SIZE];
+
+    if (!File->ExtentCount || EFI_ERROR(BlockRead(&Vol->Dev, File->DirentOffset, Dirent, sizeof(Dirent))))
+        return FALSE;
+    return CompareMem(Dirent, File->Dirent, sizeof(Dirent)) == 0;
+}
+
+/*
+ * Read Size bytes at Offset of a file, extent by extent, handing each
+ * transfer to Sink (if set) as it lands
+ */
+EFI_STATUS FatRead(FAT_VOLUME *Vol, FAT_FILE *File, UINT64 Offset,
+                   VOID *Buffer, UINTN Size, BLOCK_SINK Sink, VOID *Context)
+{
+    EFI_STATUS status;
+    UINT8 *Dst = Buffer;
+    UINTN i;
+
+    if (Offset + Size > File->Size)
+        return EFI_END_OF_FILE;
+
+    for (i = 0; i < File->ExtentCount && Size > 0; i++) {
+        FAT_EXTENT *Ext = &File->Extents[i];
+        UINTN Chunk;
+
+        if (Offset >= Ext->Length) {
+            Offset -= Ext->Length;
+            continue;
+        }
+        Chunk = Ext->Length - Offset;
+        if (Chunk > Size)
+            Chunk = Size;
+        status = BlockReadSink(&Vol->Dev, Ext->Offset + Offset, Dst, Chunk, Sink, Context);
+        if (EFI_ERROR(status))
+            return status;
+        Dst += Chunk;
+        Size -= Chunk;
+        Offset = 0;
+    }
+    return EFI_SUCCESS;
+}
+
+/*
+ * Queue a read of up to *Size bytes of a file at Offset, as far as the
+ * extent holding Offset goes; *Size is set to what was queued
+ */
+EFI_STATUS FatReadAsync(FAT_VOLUME *Vol, FAT_FILE *File, UINT64 Offset,
+                        VOID *Buffer, UINTN *Size, BLOCK_REQUEST *Req)
+{
+    UINTN i;
+
+    if (Offset + *Size > File->Size)
+        return EFI_END_OF_FILE;
+
+    for (i = 0; i < File->ExtentCount; i++) {
+        FAT_EXTENT *Ext = &File->Extents[i];
+
+        if (Offset >= Ext->Length) {
+            Offset -= Ext->Length;
+            continue;
+        }
+        if (*Size > Ext->Length - Offset)
+            *Size = Ext->Length - Offset;
+        return BlockReadAsync(&Vol->Dev, Ext->Offset + Offset, Buffer, *Size, Req);
+    }
+    return EFI_END_OF_FILE;
+}
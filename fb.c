@@ -0,0 +1,132 @@
+/*
+ * Framebuffer handoff
+ *
+ * Firmware with a graphics console has already set a mode through the
+ * Graphics Output Protocol. The loader leaves that mode as it is and
+ * describes its framebuffer to a flat kernel with a simple-framebuffer
+ * node under /chosen, so the kernel has a console at once instead of
+ * probing and setting up the display again. The framebuffer is kept
+ * out of the kernel's memory with a /memreserve/ entry, as it may be
+ * ordinary RAM (QEMU's ramfb, for one).
+ */
+
+#include "loader.h"
+
+typedef struct {
+    UINT32 Red, Green, Blue, Reserved;
+    CONST char *Format;     /* As in the simple-framebuffer binding */
+    UINT32 Bytes;           /* Per pixel */
+} PIXEL_FORMAT;
+
+static CONST PIXEL_FORMAT Formats[] = {
+    { 0x00ff0000, 0x0000ff00, 0x000000ff, 0xff000000, "x8r8g8b8", 4 },
+    { 0x000000ff, 0x0000ff00, 0x00ff0000, 0xff000000, "x8b8g8r8", 4 },
+    { 0x0000f800, 0x000007e0, 0x0000001f, 0x00000000, "r5g6b5",   2 },
+};
+
+static CONST PIXEL_FORMAT *GetFormat(EFI_GRAPHICS_OUTPUT_MODE_INFORMATION *Info)
+{
+    UINTN i;
+
+    switch (Info->PixelFormat) {
+    case PixelBlueGreenRedReserved8BitPerColor:
+        return &Formats[0];
+    case PixelRedGreenBlueReserved8BitPerColor:
+        return &Formats[1];
+    case PixelBitMask:
+        /* The reserved bits tell 32 bpp from 24 bpp with the same colours */
+        for (i = 0; i < sizeof(Formats) / sizeof(Formats[0]); i++) {
+            if (Info->PixelInformation.RedMask == Formats[i].Red &&
+                Info->PixelInformation.GreenMask == Formats[i].Green &&
+                Info->PixelInformation.BlueMask == Formats[i].Blue &&
+                Info->PixelInformation.ReservedMask == Formats[i].Reserved)
+                return &Formats[i];
+        }
+        return NULL;
+    default:
+        return NULL;    /* Blt only: there is no framebuffer */
+    }
+}
+
+static EFI_STATUS SetU32(VOID *Fdt, INTN Node, CONST char *Name, UINT32 Val)
+{
+    Val = cpu_to_fdt32(Val);
+    return FdtSetProp(Fdt, Node, Name, &Val, sizeof(Val));
+}
+
+/*
+ * Add /chosen/framebuffer@<addr> for the current GOP mode, or bring an
+ * existing one up to date. Nothing is added without GOP or a linear
+ * framebuffer.
+ */
+EFI_STATUS FramebufferPublish(VOID *Fdt)
+{
+    EFI_GRAPHICS_OUTPUT_PROTOCOL *Gop;
+    EFI_GRAPHICS_OUTPUT_MODE_INFORMATION *Info;
+    CONST PIXEL_FORMAT *Format;
+    CONST UINT32 *Cells;
+    UINT32 Reg[4], Len, AddrCells = 2, SizeCells = 1, n = 0;
+    UINT64 Base, Size;
+    CHAR16 Wide[32];
+    char Name[32];
+    INTN Chosen, Node;
+    EFI_STATUS status;
+    UINTN i;
+
+    if (EFI_ERROR(LibLocateProtocol(&gEfiGraphicsOutputProtocolGuid, (VOID **)&Gop)) ||
+        !Gop->Mode || !Gop->Mode->Info)
+        return EFI_SUCCESS;
+    Info = Gop->Mode->Info;
+    Format = GetFormat(Info);
+    Base = Gop->Mode->FrameBufferBase;
+    Size = Gop->Mode->FrameBufferSize;
+    if (!Format || !Base || !Size)
+        return EFI_SUCCESS;
+
+    /* reg is in the root's cells, /chosen has none of its own */
+    Cells = FdtGetProp(Fdt, 0, "#address-cells", &Len);
+    if (Cells && Len == 4)
+        AddrCells = fdt32_to_cpu(*Cells);
+    Cells = FdtGetProp(Fdt, 0, "#size-cells", &Len);
+    if (Cells && Len == 4)
+        SizeCells = fdt32_to_cpu(*Cells);
+    if (AddrCells < 1 || AddrCells > 2 || SizeCells < 1 || SizeCells > 2 ||
+        (AddrCells == 1 && (Base + Size) >> 32) || (SizeCells == 1 && Size >> 32))
+        return EFI_UNSUPPORTED;
+    if (AddrCells == 2)
+        Reg[n++] = cpu_to_fdt32((UINT32)(Base >> 32));
+    Reg[n++] = cpu_to_fdt32((UINT32)Base);
+    if (SizeCells == 2)
+        Reg[n++] = cpu_to_fdt32((UINT32)(Size >> 32));
+    Reg[n++] = cpu_to_fdt32((UINT32)Size);
+
+    Chosen = FdtChosen(Fdt);
+    if (Chosen < 0)
+        return EFI_NOT_FOUND;
+    Len = SPrint(Wide, sizeof(Wide), L"framebuffer@%lx", Base);
+    for (i = 0; i <= Len; i++)
+        Name[i] = (char)Wide[i];
+    /* Firmware that hands over its own tree may have added the node already */
+    Node = FdtSubnodeOffset(Fdt, Chosen, Name);
+    if (Node < 0)
+        Node = FdtAddSubnode(Fdt, Chosen, Name);
+    if (Node < 0)
+        return EFI_BUFFER_TOO_SMALL;
+
+    status = FdtSetPropString(Fdt, Node, "compatible", (CONST CHAR8 *)"simple-framebuffer");
+    if (!EFI_ERROR(status))
+        status = FdtSetProp(Fdt, Node, "reg", Reg, n * sizeof(UINT32));
+    if (!EFI_ERROR(status))
+        status = SetU32(Fdt, Node, "width", Info->HorizontalResolution);
+    if (!EFI_ERROR(status))
+        status = SetU32(Fdt, Node, "height", Info->VerticalResolution);
+    if (!EFI_ERROR(status))
+        status = SetU32(Fdt, Node, "stride", Info->PixelsPerScanLine * Format->Bytes);
+    if (!EFI_ERROR(status))
+        status = FdtSetPropString(Fdt, Node, "format", (CONST CHAR8 *)Format->Format);
+    if (!EFI_ERROR(status))
+        status = FdtSetPropString(Fdt, Node, "status", (CONST CHAR8 *)"okay");
+    if (!EFI_ERROR(status))
+        status = FdtAddMemReserve(Fdt, Base, Size);
+    return status;
+}
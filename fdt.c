@@ -0,0 +1,675 @@
+/*
+ * Minimal flattened device tree editing
+ *
+ * Just enough of libfdt to relocate the firmware DTB into a larger
+ * buffer and add or update nodes and properties in place. The
+ * relocated blob is laid out as header, reservation map, structure
+ * block, strings block, then free space, so growing the structure
+ * block only has to move the strings.
+ */
+
+#include "loader.h"
+
+#define FDT_BEGIN_NODE     1
+#define FDT_END_NODE       2
+#define FDT_PROP           3
+#define FDT_NOP            4
+#define FDT_END            9
+
+#define FDT_ERR            (-1)
+#define FDT_ALIGN(x)       (((x) + 3) & ~3U)
+
+typedef struct {
+    UINT32 magic;
+    UINT32 totalsize;
+    UINT32 off_dt_struct;
+    UINT32 off_dt_strings;
+    UINT32 off_mem_rsvmap;
+    UINT32 version;
+    UINT32 last_comp_version;
+    UINT32 boot_cpuid_phys;
+    UINT32 size_dt_strings;
+    UINT32 size_dt_struct;
+} FDT_HEADER;
+
+#define HDR(Fdt)           ((FDT_HEADER *)(Fdt))
+#define HDR_GET(Fdt, f)    fdt32_to_cpu(HDR(Fdt)->f)
+#define HDR_SET(Fdt, f, v) (HDR(Fdt)->f = cpu_to_fdt32(v))
+
+/* Node offsets that Splice keeps pointing at their nodes */
+static INTN *Tracked;
+static UINTN TrackedCount;
+
+static UINTN AsciiLen(CONST char *s)
+{
+    UINTN n = 0;
+
+    while (s[n])
+        n++;
+    return n;
+}
+
+static UINT8 *StructPtr(VOID *Fdt, INTN Offset)
+{
+    return (UINT8 *)Fdt + HDR_GET(Fdt, off_dt_struct) + Offset;
+}
+
+static char *StringPtr(VOID *Fdt, UINT32 Offset)
+{
+    return (char *)Fdt + HDR_GET(Fdt, off_dt_strings) + Offset;
+}
+
+static UINT32 ReadBe32(VOID *Fdt, INTN Offset)
+{
+    return fdt32_to_cpu(*(UINT32 *)StructPtr(Fdt, Offset));
+}
+
+/*
+ * Get DTB size from header
+ */
+UINT32 GetDtbSize(VOID *Dtb)
+{
+    UINT32 *hdr = (UINT32 *)Dtb;
+    if (fdt32_to_cpu(hdr[0]) != FDT_MAGIC)
+        return 0;
+    return fdt32_to_cpu(hdr[1]);  /* totalsize field */
+}
+
+/*
+ * Check that a blob of Size bytes, e.g. read from a file, has a
+ * header whose blocks lie within it. What is inside the blocks is
+ * checked as it is walked: NextTag keeps to the structure block, and
+ * FdtRelocate to the space before it for the reservation map. The
+ * strings block must end in a NUL, so every name in it is terminated.
+ */
+BOOLEAN FdtCheckHeader(VOID *Fdt, UINTN Size)
+{
+    UINT32 Total;
+
+    if (Size < sizeof(FDT_HEADER))
+        return FALSE;
+    Total = GetDtbSize(Fdt);
+    return Total >= sizeof(FDT_HEADER) && Total <= Size &&
+           HDR_GET(Fdt, version) >= 17 &&
+           HDR_GET(Fdt, off_mem_rsvmap) % 8 == 0 &&
+           HDR_GET(Fdt, off_mem_rsvmap) <= Total &&
+           HDR_GET(Fdt, off_dt_struct) % 4 == 0 &&
+           HDR_GET(Fdt, off_dt_struct) <= Total &&
+           HDR_GET(Fdt, size_dt_struct) <= Total - HDR_GET(Fdt, off_dt_struct) &&
+           HDR_GET(Fdt, off_dt_strings) <= Total &&
+           HDR_GET(Fdt, size_dt_strings) <= Total - HDR_GET(Fdt, off_dt_strings) &&
+           (HDR_GET(Fdt, size_dt_strings) == 0 ||
+            *StringPtr(Fdt, HDR_GET(Fdt, size_dt_strings) - 1) == '\0');
+}
+
+/*
+ * Return the tag at Offset and the offset of the tag after it. A tag,
+ * node name or property that does not fit in the structure block, or
+ * a property name outside the strings block, ends the walk like an
+ * unknown tag does.
+ */
+static UINT32 NextTag(VOID *Fdt, INTN Offset, INTN *Next)
+{
+    UINT32 Size = HDR_GET(Fdt, size_dt_struct);
+    CONST char *Name;
+    UINT32 Tag, Len;
+    INTN Pos = Offset + 4;
+
+    *Next = FDT_ERR;
+    if (Offset < 0 || (UINT32)Pos > Size)
+        return FDT_END;
+    Tag = ReadBe32(Fdt, Offset);
+    switch (Tag) {
+    case FDT_BEGIN_NODE:
+        Name = (CONST char *)StructPtr(Fdt, Pos);
+        for (Len = 0; Len < Size - Pos && Name[Len]; Len++)
+            ;
+        if (Len == Size - Pos)
+            return FDT_END;
+        Pos += Len + 1;
+        break;
+    case FDT_PROP:
+        if (Size - Pos < 8)
+            return FDT_END;
+        Len = ReadBe32(Fdt, Pos);
+        if (Len > Size - Pos - 8 || ReadBe32(Fdt, Pos + 4) >= HDR_GET(Fdt, size_dt_strings))
+            return FDT_END;
+        Pos += 8 + Len;
+        break;
+    case FDT_END_NODE:
+    case FDT_NOP:
+    case FDT_END:
+        break;
+    default:
+        return FDT_END;
+    }
+    *Next = FDT_ALIGN(Pos);
+    return Tag;
+}
+
+/*
+ * Offset just past the node's name, where its properties start
+ */
+static INTN NodeBody(VOID *Fdt, INTN Node)
+{
+    INTN Next;
+
+    if (NextTag(Fdt, Node, &Next) != FDT_BEGIN_NODE)
+        return FDT_ERR;
+    return Next;
+}
+
+/*
+ * Offset of the first subnode or END_NODE, i.e. where a new
+ * property can be appended
+ */
+static INTN NodePropsEnd(VOID *Fdt, INTN Node)
+{
+    INTN Offset = NodeBody(Fdt, Node);
+    INTN Next;
+    UINT32 Tag;
+
+    while (Offset >= 0) {
+        Tag = NextTag(Fdt, Offset, &Next);
+        if (Tag != FDT_PROP && Tag != FDT_NOP)
+            return Offset;
+        Offset = Next;
+    }
+    return FDT_ERR;
+}
+
+/*
+ * Compare a node name against Name. A Name without a unit address
+ * also matches "name@unit".
+ */
+static BOOLEAN NodeNameEq(CONST char *NodeName, CONST char *Name, UINTN Len)
+{
+    UINTN i;
+
+    for (i = 0; i < Len; i++) {
+        if (NodeName[i] != Name[i])
+            return FALSE;
+    }
+    if (NodeName[Len] == '\0')
+        return TRUE;
+    if (NodeName[Len] == '@') {
+        for (i = 0; i < Len; i++) {
+            if (Name[i] == '@')
+                return FALSE;
+        }
+        return TRUE;
+    }
+    return FALSE;
+}
+
+static INTN SubnodeOffsetLen(VOID *Fdt, INTN Parent, CONST char *Name, UINTN Len)
+{
+    INTN Offset = NodePropsEnd(Fdt, Parent);
+    INTN Next;
+    INTN Depth = 0;
+    UINT32 Tag;
+
+    while (Offset >= 0) {
+        Tag = NextTag(Fdt, Offset, &Next);
+        switch (Tag) {
+        case FDT_BEGIN_NODE:
+            if (Depth == 0 &&
+                NodeNameEq((char *)StructPtr(Fdt, Offset + 4), Name, Len))
+                return Offset;
+            Depth++;
+            break;
+        case FDT_END_NODE:
+            if (--Depth < 0)
+                return FDT_ERR;
+            break;
+        case FDT_END:
+            return FDT_ERR;
+        }
+        Offset = Next;
+    }
+    return FDT_ERR;
+}
+
+INTN FdtSubnodeOffset(VOID *Fdt, INTN Parent, CONST char *Name)
+{
+    return SubnodeOffsetLen(Fdt, Parent, Name, AsciiLen(Name));
+}
+
+/*
+ * Iterate over the direct subnodes of a node
+ */
+INTN FdtFirstSubnode(VOID *Fdt, INTN Parent)
+{
+    INTN Offset = NodePropsEnd(Fdt, Parent);
+
+    if (Offset < 0 || ReadBe32(Fdt, Offset) != FDT_BEGIN_NODE)
+        return FDT_ERR;
+    return Offset;
+}
+
+INTN FdtNextSubnode(VOID *Fdt, INTN Node)
+{
+    INTN Offset = Node;
+    INTN Next;
+    INTN Depth = 0;
+    UINT32 Tag;
+
+    /* Skip the node and everything below it */
+    do {
+        Tag = NextTag(Fdt, Offset, &Next);
+        if (Tag == FDT_BEGIN_NODE)
+            Depth++;
+        else if (Tag == FDT_END_NODE)
+            Depth--;
+        else if (Tag == FDT_END)
+            return FDT_ERR;
+        Offset = Next;
+    } while (Depth > 0);
+
+    while ((Tag = NextTag(Fdt, Offset, &Next)) == FDT_NOP)
+        Offset = Next;
+    return Tag == FDT_BEGIN_NODE ? Offset : FDT_ERR;
+}
+
+/*
+ * Walk every node in document order: the node after Offset, with
+ * Depth adjusted by how far down or up it is
+ */
+INTN FdtNextNode(VOID *Fdt, INTN Offset, INTN *Depth)
+{
+    INTN Next;
+    UINT32 Tag;
+
+    if (NextTag(Fdt, Offset, &Next) != FDT_BEGIN_NODE)
+        return FDT_ERR;
+    Offset = Next;
+    for (;;) {
+        Tag = NextTag(Fdt, Offset, &Next);
+        switch (Tag) {
+        case FDT_BEGIN_NODE:
+            ++*Depth;
+            return Offset;
+        case FDT_END_NODE:
+            if (--*Depth < 0)
+                return FDT_ERR;
+            break;
+        case FDT_END:
+            return FDT_ERR;
+        }
+        Offset = Next;
+    }
+}
+
+CONST char *FdtGetName(VOID *Fdt, INTN Node)
+{
+    return (CONST char *)StructPtr(Fdt, Node + 4);
+}
+
+/*
+ * Iterate over the properties of a node, as offsets of their tags
+ */
+INTN FdtFirstProp(VOID *Fdt, INTN Node)
+{
+    INTN Offset = NodeBody(Fdt, Node);
+    INTN Next;
+    UINT32 Tag;
+
+    while (Offset >= 0) {
+        Tag = NextTag(Fdt, Offset, &Next);
+        if (Tag == FDT_PROP)
+            return Offset;
+        if (Tag != FDT_NOP)
+            break;
+        Offset = Next;
+    }
+    return FDT_ERR;
+}
+
+INTN FdtNextProp(VOID *Fdt, INTN Prop)
+{
+    INTN Offset, Next;
+    UINT32 Tag;
+
+    NextTag(Fdt, Prop, &Offset);
+    while (Offset >= 0) {
+        Tag = NextTag(Fdt, Offset, &Next);
+        if (Tag == FDT_PROP)
+            return Offset;
+        if (Tag != FDT_NOP)
+            break;
+        Offset = Next;
+    }
+    return FDT_ERR;
+}
+
+/*
+ * Name, length and value of the property at Prop
+ */
+VOID *FdtPropAt(VOID *Fdt, INTN Prop, CONST char **Name, UINT32 *Len)
+{
+    *Name = StringPtr(Fdt, ReadBe32(Fdt, Prop + 8));
+    *Len = ReadBe32(Fdt, Prop + 4);
+    return StructPtr(Fdt, Prop + 12);
+}
+
+/*
+ * Have Splice adjust the node offsets in Offsets (negative entries
+ * are unused) as the structure block is edited; NULL stops it
+ */
+VOID FdtTrackOffsets(INTN *Offsets, UINTN Count)
+{
+    Tracked = Offsets;
+    TrackedCount = Offsets ? Count : 0;
+}
+
+/*
+ * Resolve an absolute path such as "/chosen" to a node offset
+ */
+INTN FdtPathOffset(VOID *Fdt, CONST char *Path)
+{
+    INTN Node = 0;
+    UINTN Len;
+
+    if (*Path != '/')
+        return FDT_ERR;
+
+    while (*Path) {
+        while (*Path == '/')
+            Path++;
+        if (!*Path)
+            break;
+        for (Len = 0; Path[Len] && Path[Len] != '/'; Len++)
+            ;
+        Node = SubnodeOffsetLen(Fdt, Node, Path, Len);
+        if (Node < 0)
+            return FDT_ERR;
+        Path += Len;
+    }
+    return Node;
+}
+
+/*
+ * Insert Delta bytes at a structure block offset, or for a negative
+ * Delta remove the bytes just before it. Everything after Offset,
+ * including the strings block, is moved.
+ */
+static EFI_STATUS Splice(VOID *Fdt, INTN Offset, INTN Delta)
+{
+    UINT32 StructSize = HDR_GET(Fdt, size_dt_struct);
+    UINT32 StringsOff = HDR_GET(Fdt, off_dt_strings);
+    UINT32 StringsSize = HDR_GET(Fdt, size_dt_strings);
+    UINT8 *Base = StructPtr(Fdt, Offset);
+    UINT8 *End = (UINT8 *)Fdt + StringsOff + StringsSize;
+    UINTN i;
+
+    if (Delta > 0 &&
+        StringsOff + StringsSize + (UINT32)Delta > HDR_GET(Fdt, totalsize))
+        return EFI_BUFFER_TOO_SMALL;
+
+    /* Boot Services CopyMem is defined to handle overlapping buffers */
+    if (Delta != 0)
+        BS->CopyMem(Base + Delta, Base, End - Base);
+
+    HDR_SET(Fdt, size_dt_struct, StructSize + Delta);
+    HDR_SET(Fdt, off_dt_strings, StringsOff + Delta);
+    for (i = 0; i < TrackedCount; i++) {
+        if (Tracked[i] >= Offset)
+            Tracked[i] += Delta;
+    }
+    return EFI_SUCCESS;
+}
+
+/*
+ * Find Name in the strings block, appending it if missing
+ */
+static INTN FindOrAddString(VOID *Fdt, CONST char *Name)
+{
+    char *Strings = StringPtr(Fdt, 0);
+    UINT32 Size = HDR_GET(Fdt, size_dt_strings);
+    UINTN Len = AsciiLen(Name) + 1;
+    UINT32 Off = 0;
+
+    while (Off < Size) {
+        CONST char *s = Strings + Off;
+        UINTN l;
+
+        for (l = 0; Off + l < Size && s[l]; l++)
+            ;
+        l++;
+        if (l == Len && Off + l <= Size && CompareMem(s, Name, Len) == 0)
+            return Off;
+        Off += l;
+    }
+
+    if (HDR_GET(Fdt, off_dt_strings) + Size + Len > HDR_GET(Fdt, totalsize))
+        return FDT_ERR;
+    CopyMem(Strings + Size, (VOID *)Name, Len);
+    HDR_SET(Fdt, size_dt_strings, Size + Len);
+    return Size;
+}
+
+/*
+ * Find a property of Node; returns its offset (at the FDT_PROP tag)
+ */
+static INTN FindProp(VOID *Fdt, INTN Node, CONST char *Name)
+{
+    INTN Offset = NodeBody(Fdt, Node);
+    INTN Next;
+    UINTN Len = AsciiLen(Name) + 1;
+    UINT32 Tag;
+
+    while (Offset >= 0) {
+        Tag = NextTag(Fdt, Offset, &Next);
+        if (Tag == FDT_PROP) {
+            UINT32 NameOff = ReadBe32(Fdt, Offset + 8);
+
+            if (Len <= HDR_GET(Fdt, size_dt_strings) - NameOff &&
+                CompareMem(StringPtr(Fdt, NameOff), Name, Len) == 0)
+                return Offset;
+        } else if (Tag != FDT_NOP) {
+            break;
+        }
+        Offset = Next;
+    }
+    return FDT_ERR;
+}
+
+CONST VOID *FdtGetProp(VOID *Fdt, INTN Node, CONST char *Name, UINT32 *Len)
+{
+    INTN Prop = FindProp(Fdt, Node, Name);
+
+    if (Prop < 0)
+        return NULL;
+    if (Len)
+        *Len = ReadBe32(Fdt, Prop + 4);
+    return StructPtr(Fdt, Prop + 12);
+}
+
+EFI_STATUS FdtSetProp(VOID *Fdt, INTN Node, CONST char *Name,
+                      CONST VOID *Val, UINT32 Len)
+{
+    EFI_STATUS status;
+    INTN Prop, NameOff;
+    UINT32 *Cell;
+    UINT8 *Data;
+    UINT32 i;
+
+    if (Node < 0)
+        return EFI_NOT_FOUND;
+
+    Prop = FindProp(Fdt, Node, Name);
+    if (Prop >= 0) {
+        UINT32 OldLen = ReadBe32(Fdt, Prop + 4);
+
+        status = Splice(Fdt, Prop + 12 + FDT_ALIGN(OldLen),
+                        (INTN)FDT_ALIGN(Len) - (INTN)FDT_ALIGN(OldLen));
+        if (EFI_ERROR(status))
+            return status;
+    } else {
+        NameOff = FindOrAddString(Fdt, Name);
+        if (NameOff < 0)
+            return EFI_BUFFER_TOO_SMALL;
+        Prop = NodePropsEnd(Fdt, Node);
+        if (Prop < 0)
+            return EFI_NOT_FOUND;
+        status = Splice(Fdt, Prop, 12 + FDT_ALIGN(Len));
+        if (EFI_ERROR(status))
+            return status;
+        Cell = (UINT32 *)StructPtr(Fdt, Prop);
+        Cell[0] = cpu_to_fdt32(FDT_PROP);
+        Cell[2] = cpu_to_fdt32((UINT32)NameOff);
+    }
+
+    Cell = (UINT32 *)StructPtr(Fdt, Prop);
+    Cell[1] = cpu_to_fdt32(Len);
+    Data = (UINT8 *)&Cell[3];
+    CopyMem(Data, (VOID *)Val, Len);
+    for (i = Len; i < FDT_ALIGN(Len); i++)
+        Data[i] = 0;
+    return EFI_SUCCESS;
+}
+
+EFI_STATUS FdtSetPropU64(VOID *Fdt, INTN Node, CONST char *Name, UINT64 Val)
+{
+    UINT32 Cells[2];
+
+    /* Written as two cells; the u64 itself may not be 8-byte aligned */
+    Cells[0] = cpu_to_fdt32((UINT32)(Val >> 32));
+    Cells[1] = cpu_to_fdt32((UINT32)Val);
+    return FdtSetProp(Fdt, Node, Name, Cells, sizeof(Cells));
+}
+
+EFI_STATUS FdtSetPropString(VOID *Fdt, INTN Node, CONST char *Name,
+                            CONST CHAR8 *Str)
+{
+    return FdtSetProp(Fdt, Node, Name, Str, AsciiLen((CONST char *)Str) + 1);
+}
+
+/*
+ * Add an empty subnode after Parent's properties
+ */
+INTN FdtAddSubnode(VOID *Fdt, INTN Parent, CONST char *Name)
+{
+    UINTN NameLen = AsciiLen(Name) + 1;
+    UINT32 Size = 4 + FDT_ALIGN(NameLen) + 4;
+    INTN Offset;
+    UINT8 *p;
+    UINTN i;
+
+    Offset = NodePropsEnd(Fdt, Parent);
+    if (Offset < 0)
+        return FDT_ERR;
+    if (EFI_ERROR(Splice(Fdt, Offset, Size)))
+        return FDT_ERR;
+
+    p = StructPtr(Fdt, Offset);
+    *(UINT32 *)p = cpu_to_fdt32(FDT_BEGIN_NODE);
+    for (i = 0; i < FDT_ALIGN(NameLen); i++)
+        p[4 + i] = i < NameLen ? Name[i] : 0;
+    *(UINT32 *)(p + Size - 4) = cpu_to_fdt32(FDT_END_NODE);
+    return Offset;
+}
+
+/*
+ * Offset of /chosen, creating it if the firmware did not
+ */
+INTN FdtChosen(VOID *Fdt)
+{
+    INTN Node = FdtSubnodeOffset(Fdt, 0, "chosen");
+
+    if (Node < 0)
+        Node = FdtAddSubnode(Fdt, 0, "chosen");
+    return Node;
+}
+
+/*
+ * Add a /memreserve/ entry. It goes at the end of the reservation
+ * map, which sits right before the structure block in a relocated
+ * blob, so the structure and strings blocks move up by one entry.
+ */
+EFI_STATUS FdtAddMemReserve(VOID *Fdt, UINT64 Addr, UINT64 Size)
+{
+    UINT32 StructOff = HDR_GET(Fdt, off_dt_struct);
+    UINT32 StringsOff = HDR_GET(Fdt, off_dt_strings);
+    UINT32 End = StringsOff + HDR_GET(Fdt, size_dt_strings);
+    UINT64 *Entry;
+
+    if (End + 16 > HDR_GET(Fdt, totalsize))
+        return EFI_BUFFER_TOO_SMALL;
+    BS->CopyMem((UINT8 *)Fdt + StructOff + 16, (UINT8 *)Fdt + StructOff, End - StructOff);
+    HDR_SET(Fdt, off_dt_struct, StructOff + 16);
+    HDR_SET(Fdt, off_dt_strings, StringsOff + 16);
+
+    /* Overwrite the old terminator and add a new one */
+    Entry = (UINT64 *)((UINT8 *)Fdt + StructOff - 16);
+    Entry[0] = cpu_to_fdt64(Addr);
+    Entry[1] = cpu_to_fdt64(Size);
+    Entry[2] = 0;
+    Entry[3] = 0;
+    return EFI_SUCCESS;
+}
+
+/*
+ * Drop the free space at the end, so totalsize covers exactly the
+ * blob's contents and it can be hashed reproducibly
+ */
+VOID FdtPack(VOID *Fdt)
+{
+    HDR_SET(Fdt, totalsize, HDR_GET(Fdt, off_dt_strings) + HDR_GET(Fdt, size_dt_strings));
+}
+
+/*
+ * Copy a DTB into a newly allocated buffer with Extra bytes of free
+ * space, normalising the block order so it can be edited in place.
+ */
+VOID *FdtRelocate(VOID *Dtb, UINTN Extra)
+{
+    EFI_STATUS status;
+    EFI_PHYSICAL_ADDRESS Addr;
+    UINT32 RsvOff, RsvEnd, RsvSize, StructSize, StringsSize, Size;
+    UINT64 *Rsv;
+    UINT8 *New;
+
+    if (!FdtCheckHeader(Dtb, GetDtbSize(Dtb)))
+        return NULL;
+
+    /*
+     * Reservation map runs until an all-zero entry, which must come
+     * before the structure block (or the end, if the map is after it)
+     */
+    RsvOff = HDR_GET(Dtb, off_mem_rsvmap);
+    RsvEnd = RsvOff < HDR_GET(Dtb, off_dt_struct) ? HDR_GET(Dtb, off_dt_struct) :
+                                                    HDR_GET(Dtb, totalsize);
+    Rsv = (UINT64 *)((UINT8 *)Dtb + RsvOff);
+    for (RsvSize = 16;; Rsv += 2, RsvSize += 16) {
+        if (RsvSize > RsvEnd - RsvOff)
+            return NULL;
+        if (!Rsv[0] && !Rsv[1])
+            break;
+    }
+
+    StructSize = HDR_GET(Dtb, size_dt_struct);
+    StringsSize = HDR_GET(Dtb, size_dt_strings);
+    Size = sizeof(FDT_HEADER) + RsvSize + StructSize + StringsSize + Extra;
+    Size = (Size + EFI_PAGE_MASK) & ~EFI_PAGE_MASK;
+
+    status = BS->AllocatePages(AllocateAnyPages, EfiLoaderData,
+                               EFI_SIZE_TO_PAGES(Size), &Addr);
+    if (EFI_ERROR(status))
+        return NULL;
+    New = (UINT8 *)Addr;
+
+    CopyMem(New, Dtb, sizeof(FDT_HEADER));
+    CopyMem(New + sizeof(FDT_HEADER), (UINT8 *)Dtb + RsvOff, RsvSize);
+    CopyMem(New + sizeof(FDT_HEADER) + RsvSize,
+            (UINT8 *)Dtb + HDR_GET(Dtb, off_dt_struct), StructSize);
+    CopyMem(New + sizeof(FDT_HEADER) + RsvSize + StructSize,
+            (UINT8 *)Dtb + HDR_GET(Dtb, off_dt_strings), StringsSize);
+
+    HDR_SET(New, totalsize, Size);
+    HDR_SET(New, off_mem_rsvmap, sizeof(FDT_HEADER));
+    HDR_SET(New, off_dt_struct, sizeof(FDT_HEADER) + RsvSize);
+    HDR_SET(New, off_dt_strings, sizeof(FDT_HEADER) + RsvSize + StructSize);
+    HDR_SET(New, version, 17);
+    return New;
+}
@@ -0,0 +1,443 @@
+/*
+ * gzip decompression (RFC 1951 DEFLATE in an RFC 1952 wrapper)
+ *
+ * A one-shot inflater for compressed kernels and initrds. Huffman
+ * codes up to FAST_BITS long are decoded with a single table lookup;
+ * longer ones fall back to a canonical-code search. If the output
+ * buffer fills up, decoding stops with EFI_BUFFER_TOO_SMALL and the
+ * output produced so far is valid, which lets callers peek at the
+ * start of a compressed image.
+ */
+
+#include "loader.h"
+
+#define FAST_BITS          9
+#define FAST_MASK          ((1 << FAST_BITS) - 1)
+#define MAX_SYMBOLS        288
+
+#define GZIP_FHCRC         0x02
+#define GZIP_FEXTRA        0x04
+#define GZIP_FNAME         0x08
+#define GZIP_FCOMMENT      0x10
+
+typedef struct {
+    UINT16 Fast[1 << FAST_BITS];   /* (length << 9) | symbol, 0 = slow path */
+    UINT16 FirstCode[16];
+    UINT32 MaxCode[17];            /* Pre-shifted to 16 bits */
+    UINT16 FirstSymbol[16];
+    UINT8 Size[MAX_SYMBOLS];
+    UINT16 Value[MAX_SYMBOLS];
+} HUFFMAN;
+
+typedef struct {
+    CONST UINT8 *In;
+    CONST UINT8 *InEnd;
+    UINT64 Bits;
+    UINTN BitCount;
+    UINTN Overrun;                 /* Zero bytes fed past the input */
+    UINT8 *Out;
+    UINTN OutPos;
+    UINTN OutSize;
+} INFLATE_STATE;
+
+static HUFFMAN LitLen, Dist;
+
+static CONST UINT16 LengthBase[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static CONST UINT8 LengthExtra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static CONST UINT16 DistBase[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577
+};
+static CONST UINT8 DistExtra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+static CONST UINT8 CodeLengthOrder[19] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+static UINT32 BitReverse(UINT32 Code, UINTN Bits)
+{
+    UINT32 r = 0;
+    UINTN i;
+
+    for (i = 0; i < Bits; i++) {
+        r = (r << 1) | (Code & 1);
+        Code >>= 1;
+    }
+    return r;
+}
+
+static BOOLEAN BuildHuffman(HUFFMAN *h, CONST UINT8 *Lengths, UINTN Count)
+{
+    UINT32 NextCode[16];
+    UINT32 Sizes[16];
+    UINT32 Code = 0, k = 0;
+    UINTN i;
+
+    ZeroMem(Sizes, sizeof(Sizes));
+    ZeroMem(h->Fast, sizeof(h->Fast));
+    for (i = 0; i < Count; i++)
+        Sizes[Lengths[i]]++;
+    Sizes[0] = 0;
+
+    for (i = 1; i < 16; i++) {
+        if (Sizes[i] > (1U << i))
+            return FALSE;
+        NextCode[i] = Code;
+        h->FirstCode[i] = (UINT16)Code;
+        h->FirstSymbol[i] = (UINT16)k;
+        Code += Sizes[i];
+        if (Sizes[i] && Code - 1 >= (1U << i))
+            return FALSE;
+        h->MaxCode[i] = Code << (16 - i);
+        Code <<= 1;
+        k += Sizes[i];
+    }
+    h->MaxCode[16] = 0x10000;
+
+    for (i = 0; i < Count; i++) {
+        UINTN s = Lengths[i];
+        UINT32 c, j;
+
+        if (!s)
+            continue;
+        c = NextCode[s] - h->FirstCode[s] + h->FirstSymbol[s];
+        h->Size[c] = (UINT8)s;
+        h->Value[c] = (UINT16)i;
+        if (s <= FAST_BITS) {
+            for (j = BitReverse(NextCode[s], s); j < (1U << FAST_BITS); j += 1U << s)
+                h->Fast[j] = (UINT16)((s << 9) | i);
+        }
+        NextCode[s]++;
+    }
+    return TRUE;
+}
+
+static VOID Refill(INFLATE_STATE *s)
+{
+    while (s->BitCount <= 56) {
+        UINT64 Byte = 0;
+
+        if (s->In < s->InEnd)
+            Byte = *s->In++;
+        else
+            s->Overrun++;
+        s->Bits |= Byte << s->BitCount;
+        s->BitCount += 8;
+    }
+}
+
+static UINT32 GetBits(INFLATE_STATE *s, UINTN n)
+{
+    UINT32 v;
+
+    if (s->BitCount < n)
+        Refill(s);
+    v = (UINT32)(s->Bits & ((1ULL << n) - 1));
+    s->Bits >>= n;
+    s->BitCount -= n;
+    return v;
+}
+
+static INTN Decode(INFLATE_STATE *s, HUFFMAN *h)
+{
+    UINT32 Entry, k;
+    UINTN Len, b;
+
+    if (s->BitCount < 16)
+        Refill(s);
+
+    Entry = h->Fast[s->Bits & FAST_MASK];
+    if (Entry) {
+        Len = Entry >> 9;
+        s->Bits >>= Len;
+        s->BitCount -= Len;
+        return Entry & 0x1ff;
+    }
+
+    /* Codes are stored MSB first; compare against the pre-shifted limits */
+    k = BitReverse((UINT32)s->Bits & 0xffff, 16);
+    for (Len = FAST_BITS + 1; k >= h->MaxCode[Len]; Len++)
+        ;
+    if (Len >= 16)
+        return -1;
+    b = (k >> (16 - Len)) - h->FirstCode[Len] + h->FirstSymbol[Len];
+    if (b >= MAX_SYMBOLS || h->Size[b] != Len)
+        return -1;
+    s->Bits >>= Len;
+    s->BitCount -= Len;
+    return h->Value[b];
+}
+
+static EFI_STATUS InflateStored(INFLATE_STATE *s)
+{
+    UINT32 Len, NLen;
+
+    /* Drop to a byte boundary, then hand back whole buffered bytes */
+    GetBits(s, s->BitCount & 7);
+    Len = GetBits(s, 16);
+    NLen = GetBits(s, 16);
+    if ((Len ^ 0xffff) != NLen)
+        return EFI_VOLUME_CORRUPTED;
+
+    while (Len && s->BitCount) {
+        if (s->OutPos >= s->OutSize)
+            return EFI_BUFFER_TOO_SMALL;
+        s->Out[s->OutPos++] = (UINT8)GetBits(s, 8);
+        Len--;
+    }
+    if (Len > (UINTN)(s->InEnd - s->In))
+        return EFI_VOLUME_CORRUPTED;
+    if (Len > s->OutSize - s->OutPos) {
+        CopyMem(s->Out + s->OutPos, (VOID *)s->In, s->OutSize - s->OutPos);
+        s->OutPos = s->OutSize;
+        return EFI_BUFFER_TOO_SMALL;
+    }
+    CopyMem(s->Out + s->OutPos, (VOID *)s->In, Len);
+    s->OutPos += Len;
+    s->In += Len;
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS BuildFixedTables(VOID)
+{
+    UINT8 Lengths[MAX_SYMBOLS];
+    UINTN i;
+
+    for (i = 0; i < 144; i++)
+        Lengths[i] = 8;
+    for (; i < 256; i++)
+        Lengths[i] = 9;
+    for (; i < 280; i++)
+        Lengths[i] = 7;
+    for (; i < MAX_SYMBOLS; i++)
+        Lengths[i] = 8;
+    if (!BuildHuffman(&LitLen, Lengths, MAX_SYMBOLS))
+        return EFI_VOLUME_CORRUPTED;
+    for (i = 0; i < 30; i++)
+        Lengths[i] = 5;
+    if (!BuildHuffman(&Dist, Lengths, 30))
+        return EFI_VOLUME_CORRUPTED;
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS BuildDynamicTables(INFLATE_STATE *s)
+{
+    UINT8 Lengths[MAX_SYMBOLS + 32];
+    UINT8 CodeLengths[19];
+    UINTN HLit, HDist, HCLen, i, n;
+    INTN Sym;
+
+    HLit = GetBits(s, 5) + 257;
+    HDist = GetBits(s, 5) + 1;
+    HCLen = GetBits(s, 4) + 4;
+    if (HLit > 286 || HDist > 30)
+        return EFI_VOLUME_CORRUPTED;
+
+    ZeroMem(CodeLengths, sizeof(CodeLengths));
+    for (i = 0; i < HCLen; i++)
+        CodeLengths[CodeLengthOrder[i]] = (UINT8)GetBits(s, 3);
+    if (!BuildHuffman(&LitLen, CodeLengths, 19))
+        return EFI_VOLUME_CORRUPTED;
+
+    n = 0;
+    while (n < HLit + HDist) {
+        UINTN Repeat;
+        UINT8 Fill;
+
+        Sym = Decode(s, &LitLen);
+        if (Sym < 0 || Sym > 18)
+            return EFI_VOLUME_CORRUPTED;
+        if (Sym < 16) {
+            Lengths[n++] = (UINT8)Sym;
+            continue;
+        }
+        if (Sym == 16) {
+            if (n == 0)
+                return EFI_VOLUME_CORRUPTED;
+            Fill = Lengths[n - 1];
+            Repeat = 3 + GetBits(s, 2);
+        } else if (Sym == 17) {
+            Fill = 0;
+            Repeat = 3 + GetBits(s, 3);
+        } else {
+            Fill = 0;
+            Repeat = 11 + GetBits(s, 7);
+        }
+        if (n + Repeat > HLit + HDist)
+            return EFI_VOLUME_CORRUPTED;
+        while (Repeat--)
+            Lengths[n++] = Fill;
+    }
+
+    if (!BuildHuffman(&LitLen, Lengths, HLit) ||
+        !BuildHuffman(&Dist, Lengths + HLit, HDist))
+        return EFI_VOLUME_CORRUPTED;
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS InflateCodes(INFLATE_STATE *s)
+{
+    UINT8 *Out = s->Out;
+    UINTN Pos = s->OutPos;
+    UINTN Len, Distance;
+    INTN Sym;
+
+    for (;;) {
+        Sym = Decode(s, &LitLen);
+        if (Sym < 256) {
+            if (Sym < 0)
+                return EFI_VOLUME_CORRUPTED;
+            if (Pos >= s->OutSize) {
+                s->OutPos = Pos;
+                return EFI_BUFFER_TOO_SMALL;
+            }
+            Out[Pos++] = (UINT8)Sym;
+            continue;
+        }
+        if (Sym == 256)
+            break;
+
+        Sym -= 257;
+        if (Sym >= 29)
+            return EFI_VOLUME_CORRUPTED;
+        Len = LengthBase[Sym] + GetBits(s, LengthExtra[Sym]);
+
+        Sym = Decode(s, &Dist);
+        if (Sym < 0 || Sym >= 30)
+            return EFI_VOLUME_CORRUPTED;
+        Distance = DistBase[Sym] + GetBits(s, DistExtra[Sym]);
+        if (Distance > Pos)
+            return EFI_VOLUME_CORRUPTED;
+
+        if (Len > s->OutSize - Pos) {
+            Len = s->OutSize - Pos;
+            while (Len--) {
+                Out[Pos] = Out[Pos - Distance];
+                Pos++;
+            }
+            s->OutPos = Pos;
+            return EFI_BUFFER_TOO_SMALL;
+        }
+        if (Distance == 1) {
+            SetMem(Out + Pos, Len, Out[Pos - 1]);
+            Pos += Len;
+        } else {
+            while (Len--) {
+                Out[Pos] = Out[Pos - Distance];
+                Pos++;
+            }
+        }
+    }
+    s->OutPos = Pos;
+    return EFI_SUCCESS;
+}
+
+/*
+ * Check for the gzip magic and deflate method
+ */
+BOOLEAN IsGzip(CONST VOID *Buf, UINTN Size)
+{
+    CONST UINT8 *p = Buf;
+
+    return Size >= 18 && p[0] == 0x1f && p[1] == 0x8b && p[2] == 8;
+}
+
+/*
+ * Uncompressed size from the gzip trailer (modulo 4 GiB)
+ */
+UINTN GzipOriginalSize(CONST VOID *Buf, UINTN Size)
+{
+    CONST UINT8 *p = (CONST UINT8 *)Buf + Size - 4;
+
+    if (!IsGzip(Buf, Size))
+        return 0;
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((UINT32)p[3] << 24);
+}
+
+EFI_STATUS GzipDecompress(CONST VOID *Src, UINTN SrcSize,
+                          VOID *Dst, UINTN DstSize, UINTN *OutSize)
+{
+    CONST UINT8 *p = Src;
+    CONST UINT8 *End = p + SrcSize;
+    INFLATE_STATE s;
+    EFI_STATUS status;
+    UINT8 Flags;
+    UINT32 Final, Type;
+
+    *OutSize = 0;
+    if (!IsGzip(Src, SrcSize))
+        return EFI_UNSUPPORTED;
+
+    /* Skip the member header */
+    Flags = p[3];
+    p += 10;
+    if (Flags & GZIP_FEXTRA) {
+        if (End - p < 2)
+            return EFI_VOLUME_CORRUPTED;
+        p += 2 + (p[0] | (p[1] << 8));
+    }
+    if (Flags & GZIP_FNAME) {
+        while (p < End && *p)
+            p++;
+        p++;
+    }
+    if (Flags & GZIP_FCOMMENT) {
+        while (p < End && *p)
+            p++;
+        p++;
+    }
+    if (Flags & GZIP_FHCRC)
+        p += 2;
+    if (p + 8 > End)
+        return EFI_VOLUME_CORRUPTED;
+
+    ZeroMem(&s, sizeof(s));
+    s.In = p;
+    s.InEnd = End - 8;      /* CRC32 and ISIZE trailer */
+    s.Out = Dst;
+    s.OutSize = DstSize;
+
+    do {
+        Final = GetBits(&s, 1);
+        Type = GetBits(&s, 2);
+        switch (Type) {
+        case 0:
+            status = InflateStored(&s);
+            break;
+        case 1:
+            status = BuildFixedTables();
+            if (!EFI_ERROR(status))
+                status = InflateCodes(&s);
+            break;
+        case 2:
+            status = BuildDynamicTables(&s);
+            if (!EFI_ERROR(status))
+                status = InflateCodes(&s);
+            break;
+        default:
+            status = EFI_VOLUME_CORRUPTED;
+            break;
+        }
+        *OutSize = s.OutPos;
+        if (EFI_ERROR(status))
+            return status;
+        /* Reading past the end means the stream was truncated */
+        if (s.Overrun * 8 > s.BitCount)
+            return EFI_VOLUME_CORRUPTED;
+        /* Blocks are tens of KiB: a fair place to let queued reads move */
+        SchedYield();
+    } while (!Final);
+
+    if ((UINT32)s.OutPos != GzipOriginalSize(Src, SrcSize))
+        return EFI_CRC_ERROR;
+    return EFI_SUCCESS;
+}
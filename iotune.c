@@ -0,0 +1,178 @@
+/*
+ * Transfer size tuning
+ *
+ * How large a ReadBlocks is fastest depends on the device and its
+ * driver: SD and eMMC hosts may split or bounce large transfers,
+ * virtio-blk and NVMe usually prefer one request that is as large as
+ * possible. Rather than guess, the first bulk reads from a device are
+ * each issued at a different size, from 128 KiB to 4 MiB and then
+ * unlimited, and timed. Once every size has been measured, the fastest
+ * becomes the device's MaxTransfer.
+ *
+ * Only whole-file direct reads are large enough for this: ReadFile
+ * issues them unsplit, however it hashes them (see loader.c). A kernel
+ * read of 16 MiB or more measures every size in one go.
+ *
+ * The measurements are kept in a non-volatile variable per device,
+ * named after a CRC32 of its device path, so a boot that reads too
+ * little to try every size carries on where the last one stopped. After
+ * that the chosen size is used from the first read and the variable is
+ * no longer written.
+ */
+
+#include "loader.h"
+
+#define TUNE_MAGIC         0x4e55544c     /* "LTUN" */
+#define TUNE_VERSION       1
+#define TUNE_MIN           0x20000        /* Smallest size tried */
+#define TUNE_DEVICES       2              /* ESP and raw kernel disk */
+
+typedef struct {
+    UINT32 Magic;
+    UINT32 Version;
+    UINT32 DevicePathSize;
+    UINT32 Chosen;              /* Bytes per transfer, 0 = unlimited */
+    UINT64 Rate[TUNE_SIZES];    /* Bytes per 1024 ticks, 0 = not measured */
+} TUNE_RECORD;
+
+struct _IO_TUNE {
+    CHAR16 Name[32];
+    TUNE_RECORD Record;
+    UINTN Trying;               /* Size being timed, TUNE_SIZES = none */
+    BOOLEAN Done;               /* Chosen holds the fastest size */
+    BOOLEAN Dirty;              /* Record differs from the variable */
+};
+
+static IO_TUNE Tunes[TUNE_DEVICES];
+static UINTN TuneCount;
+
+/* Bytes per transfer for size i; the last is unlimited */
+static UINTN TuneSize(UINTN i)
+{
+    return i == TUNE_SIZES - 1 ? 0 : (UINTN)TUNE_MIN << i;
+}
+
+/*
+ * Pick the fastest size once all are measured. Ties go to the smaller
+ * size, which keeps fewer bytes in flight for the same speed.
+ */
+static VOID TuneChoose(BLOCK_DEVICE *Dev, IO_TUNE *Tune)
+{
+    UINTN i, Best = 0;
+
+    for (i = 0; i < TUNE_SIZES; i++) {
+        if (!Tune->Record.Rate[i])
+            return;
+        if (Tune->Record.Rate[i] > Tune->Record.Rate[Best])
+            Best = i;
+    }
+    Tune->Record.Chosen = TuneSize(Best);
+    Tune->Done = TRUE;
+    Dev->MaxTransfer = Tune->Record.Chosen;
+}
+
+/*
+ * Start tuning the device behind Handle, or apply what an earlier boot
+ * found for it
+ */
+VOID IoTuneOpen(BLOCK_DEVICE *Dev, EFI_HANDLE Handle)
+{
+    EFI_DEVICE_PATH *DevicePath = DevicePathFromHandle(Handle);
+    IO_TUNE *Tune;
+    UINTN Size;
+    UINT32 Crc;
+
+    if (!DevicePath || TuneCount == TUNE_DEVICES ||
+        EFI_ERROR(BS->CalculateCrc32(DevicePath, DevicePathSize(DevicePath), &Crc)))
+        return;
+    Tune = &Tunes[TuneCount++];
+    ZeroMem(Tune, sizeof(*Tune));
+    SPrint(Tune->Name, sizeof(Tune->Name), L"LoaderReadSize%08x", Crc);
+    Tune->Trying = TUNE_SIZES;
+
+    Size = sizeof(Tune->Record);
+    if (EFI_ERROR(RT->GetVariable(Tune->Name, &LoaderVendorGuid, NULL, &Size, &Tune->Record)) ||
+        Size != sizeof(Tune->Record) || Tune->Record.Magic != TUNE_MAGIC ||
+        Tune->Record.Version != TUNE_VERSION ||
+        Tune->Record.DevicePathSize != DevicePathSize(DevicePath)) {
+        ZeroMem(&Tune->Record, sizeof(Tune->Record));
+        Tune->Record.Magic = TUNE_MAGIC;
+        Tune->Record.Version = TUNE_VERSION;
+        Tune->Record.DevicePathSize = DevicePathSize(DevicePath);
+    }
+    Dev->Tune = Tune;
+    TuneChoose(Dev, Tune);
+}
+
+/*
+ * Bytes to transfer for a whole-block read of Size bytes, 0 for all
+ * of them. While tuning, a read large enough for a size not measured
+ * yet is issued at the largest such size, so that one large read, cut
+ * into pieces, measures as many sizes as it can. Unlimited is only
+ * told apart from 4 MiB by a larger read, so it is measured last.
+ */
+UINTN IoTuneLimit(BLOCK_DEVICE *Dev, UINTN Size)
+{
+    IO_TUNE *Tune = Dev->Tune;
+    UINTN i;
+
+    if (!Tune || Tune->Done)
+        return Dev->MaxTransfer;
+    Tune->Trying = TUNE_SIZES;
+    for (i = TUNE_SIZES - 1; i-- > 0;) {
+        if (!Tune->Record.Rate[i] && Size >= TuneSize(i)) {
+            Tune->Trying = i;
+            return TuneSize(i);
+        }
+    }
+    if (!Tune->Record.Rate[TUNE_SIZES - 1] && Size > TuneSize(TUNE_SIZES - 2)) {
+        Tune->Trying = TUNE_SIZES - 1;
+        return 0;
+    }
+    return Dev->MaxTransfer;
+}
+
+/*
+ * Account a transfer of Size bytes that took Ticks
+ */
+VOID IoTuneSample(BLOCK_DEVICE *Dev, UINTN Size, UINT64 Ticks)
+{
+    IO_TUNE *Tune = Dev->Tune;
+
+    if (!Tune || Tune->Trying == TUNE_SIZES)
+        return;
+    Tune->Record.Rate[Tune->Trying] = ((UINT64)Size << 10) / (Ticks ? Ticks : 1);
+    if (!Tune->Record.Rate[Tune->Trying])
+        Tune->Record.Rate[Tune->Trying] = 1;
+    Tune->Trying = TUNE_SIZES;
+    Tune->Dirty = TRUE;
+    TuneChoose(Dev, Tune);
+}
+
+/*
+ * Store new measurements, before the OS owns the variable store
+ */
+VOID IoTuneSave(VOID)
+{
+    IO_TUNE *Tune;
+    UINTN i, Measured, s;
+
+    for (i = 0; i < TuneCount; i++) {
+        Tune = &Tunes[i];
+        if (!Tune->Dirty)
+            continue;
+        Tune->Dirty = FALSE;
+        RT->SetVariable(Tune->Name, &LoaderVendorGuid,
+                        EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS,
+                        sizeof(Tune->Record), &Tune->Record);
+        if (Tune->Done && Tune->Record.Chosen) {
+            LogPrint(L"Read size for this device: %d KiB\r\n", Tune->Record.Chosen >> 10);
+        } else if (Tune->Done) {
+            LogPrint(L"Read size for this device: unlimited\r\n");
+        } else {
+            for (s = 0, Measured = 0; s < TUNE_SIZES; s++)
+                Measured += Tune->Record.Rate[s] != 0;
+            LogPrint(L"Read sizes measured: %d of %d\r\n", Measured, TUNE_SIZES);
+        }
+    }
+}
@@ -3,23 +3,26 @@
  *
  * Loads a raw binary kernel from the EFI System Partition,
  * exits boot services, and jumps to the kernel entry point.
+ * Kernels built with the Linux EFI stub (PE/COFF) are handed to
+ * the firmware via LoadImage/StartImage instead.
  *
- * The kernel is expected at \kernel.bin on the ESP.
+ * What to boot is described by \loader.conf (see config.c); without
+ * it the kernel is expected at \kernel.bin on the ESP.
  *
  * Kernel entry convention (compatible with Linux RISC-V boot protocol):
  *   a0 = hart id (current CPU)
  *   a1 = pointer to device tree blob (FDT)
  */
 
-#include <efi.h>
-#include <efilib.h>
+#include "loader.h"
 
-/* Configuration */
-#define KERNEL_PATH        L"\\kernel.bin"
-#define KERNEL_LOAD_ADDR   0x80200000ULL  /* Standard RISC-V Linux kernel load address */
-#define DTB_LOAD_ADDR      0x82200000ULL  /* DTB location (matches OpenSBI convention) */
 #define MAX_MEMORY_MAP     16384
-#define FDT_MAGIC          0xd00dfeed
+
+/* Vendor GUID for the loader's own EFI variables */
+EFI_GUID LoaderVendorGuid = {
+    0x6f1c3a52, 0x8d2e, 0x4b7a,
+    {0x9c, 0x41, 0x5e, 0x27, 0xd0, 0x83, 0xa6, 0x1f}
+};
 
 /* Device Tree Table GUID */
 static EFI_GUID DtbTableGuid = {
@@ -27,70 +30,1987 @@ static EFI_GUID DtbTableGuid = {
     {0x83, 0x0b, 0xd9, 0x15, 0x2c, 0x69, 0xaa, 0xe0}
 };
 
-/* RISC-V Boot Protocol GUID */
-static EFI_GUID RiscvBootProtocolGuid = {
-    0xccd15aa8, 0x5e42, 0x4c68,
-    {0x88, 0x36, 0x24, 0x1c, 0x1d, 0x1c, 0x17, 0x9a}
-};
+/* SMBIOS entry points */
+static EFI_GUID SmbiosTableGuid = {
+    0xeb9d2d31, 0x2d88, 0x11d3,
+    {0x9a, 0x16, 0x00, 0x90, 0x27, 0x3f, 0xc1, 0x4d}
+};
+
+static EFI_GUID Smbios3TableGuid = {
+    0xf2fd1544, 0x9794, 0x4a2c,
+    {0x99, 0x2e, 0xe5, 0xbb, 0xcf, 0x20, 0xe3, 0x94}
+};
+
+/* ACPI 2.0 RSDP */
+static EFI_GUID Acpi20TableGuid = {
+    0x8868e871, 0xe4f1, 0x11d3,
+    {0xbc, 0x22, 0x00, 0x80, 0xc7, 0x3c, 0x88, 0x81}
+};
+
+/* LINUX_EFI_RANDOM_SEED_TABLE, left by an earlier boot stage */
+static EFI_GUID RandomSeedTableGuid = {
+    0x1ce1e5bc, 0x7ceb, 0x42f2,
+    {0x81, 0xe5, 0x8a, 0xad, 0xf1, 0x80, 0xf5, 0x7b}
+};
+
+/* EFI_MEMORY_ATTRIBUTES_TABLE */
+static EFI_GUID MemoryAttributesTableGuid = {
+    0xdcfa911d, 0x26eb, 0x469f,
+    {0xa2, 0x20, 0x38, 0xb7, 0xdc, 0x46, 0x12, 0x20}
+};
+
+/* RISC-V Boot Protocol GUID */
+static EFI_GUID RiscvBootProtocolGuid = {
+    0xccd15aa8, 0x5e42, 0x4c68,
+    {0x88, 0x36, 0x24, 0x1c, 0x1d, 0x1c, 0x17, 0x9a}
+};
+
+typedef struct {
+    UINT64 Revision;
+    EFI_STATUS (EFIAPI *GetBootHartId)(VOID *This, UINTN *BootHartId);
+} RISCV_EFI_BOOT_PROTOCOL;
+
+/* EFI_RNG_PROTOCOL GUID */
+static EFI_GUID RngProtocolGuid = {
+    0x3152bca5, 0xeade, 0x433d,
+    {0x86, 0x2e, 0xc0, 0x1c, 0xdc, 0x29, 0x1f, 0x44}
+};
+
+typedef struct {
+    EFI_STATUS (EFIAPI *GetInfo)(VOID *This, UINTN *AlgListSize, EFI_GUID *AlgList);
+    EFI_STATUS (EFIAPI *GetRNG)(VOID *This, EFI_GUID *Alg, UINTN Size, UINT8 *Value);
+} RNG_PROTOCOL;
+
+static LOADER_CONFIG Config;
+static BOOT_PLAN Plan;
+
+/*
+ * Configuration tables the loader uses, indexed in one pass over
+ * ST->ConfigurationTable at startup
+ */
+enum {
+    TABLE_DTB,
+    TABLE_ACPI20,
+    TABLE_SMBIOS3,
+    TABLE_SMBIOS,
+    TABLE_RANDOM_SEED,
+    TABLE_MEMORY_ATTRIBUTES,
+    TABLES
+};
+
+static CONST struct {
+    EFI_GUID *Guid;
+    CONST CHAR16 *Name;
+} TableIds[TABLES] = {
+    [TABLE_DTB]               = { &DtbTableGuid,              L"dtb" },
+    [TABLE_ACPI20]            = { &Acpi20TableGuid,           L"acpi20" },
+    [TABLE_SMBIOS3]           = { &Smbios3TableGuid,          L"smbios3" },
+    [TABLE_SMBIOS]            = { &SmbiosTableGuid,           L"smbios" },
+    [TABLE_RANDOM_SEED]       = { &RandomSeedTableGuid,       L"random-seed" },
+    [TABLE_MEMORY_ATTRIBUTES] = { &MemoryAttributesTableGuid, L"memory-attributes" },
+};
+
+static VOID *Tables[TABLES];
+static UINT32 DtbTableIndex;
+
+static VOID IndexTables(VOID)
+{
+    UINTN i, t;
+
+    for (i = 0; i < ST->NumberOfTableEntries; i++) {
+        for (t = 0; t < TABLES; t++) {
+            /* Note: gnu-efi 3.0 CompareGuid returns 0 when GUIDs are EQUAL */
+            if (Tables[t] ||
+                CompareGuid(&ST->ConfigurationTable[i].VendorGuid, TableIds[t].Guid) != 0)
+                continue;
+            Tables[t] = ST->ConfigurationTable[i].VendorTable;
+            if (t == TABLE_DTB)
+                DtbTableIndex = i;
+            break;
+        }
+    }
+    LogPrint(L"Firmware tables:");
+    for (t = 0; t < TABLES; t++) {
+        if (Tables[t])
+            LogPrint(L" %s", TableIds[t].Name);
+    }
+    LogPrint(L"\r\n");
+}
+
+/*
+ * Find the Device Tree Blob in EFI configuration tables, and its
+ * index there for the boot plan
+ */
+static VOID *FindDtb(UINT32 *Index)
+{
+    *Index = Tables[TABLE_DTB] ? DtbTableIndex : PLAN_DTB_NONE;
+    return Tables[TABLE_DTB];
+}
+
+/*
+ * The current memory map, in a buffer that is reused by the next call
+ */
+static EFI_MEMORY_DESCRIPTOR *ReadMemoryMap(UINTN *MapSize, UINTN *DescSize)
+{
+    static UINT8 Map[MAX_MEMORY_MAP];
+    UINTN MapKey;
+    UINT32 DescVersion;
+
+    *MapSize = sizeof(Map);
+    if (EFI_ERROR(BS->GetMemoryMap(MapSize, (EFI_MEMORY_DESCRIPTOR *)Map, &MapKey,
+                                   DescSize, &DescVersion)))
+        return NULL;
+    return (EFI_MEMORY_DESCRIPTOR *)Map;
+}
+
+/*
+ * The DTB OpenSBI leaves at DTB_LOAD_ADDR, if there is one. Nothing
+ * is read there unless the memory map has RAM at that address, and
+ * the whole blob must lie within that RAM.
+ */
+static VOID *FallbackDtb(VOID)
+{
+    EFI_MEMORY_DESCRIPTOR *Desc;
+    UINT8 *Map;
+    UINTN MapSize, DescSize, i;
+    UINT64 End = 0;
+
+    Map = (UINT8 *)ReadMemoryMap(&MapSize, &DescSize);
+    if (!Map)
+        return NULL;
+    for (i = 0; i + DescSize <= MapSize; i += DescSize) {
+        Desc = (EFI_MEMORY_DESCRIPTOR *)(Map + i);
+        if (Desc->PhysicalStart > DTB_LOAD_ADDR ||
+            Desc->PhysicalStart + Desc->NumberOfPages * EFI_PAGE_SIZE <= DTB_LOAD_ADDR)
+            continue;
+        /* Reserved memory may be firmware's own, behind PMP */
+        switch (Desc->Type) {
+        case EfiLoaderCode:
+        case EfiLoaderData:
+        case EfiBootServicesCode:
+        case EfiBootServicesData:
+        case EfiRuntimeServicesCode:
+        case EfiRuntimeServicesData:
+        case EfiConventionalMemory:
+        case EfiACPIReclaimMemory:
+            End = Desc->PhysicalStart + Desc->NumberOfPages * EFI_PAGE_SIZE;
+            break;
+        }
+        break;
+    }
+    if (!End || !FdtCheckHeader((VOID *)DTB_LOAD_ADDR, End - DTB_LOAD_ADDR))
+        return NULL;
+    return (VOID *)DTB_LOAD_ADDR;
+}
+
+/*
+ * The SMBIOS structure table and its size (a maximum for SMBIOS 3),
+ * from the 64-bit entry point if there is one
+ */
+static UINT8 *SmbiosStructures(UINT32 *Size)
+{
+    UINT8 *Ep = Tables[TABLE_SMBIOS3];
+    UINT64 Addr;
+
+    if (Ep && CompareMem(Ep, "_SM3_", 5) == 0) {
+        CopyMem(Size, Ep + 0x0c, sizeof(*Size));
+        CopyMem(&Addr, Ep + 0x10, sizeof(Addr));
+        return (UINT8 *)Addr;
+    }
+    Ep = Tables[TABLE_SMBIOS];
+    if (Ep && CompareMem(Ep, "_SM_", 4) == 0) {
+        *Size = *(UINT16 *)(Ep + 0x16);
+        return (UINT8 *)(UINTN)*(UINT32 *)(Ep + 0x18);
+    }
+    return NULL;
+}
+
+/*
+ * The system's product name from the SMBIOS type 1 structure, if
+ * firmware has SMBIOS tables
+ */
+static CONST CHAR8 *SmbiosProduct(VOID)
+{
+    UINT8 *p, *End, *s;
+    UINT32 Size;
+    UINTN n;
+
+    /* Each structure is a formatted area, then strings up to a double NUL */
+    p = SmbiosStructures(&Size);
+    if (!p)
+        return NULL;
+    End = p + Size;
+    while (p + 4 <= End && p[0] != 127) {
+        if (p[0] == 1 && p[1] > 5 && p[5]) {
+            s = p + p[1];
+            for (n = 1; n < p[5] && s < End; n++) {
+                while (s < End && *s)
+                    s++;
+                s++;
+            }
+            return s < End && *s ? (CONST CHAR8 *)s : NULL;
+        }
+        for (s = p + p[1]; s + 1 < End && (s[0] || s[1]); s++)
+            ;
+        p = s + 2;
+    }
+    return NULL;
+}
+
+/*
+ * Get the boot hart ID via RISC-V EFI boot protocol
+ */
+static UINTN GetBootHartId(EFI_SYSTEM_TABLE *ST)
+{
+    EFI_STATUS status;
+    RISCV_EFI_BOOT_PROTOCOL *riscv_boot;
+    UINTN hart_id = 0;
+
+    status = LibLocateProtocol(&RiscvBootProtocolGuid, (VOID **)&riscv_boot);
+    if (!EFI_ERROR(status) && riscv_boot && riscv_boot->GetBootHartId) {
+        riscv_boot->GetBootHartId(riscv_boot, &hart_id);
+    }
+    return hart_id;
+}
+
+/*
+ * Ticks per second of the time CSR, 0 if the DTB does not say
+ */
+static UINT64 GetTimebase(VOID *Dtb)
+{
+    CONST UINT32 *Freq;
+    INTN Cpus;
+    UINT32 Len;
+
+    Cpus = Dtb ? FdtPathOffset(Dtb, "/cpus") : -1;
+    if (Cpus < 0)
+        return 0;
+    Freq = FdtGetProp(Dtb, Cpus, "timebase-frequency", &Len);
+    if (Freq && Len == 4)
+        return fdt32_to_cpu(*Freq);
+    if (Freq && Len == 8)
+        return ((UINT64)fdt32_to_cpu(Freq[0]) << 32) | fdt32_to_cpu(Freq[1]);
+    return 0;
+}
+
+/*
+ * Open a file and return its size (and optionally modification time)
+ */
+static EFI_STATUS OpenFile(EFI_FILE_HANDLE Root, CHAR16 *Path,
+                           EFI_FILE_HANDLE *File, UINTN *Size, EFI_TIME *Time)
+{
+    EFI_STATUS status;
+    UINT8 InfoBuffer[512];
+    UINTN InfoSize = sizeof(InfoBuffer);
+
+    status = PROF_CALL(PROF_FILE_OPEN, 0,
+                       Root->Open(Root, File, Path, EFI_FILE_MODE_READ, 0));
+    if (EFI_ERROR(status))
+        return status;
+    status = PROF_CALL(PROF_FILE_GET_INFO, 0,
+                       (*File)->GetInfo(*File, &gEfiFileInfoGuid, &InfoSize, InfoBuffer));
+    if (EFI_ERROR(status)) {
+        (*File)->Close(*File);
+        return status;
+    }
+    *Size = ((EFI_FILE_INFO *)InfoBuffer)->FileSize;
+    if (Time)
+        *Time = ((EFI_FILE_INFO *)InfoBuffer)->ModificationTime;
+    return EFI_SUCCESS;
+}
+
+/*
+ * An open kernel or initrd. Large files on a FAT32 ESP are read through
+ * their extents (fat.c), raw partition kernels straight from their
+ * partition (rawpart.c), everything else through SimpleFileSystem.
+ * File is NULL when the file was never opened, e.g. because the
+ * extents came from the boot plan.
+ */
+typedef struct {
+    EFI_FILE_HANDLE File;
+    FAT_FILE *Fat;
+    BLOCK_DEVICE *Raw;
+    UINT64 Size;
+    UINT64 Position;
+    SHA256_CTX *Hash;           /* Fed with every byte read, if set */
+} FILE_READER;
+
+#define HASH_CHUNK         0x40000        /* Bytes hashed at a time, to hash from cache */
+
+static FAT_VOLUME FatVolume;
+static BLOCK_DEVICE RawDevice;
+static RAW_KERNEL_HEADER RawHeader;
+
+/* Set when a public key is compiled in: payloads must then be signed */
+static BOOLEAN SignaturesRequired;
+static UINT8 PublicKey[ED25519_KEY_SIZE];
+
+/* Set once the event log exists */
+static BOOLEAN Measured;
+
+/* Set once the warm-boot cache region is reserved */
+static BOOLEAN WarmCache;
+static CONST CHAR8 DtbEvent[] = "dtb";
+
+static BOOT_STATS Stats;
+
+/*
+ * Note the end of a boot stage; reads from now on count for the next
+ */
+static VOID EndStage(UINTN Stage)
+{
+    Stats.End[Stage] = ReadTime();
+    if (Stage + 1 < STAGES)
+        Stats.Stage = Stage + 1;
+}
+
+static EFI_STATUS OpenReader(EFI_FILE_HANDLE Root, CHAR16 *Path, FAT_FILE *Fat,
+                             FILE_READER *Reader, EFI_TIME *Time)
+{
+    EFI_STATUS status;
+    UINTN Size;
+
+    status = OpenFile(Root, Path, &Reader->File, &Size, Time);
+    if (EFI_ERROR(status))
+        return status;
+    Reader->Size = Size;
+    Reader->Position = 0;
+    Reader->Fat = NULL;
+    Reader->Raw = NULL;
+    Reader->Hash = NULL;
+    if (FatVolume.Dev.BlockIo && Size >= FAT_DIRECT_MIN &&
+        !EFI_ERROR(FatLookup(&FatVolume, Path, Fat)) && Fat->Size == Size)
+        Reader->Fat = Fat;
+    else
+        ZeroMem(Fat, sizeof(*Fat));
+    return EFI_SUCCESS;
+}
+
+/* What a read has hashed so far */
+typedef struct {
+    SHA256_CTX *Hash;
+    UINTN Done;
+} HASH_SINK;
+
+/*
+ * Hash a transfer that has just landed, giving queued reads a turn
+ * every HASH_CHUNK bytes
+ */
+static VOID HashLanded(VOID *Context, VOID *Data, UINTN Size)
+{
+    HASH_SINK *Sink = Context;
+    UINT8 *p = Data;
+    UINTN Stride;
+
+    for (; Size > 0; p += Stride, Size -= Stride) {
+        Stride = Size < HASH_CHUNK ? Size : HASH_CHUNK;
+        Sha256Update(Sink->Hash, p, Stride);
+        Sink->Done += Stride;
+        SchedYield();
+    }
+}
+
+/*
+ * Read the next Size bytes, hashing them as they land if asked to.
+ * If a direct read fails, the rest of the file is read through the
+ * file system driver instead; what the direct read already hashed is
+ * not hashed again.
+ */
+static EFI_STATUS ReadChunk(FILE_READER *Reader, VOID *Buffer, UINTN Size)
+{
+    UINT64 Start = ReadTime();
+    BLOCK_SINK Landed = Reader->Hash ? HashLanded : NULL;
+    HASH_SINK Sink = { Reader->Hash, 0 };
+    EFI_STATUS status;
+    UINTN ReadSize = Size;
+
+    if (Reader->Raw) {
+        status = BlockReadSink(Reader->Raw, Reader->Position, Buffer, Size, Landed, &Sink);
+        goto done;
+    }
+    if (Reader->Fat) {
+        status = FatRead(&FatVolume, Reader->Fat, Reader->Position, Buffer, Size,
+                         Landed, &Sink);
+        if (!EFI_ERROR(status) || !Reader->File)
+            goto done;
+        Reader->Fat = NULL;
+        Stats.Retries++;
+        status = Reader->File->SetPosition(Reader->File, Reader->Position);
+        if (EFI_ERROR(status))
+            return status;
+    }
+    status = PROF_CALL(PROF_FILE_READ, ReadSize,
+                       Reader->File->Read(Reader->File, &ReadSize, Buffer));
+    if (!EFI_ERROR(status) && ReadSize != Size)
+        status = EFI_END_OF_FILE;
+    if (!EFI_ERROR(status) && Landed)
+        HashLanded(&Sink, (UINT8 *)Buffer + Sink.Done, Size - Sink.Done);
+done:
+    if (!EFI_ERROR(status)) {
+        Reader->Position += Size;
+        Stats.ReadBytes[Stats.Stage] += Size;
+        Stats.ReadTicks[Stats.Stage] += ReadTime() - Start;
+    }
+    return status;
+}
+
+/*
+ * Read the next Size bytes, hashing them on the way if asked to.
+ * Reads through SimpleFileSystem are split so each chunk is hashed
+ * while still in cache. Direct reads are issued whole, so their
+ * transfers stay as large as the device allows, and each transfer is
+ * hashed as soon as it has landed.
+ */
+static EFI_STATUS ReadFile(FILE_READER *Reader, VOID *Buffer, UINTN Size)
+{
+    EFI_STATUS status;
+    UINT8 *p = Buffer;
+    UINTN Chunk;
+
+    if (!Reader->Hash)
+        return ReadChunk(Reader, Buffer, Size);
+    while (Size > 0) {
+        Chunk = Reader->Raw || Reader->Fat || Size < HASH_CHUNK ? Size : HASH_CHUNK;
+        status = ReadChunk(Reader, p, Chunk);
+        if (EFI_ERROR(status))
+            return status;
+        p += Chunk;
+        Size -= Chunk;
+    }
+    return EFI_SUCCESS;
+}
+
+static UINT32 ReaderSource(FILE_READER *Reader)
+{
+    return Reader->Raw ? SOURCE_RAW : Reader->Fat ? SOURCE_FAT : SOURCE_FILE;
+}
+
+static VOID CloseReader(FILE_READER *Reader)
+{
+    if (Reader->File)
+        Reader->File->Close(Reader->File);
+    if (Reader->Raw)
+        BlockClose(Reader->Raw);
+}
+
+/*
+ * Open the raw partition kernel of an entry. Raw kernels are not
+ * planned: their header already gives the size and compression.
+ */
+static EFI_STATUS OpenRawKernel(CONFIG_ENTRY *Entry, FILE_READER *Reader)
+{
+    EFI_STATUS status;
+
+    LogPrint(L"Opening kernel partition %g... ", &Entry->Partition);
+    status = RawPartitionOpen(&Entry->Partition, &RawDevice, &RawHeader);
+    if (EFI_ERROR(status)) {
+        LogPrint(L"FAILED: %r\r\n", status);
+        return status;
+    }
+    Reader->File = NULL;
+    Reader->Fat = NULL;
+    Reader->Hash = NULL;
+    Reader->Raw = &RawDevice;
+    Reader->Size = RawHeader.ImageSize;
+    Reader->Position = 0;
+    LogPrint(L"OK (%d bytes)\r\n", Reader->Size);
+    return EFI_SUCCESS;
+}
+
+/*
+ * Allocate pages for Size bytes, and copy them from Data if that is set
+ */
+static EFI_STATUS AllocatePayload(UINTN Size, CONST VOID *Data, PAYLOAD *Out)
+{
+    EFI_STATUS status;
+
+    Out->Size = Size;
+    Out->Pages = EFI_SIZE_TO_PAGES(Size);
+    status = BS->AllocatePages(AllocateAnyPages, EfiLoaderData, Out->Pages, &Out->Addr);
+    if (!EFI_ERROR(status) && Data)
+        CopyMem((VOID *)Out->Addr, (VOID *)Data, Size);
+    return status;
+}
+
+/*
+ * Read the rest of an open file into freshly allocated pages
+ */
+static EFI_STATUS ReadPayload(FILE_READER *Reader, PAYLOAD *Out)
+{
+    EFI_STATUS status;
+
+    status = AllocatePayload(Reader->Size, NULL, Out);
+    if (EFI_ERROR(status))
+        return status;
+    status = ReadFile(Reader, (VOID *)Out->Addr, Out->Size);
+    if (EFI_ERROR(status))
+        BS->FreePages(Out->Addr, Out->Pages);
+    return status;
+}
+
+/*
+ * Read the rest of a compressed file into a staging buffer, after
+ * the HdrSize bytes at Hdr that were already read from it
+ */
+static EFI_STATUS StageFile(FILE_READER *Reader, VOID *Hdr, UINTN HdrSize,
+                            UINTN FileSize, PAYLOAD *Packed)
+{
+    EFI_STATUS status;
+
+    Packed->Size = FileSize;
+    Packed->Pages = EFI_SIZE_TO_PAGES(FileSize);
+    status = BS->AllocatePages(AllocateAnyPages, EfiLoaderData,
+                               Packed->Pages, &Packed->Addr);
+    if (EFI_ERROR(status)) {
+        LogPrint(L"Allocating compressed buffer... FAILED: %r\r\n", status);
+        Packed->Addr = 0;
+        return status;
+    }
+
+    LogPrint(L"Loading compressed kernel... ");
+    CopyMem((VOID *)Packed->Addr, Hdr, HdrSize);
+    status = ReadFile(Reader, (UINT8 *)Packed->Addr + HdrSize, FileSize - HdrSize);
+    if (EFI_ERROR(status)) {
+        LogPrint(L"FAILED: %r\r\n", status);
+        BS->FreePages(Packed->Addr, Packed->Pages);
+        Packed->Addr = 0;
+        return status;
+    }
+    LogPrint(L"OK\r\n");
+    return EFI_SUCCESS;
+}
+
+/*
+ * Open \<Path><Suffix>, a file that describes the file at Path
+ */
+static EFI_STATUS OpenSidecar(EFI_FILE_HANDLE Root, CHAR16 *Path, CONST CHAR16 *Suffix,
+                              EFI_FILE_HANDLE *File, UINTN *Size)
+{
+    CHAR16 SidePath[CONFIG_MAX_PATH + 8];
+    UINTN Len;
+
+    for (Len = 0; Path[Len]; Len++)
+        SidePath[Len] = Path[Len];
+    CopyMem(SidePath + Len, (VOID *)Suffix, (StrLen(Suffix) + 1) * sizeof(CHAR16));
+    return OpenFile(Root, SidePath, File, Size, NULL);
+}
+
+/*
+ * Find the digest a file must match: Hex from the entry's config, or
+ * a sha256sum/b3sum-style sidecar, \<file><Suffix>, next to the file
+ */
+static BOOLEAN ExpectedDigest(EFI_FILE_HANDLE Root, CHAR16 *Path, CONST CHAR8 *Hex,
+                              CONST CHAR16 *Suffix, UINT8 *Digest)
+{
+    EFI_FILE_HANDLE File;
+    CHAR8 Text[2 * SHA256_DIGEST_SIZE + 1];
+    UINTN Size;
+    BOOLEAN Found;
+
+    if (Hex)
+        return ParseHexDigest(Hex, 2 * SHA256_DIGEST_SIZE, Digest);
+    if (!Path || EFI_ERROR(OpenSidecar(Root, Path, Suffix, &File, &Size)))
+        return FALSE;
+    Size = Size < sizeof(Text) ? Size : sizeof(Text);
+    Found = !EFI_ERROR(PROF_CALL(PROF_FILE_READ, Size, File->Read(File, &Size, Text))) &&
+            ParseHexDigest(Text, Size, Digest);
+    File->Close(File);
+    return Found;
+}
+
+/*
+ * Check the Ed25519 signature over a payload's SHA-256. Sig is the
+ * signature if it came with the payload; otherwise it is read from a
+ * raw 64-byte \<Path>.sig.
+ */
+static EFI_STATUS VerifySignature(EFI_FILE_HANDLE Root, CHAR16 *Path, CONST UINT8 *Sig,
+                                  UINT8 *Digest, CONST CHAR16 *What)
+{
+    UINT8 Buffer[ED25519_SIGNATURE_SIZE];
+    EFI_FILE_HANDLE File;
+    EFI_STATUS status;
+    UINTN Size;
+
+    LogPrint(L"Checking %s signature... ", What);
+    if (!Sig) {
+        status = Path ? OpenSidecar(Root, Path, L".sig", &File, &Size) : EFI_NOT_FOUND;
+        if (!EFI_ERROR(status)) {
+            if (Size == sizeof(Buffer))
+                status = PROF_CALL(PROF_FILE_READ, Size, File->Read(File, &Size, Buffer));
+            else
+                status = EFI_BAD_BUFFER_SIZE;
+            File->Close(File);
+        }
+        if (EFI_ERROR(status) || Size != sizeof(Buffer)) {
+            LogPrint(L"FAILED: no valid %s.sig\r\n", Path ? Path : What);
+            return EFI_SECURITY_VIOLATION;
+        }
+        Sig = Buffer;
+    }
+    if (!Ed25519Verify(PublicKey, Sig, Digest, SHA256_DIGEST_SIZE)) {
+        LogPrint(L"INVALID\r\n");
+        return EFI_SECURITY_VIOLATION;
+    }
+    LogPrint(L"OK\r\n");
+    return EFI_SUCCESS;
+}
+
+/*
+ * Log the digest of a file, described as "<What> <Path>"
+ */
+static VOID MeasureFile(CONST char *What, CHAR16 *Path, UINT8 *Digest)
+{
+    CHAR8 Data[16 + CONFIG_MAX_PATH];
+    UINTN Len = 0, i;
+
+    for (i = 0; What[i]; i++)
+        Data[Len++] = What[i];
+    if (Path) {
+        Data[Len++] = ' ';
+        for (i = 0; Path[i] && Len < sizeof(Data); i++)
+            Data[Len++] = (CHAR8)Path[i];
+    }
+    EventLogAppend(PCR_FILES, Digest, Data, Len);
+}
+
+/*
+ * Check a kernel's SHA-256 against the expected digest (if Expected is
+ * set) and its signature (Sig, or the .sig file if that is NULL). The
+ * digest is logged either way.
+ */
+static EFI_STATUS CheckKernelDigest(EFI_FILE_HANDLE Root, CHAR16 *Path, UINT8 *Digest,
+                                    UINT8 *Expected, CONST UINT8 *Sig)
+{
+    MeasureFile("kernel", Path, Digest);
+    if (Expected) {
+        LogPrint(L"Verifying kernel SHA-256... ");
+        if (CompareMem(Digest, Expected, SHA256_DIGEST_SIZE) != 0) {
+            LogPrint(L"MISMATCH\r\n");
+            return EFI_SECURITY_VIOLATION;
+        }
+        LogPrint(L"OK\r\n");
+    }
+    if (SignaturesRequired)
+        return VerifySignature(Root, Path, Sig, Digest, L"kernel");
+    return EFI_SUCCESS;
+}
+
+/*
+ * Check a fully read kernel: for raw partition images the header's
+ * CRC32 of the bytes as stored, then the streamed SHA-256, which is
+ * left in Digest
+ */
+static EFI_STATUS VerifyKernel(EFI_FILE_HANDLE Root, CHAR16 *Path, FILE_READER *Reader,
+                               VOID *Buffer, UINT8 *Expected, UINT8 *Digest)
+{
+    UINT32 Crc;
+
+    if (Reader->Raw &&
+        (EFI_ERROR(BS->CalculateCrc32(Buffer, Reader->Size, &Crc)) || Crc != RawHeader.Crc32)) {
+        LogPrint(L"Kernel partition CRC mismatch\r\n");
+        return EFI_CRC_ERROR;
+    }
+    Sha256Final(Reader->Hash, Digest);
+    return CheckKernelDigest(Root, Path, Digest, Expected,
+                             Reader->Raw ? RawHeader.Signature : NULL);
+}
+
+/*
+ * Log a loaded initrd from its SHA-256 in Digest, then check its
+ * signature and its BLAKE3 digest if one is configured. Initrds can
+ * be hundreds of MB, so the BLAKE3 hash is spread over all harts
+ * rather than streamed through the read.
+ */
+static EFI_STATUS VerifyInitrd(EFI_FILE_HANDLE Root, CHAR16 *Path, CONFIG_ENTRY *Entry,
+                               PAYLOAD *Initrd, UINT8 *Digest)
+{
+    UINT8 Expected[BLAKE3_DIGEST_SIZE], Blake3[BLAKE3_DIGEST_SIZE];
+    EFI_STATUS status;
+    UINTN Harts;
+
+    MeasureFile("initrd", Path, Digest);
+    if (SignaturesRequired) {
+        status = VerifySignature(Root, Path, NULL, Digest, L"initrd");
+        if (EFI_ERROR(status))
+            return status;
+    }
+    if (!ExpectedDigest(Root, Path, CONFIG_STR(&Config, Entry->InitrdBlake3), L".b3", Expected))
+        return EFI_SUCCESS;
+
+    LogPrint(L"Verifying initrd BLAKE3... ");
+    status = Blake3Hash((VOID *)Initrd->Addr, Initrd->Size, Tables[TABLE_DTB],
+                        GetBootHartId(ST), Blake3, &Harts);
+    if (EFI_ERROR(status)) {
+        LogPrint(L"FAILED: %r\r\n", status);
+        return status;
+    }
+    if (CompareMem(Blake3, Expected, sizeof(Blake3)) != 0) {
+        LogPrint(L"MISMATCH\r\n");
+        return EFI_SECURITY_VIOLATION;
+    }
+    LogPrint(L"OK (%d harts)\r\n", Harts);
+    return EFI_SUCCESS;
+}
+
+/*
+ * An initrd being read in the background while the kernel loads. Up to
+ * PREFETCH_DEPTH reads are queued at a time; they are hashed as they
+ * complete, in file order.
+ */
+#define PREFETCH_DEPTH     4
+#define PREFETCH_CHUNK     0x100000       /* Bytes per queued read */
+
+typedef struct {
+    TASK Task;                  /* First, the step gets the task */
+    FILE_READER Reader;
+    FAT_FILE Extents;
+    EFI_TIME FileTime;
+    SHA256_CTX Hash;
+    PAYLOAD Buffer;
+    BLOCK_REQUEST Requests[PREFETCH_DEPTH];
+    UINTN Sizes[PREFETCH_DEPTH];
+    UINTN Head;                 /* Oldest request in flight */
+    UINTN Count;                /* Requests in flight */
+    UINT64 Queued;              /* Bytes asked for */
+    UINT64 Done;                /* Bytes read and hashed */
+    UINT64 Start;
+} PREFETCH;
+
+static PREFETCH Prefetch;
+
+/*
+ * Hash what has arrived and queue more. After a failed read nothing
+ * more is queued, but the task only finishes once no read is in flight
+ * into the buffer.
+ */
+static BOOLEAN PrefetchStep(TASK *Task)
+{
+    PREFETCH *p = (PREFETCH *)Task;
+    UINT8 *Base = (UINT8 *)p->Buffer.Addr;
+    BLOCK_REQUEST *Req;
+    EFI_STATUS status;
+    UINTN i, Size;
+
+    while (p->Count && BlockRequestDone(&p->Requests[p->Head])) {
+        Req = &p->Requests[p->Head];
+        if (EFI_ERROR(Req->Status) && !EFI_ERROR(Task->Status))
+            Task->Status = Req->Status;
+        if (!EFI_ERROR(Task->Status)) {
+            Sha256Update(&p->Hash, Base + p->Done, p->Sizes[p->Head]);
+            p->Done += p->Sizes[p->Head];
+            Stats.ReadBytes[STAGE_INITRD] += p->Sizes[p->Head];
+        }
+        p->Head = (p->Head + 1) % PREFETCH_DEPTH;
+        p->Count--;
+    }
+
+    while (!EFI_ERROR(Task->Status) && p->Count < PREFETCH_DEPTH &&
+           p->Queued < p->Reader.Size) {
+        i = (p->Head + p->Count) % PREFETCH_DEPTH;
+        Size = p->Reader.Size - p->Queued < PREFETCH_CHUNK ?
+               p->Reader.Size - p->Queued : PREFETCH_CHUNK;
+        if (FatVolume.Dev.MaxTransfer && Size > FatVolume.Dev.MaxTransfer)
+            Size = FatVolume.Dev.MaxTransfer;
+        status = FatReadAsync(&FatVolume, &p->Extents, p->Queued, Base + p->Queued,
+                              &Size, &p->Requests[i]);
+        if (EFI_ERROR(status)) {
+            Task->Status = status;
+            break;
+        }
+        p->Sizes[i] = Size;
+        p->Queued += Size;
+        p->Count++;
+    }
+
+    if (p->Count)
+        return FALSE;
+    Stats.ReadTicks[STAGE_INITRD] += ReadTime() - p->Start;
+    return TRUE;
+}
+
+/*
+ * Start reading the initrd in the background, so that its reads
+ * overlap with reading, decompressing and hashing the kernel. This is
+ * only done where reads can be queued, a FAT32 ESP with BlockIo2, and
+ * when the warm-boot cache has no copy to use instead; otherwise
+ * LoadInitrd reads it as usual.
+ */
+static VOID StartInitrd(EFI_FILE_HANDLE Root, CHAR16 *Path)
+{
+    FILE_READER *Reader = &Prefetch.Reader;
+    UINT8 Digest[SHA256_DIGEST_SIZE];
+    VOID *Cached;
+    UINTN CachedSize;
+
+    if (!FatVolume.Dev.BlockIo2 ||
+        EFI_ERROR(OpenReader(Root, Path, &Prefetch.Extents, Reader, &Prefetch.FileTime)))
+        return;
+    if (!Reader->Fat ||
+        (WarmCacheLookup(WARM_INITRD, Path, Reader->Size, &Prefetch.FileTime,
+                         &Cached, &CachedSize, Digest) && CachedSize == Reader->Size) ||
+        EFI_ERROR(AllocatePayload(Reader->Size, NULL, &Prefetch.Buffer))) {
+        CloseReader(Reader);
+        return;
+    }
+    Sha256Init(&Prefetch.Hash);
+    Reader->Hash = &Prefetch.Hash;
+    Prefetch.Start = ReadTime();
+    Prefetch.Task.Step = PrefetchStep;
+    LogPrint(L"Reading initrd %s in the background\r\n", Path);
+    SchedStart(&Prefetch.Task);
+}
+
+/*
+ * Wait for the background read of the initrd. If it failed, the file
+ * is read again through the file system driver.
+ */
+static EFI_STATUS FinishInitrd(PAYLOAD *Initrd, UINT8 *Digest)
+{
+    FILE_READER *Reader = &Prefetch.Reader;
+    EFI_STATUS status;
+    UINTN i;
+
+    status = SchedWait(&Prefetch.Task);
+    Prefetch.Task.Step = NULL;
+    for (i = 0; i < PREFETCH_DEPTH; i++)
+        BlockRequestFree(&Prefetch.Requests[i]);
+    *Initrd = Prefetch.Buffer;
+    if (EFI_ERROR(status)) {
+        LogPrint(L"(background read failed: %r) ", status);
+        Stats.Retries++;
+        Reader->Fat = NULL;
+        Reader->Position = 0;
+        Sha256Init(&Prefetch.Hash);
+        status = Reader->File->SetPosition(Reader->File, 0);
+        if (!EFI_ERROR(status))
+            status = ReadFile(Reader, (VOID *)Initrd->Addr, Initrd->Size);
+        if (EFI_ERROR(status)) {
+            BS->FreePages(Initrd->Addr, Initrd->Pages);
+            return status;
+        }
+    }
+    Sha256Final(&Prefetch.Hash, Digest);
+    return EFI_SUCCESS;
+}
+
+/*
+ * Abandon a background read that LoadInitrd never took, for a boot
+ * that failed before it. No read may still be in flight into the
+ * buffer once the loader has returned and its pages are freed.
+ */
+static VOID CancelInitrd(VOID)
+{
+    UINTN i;
+
+    if (!Prefetch.Task.Step)
+        return;
+    SchedWait(&Prefetch.Task);
+    Prefetch.Task.Step = NULL;
+    for (i = 0; i < PREFETCH_DEPTH; i++)
+        BlockRequestFree(&Prefetch.Requests[i]);
+    BS->FreePages(Prefetch.Buffer.Addr, Prefetch.Buffer.Pages);
+    CloseReader(&Prefetch.Reader);
+}
+
+/*
+ * Load and check the initrd, copying it out of the warm-boot cache
+ * if that holds the same file, or taking it from the background read
+ * if one was started. A freshly read initrd is cached once it has been
+ * verified.
+ */
+static EFI_STATUS LoadInitrd(EFI_FILE_HANDLE Root, CHAR16 *Path, CONFIG_ENTRY *Entry,
+                             PAYLOAD *Initrd)
+{
+    static FAT_FILE Extents;
+    EFI_STATUS status;
+    FILE_READER Reader;
+    EFI_TIME FileTime;
+    SHA256_CTX Hash;
+    UINT8 Digest[SHA256_DIGEST_SIZE];
+    VOID *Cached;
+    UINTN CachedSize;
+    BOOLEAN Warm;
+
+    LogPrint(L"Loading initrd %s... ", Path);
+    if (Prefetch.Task.Step) {
+        status = FinishInitrd(Initrd, Digest);
+        Reader = Prefetch.Reader;
+        FileTime = Prefetch.FileTime;
+        Warm = FALSE;
+    } else {
+        status = OpenReader(Root, Path, &Extents, &Reader, &FileTime);
+        if (EFI_ERROR(status)) {
+            LogPrint(L"FAILED: %r\r\n", status);
+            return status;
+        }
+        Warm = WarmCacheLookup(WARM_INITRD, Path, Reader.Size, &FileTime,
+                               &Cached, &CachedSize, Digest) && CachedSize == Reader.Size;
+        if (Warm) {
+            status = AllocatePayload(CachedSize, Cached, Initrd);
+        } else {
+            Sha256Init(&Hash);
+            Reader.Hash = &Hash;
+            status = ReadPayload(&Reader, Initrd);
+            if (!EFI_ERROR(status))
+                Sha256Final(&Hash, Digest);
+        }
+    }
+    CloseReader(&Reader);
+    if (EFI_ERROR(status)) {
+        LogPrint(L"FAILED: %r\r\n", status);
+        return status;
+    }
+    LogPrint(L"OK at 0x%lx (%d bytes%s)\r\n", Initrd->Addr, Initrd->Size,
+             Warm ? L", warm cache" : L"");
+    Stats.Initrd.Source = Warm ? SOURCE_WARM : ReaderSource(&Reader);
+    Stats.Initrd.Addr = Initrd->Addr;
+    Stats.Initrd.Size = Initrd->Size;
+
+    status = VerifyInitrd(Root, Path, Entry, Initrd, Digest);
+    if (EFI_ERROR(status)) {
+        BS->FreePages(Initrd->Addr, Initrd->Pages);
+        return status;
+    }
+    if (!Warm)
+        WarmCacheStore(WARM_INITRD, Path, Initrd->Size, &FileTime,
+                       (VOID *)Initrd->Addr, Initrd->Size, Digest);
+    return EFI_SUCCESS;
+}
+
+/*
+ * Allocate memory for the kernel image described by Hdr. Flat and
+ * Image kernels go at LoadAddr if possible; EFI stub kernels are
+ * relocated by LoadImage, so any staging address works.
+ */
+static EFI_STATUS AllocateKernel(RISCV_IMAGE_HEADER *Hdr, UINTN HdrSize,
+                                 UINTN Size, UINT64 LoadAddr, BOOLEAN EfiStub,
+                                 PAYLOAD *Kernel)
+{
+    EFI_STATUS status;
+
+    Kernel->Size = Size;
+    Kernel->Pages = EFI_SIZE_TO_PAGES(Size);
+    if (EfiStub) {
+        LogPrint(L"Allocating staging buffer... ");
+        status = BS->AllocatePages(AllocateAnyPages, EfiLoaderData,
+                                   Kernel->Pages, &Kernel->Addr);
+        if (EFI_ERROR(status)) {
+            LogPrint(L"FAILED: %r\r\n", status);
+            return status;
+        }
+        LogPrint(L"OK at 0x%lx\r\n", Kernel->Addr);
+        return EFI_SUCCESS;
+    }
+
+    /* Image headers carry the full in-memory size including .bss */
+    if (IsRiscvImage(Hdr, HdrSize) &&
+        EFI_SIZE_TO_PAGES(Hdr->image_size) > Kernel->Pages)
+        Kernel->Pages = EFI_SIZE_TO_PAGES(Hdr->image_size);
+
+    LogPrint(L"Allocating memory at 0x%lx... ", LoadAddr);
+    Kernel->Addr = LoadAddr;
+    status = BS->AllocatePages(AllocateAddress, EfiLoaderCode, Kernel->Pages, &Kernel->Addr);
+    if (EFI_ERROR(status)) {
+        LogPrint(L"(trying any address) ");
+        Stats.Retries++;
+        status = BS->AllocatePages(AllocateAnyPages, EfiLoaderCode, Kernel->Pages, &Kernel->Addr);
+        if (EFI_ERROR(status)) {
+            LogPrint(L"FAILED: %r\r\n", status);
+            return status;
+        }
+    }
+    LogPrint(L"OK at 0x%lx\r\n", Kernel->Addr);
+    return EFI_SUCCESS;
+}
+
+/*
+ * Load (and if needed decompress) the kernel of a boot entry.
+ *
+ * If the boot plan matches the file, its format, size and load
+ * address are used as-is and the file is read in one go; when the
+ * plan also holds the file's FAT extents and its directory entry is
+ * unchanged, the file is not even opened, and when the warm-boot cache
+ * holds the image it is not read either. Otherwise
+ * the image header is peeked first so the allocation can be chosen
+ * before the bulk read; the header bytes are reused, not read twice.
+ * A NULL Path boots the entry's raw kernel partition.
+ */
+static EFI_STATUS LoadKernel(EFI_FILE_HANDLE Root, EFI_LOADED_IMAGE *LoadedImage,
+                             CHAR16 *Path, CONFIG_ENTRY *Entry,
+                             PAYLOAD *Kernel, BOOLEAN *EfiStub)
+{
+    static CONST CHAR16 *FormatNames[] = {
+        L"flat binary", L"RISC-V Image", L"EFI stub (PE/COFF)"
+    };
+    EFI_STATUS status;
+    FILE_READER Reader;
+    EFI_DEVICE_PATH *FilePath;
+    EFI_TIME FileTime;
+    RISCV_IMAGE_HEADER KernelHdr;
+    UINTN FileSize, HdrSize = 0, ImageSize, OutSize;
+    PAYLOAD Packed = { 0, 0, 0 };
+    BOOLEAN Planned, Gzip;
+    UINT32 Compression = Entry->Compression;
+    SHA256_CTX Hash;
+    UINT8 Expected[SHA256_DIGEST_SIZE], Digest[SHA256_DIGEST_SIZE];
+    BOOLEAN HaveDigest, Warm = FALSE;
+    VOID *Cached;
+    UINTN CachedSize;
+
+    if (!Path) {
+        status = OpenRawKernel(Entry, &Reader);
+        if (EFI_ERROR(status))
+            return status;
+        FileSize = Reader.Size;
+        if (Compression == COMPRESSION_AUTO)
+            Compression = RawHeader.Compression;
+        Plan.DevicePathSize = 0;
+        Planned = FALSE;
+        goto probe;
+    }
+
+    /* Open kernel file */
+    LogPrint(L"Opening kernel file %s... ", Path);
+    FilePath = FileDevicePath(LoadedImage->DeviceHandle, Path);
+    if (FatVolume.Dev.BlockIo && BootPlanMatchesPath(&Plan, FilePath, Entry) &&
+        FatFileUnchanged(&FatVolume, &Plan.KernelExtents)) {
+        Reader.File = NULL;
+        Reader.Fat = &Plan.KernelExtents;
+        Reader.Size = FileSize = Plan.FileSize;
+        Reader.Position = 0;
+        FileTime = Plan.FileTime;
+    } else {
+        status = OpenReader(Root, Path, &Plan.KernelExtents, &Reader, &FileTime);
+        if (EFI_ERROR(status)) {
+            LogPrint(L"FAILED: %r\r\n", status);
+            LogPrint(L"\r\nPlease place kernel at %s on the ESP.\r\n", Path);
+            if (FilePath)
+                FreePool(FilePath);
+            return status;
+        }
+        FileSize = Reader.Size;
+    }
+    LogPrint(L"OK (%d bytes%s)\r\n", FileSize, Reader.Fat ? L", extents" : L"");
+
+    Planned = BootPlanSetKey(&Plan, FilePath, Entry, FileSize, &FileTime);
+    if (FilePath)
+        FreePool(FilePath);
+
+    if (Planned) {
+        Gzip = Plan.Compression == COMPRESSION_GZIP;
+        *EfiStub = Plan.Format == KERNEL_EFI_STUB;
+        Kernel->Addr = Plan.LoadAddr;
+        Kernel->Size = Plan.ImageSize;
+        Kernel->Pages = Plan.ImagePages;
+        LogPrint(L"Kernel format: %s%s (boot plan)\r\n", FormatNames[Plan.Format],
+                 Gzip ? L", gzip" : L"");
+        LogPrint(L"Allocating memory at 0x%lx... ", Kernel->Addr);
+        status = BS->AllocatePages(AllocateAddress,
+                                   *EfiStub ? EfiLoaderData : EfiLoaderCode,
+                                   Kernel->Pages, &Kernel->Addr);
+        if (EFI_ERROR(status)) {
+            LogPrint(L"FAILED: %r, probing instead\r\n", status);
+            Stats.Retries++;
+            Planned = FALSE;
+        } else {
+            LogPrint(L"OK\r\n");
+        }
+    }
+
+probe:
+    /* Always hashed, for the event log if nothing else */
+    HaveDigest = ExpectedDigest(Root, Path, CONFIG_STR(&Config, Entry->Sha256), L".sha256",
+                                Expected);
+
+    /* A planned kernel may still be in RAM from the previous boot */
+    if (Planned && WarmCacheLookup(WARM_KERNEL, Path, FileSize, &FileTime,
+                                   &Cached, &CachedSize, Digest) &&
+        CachedSize == Kernel->Size) {
+        LogPrint(L"Loading kernel from warm cache... ");
+        CopyMem((VOID *)Kernel->Addr, Cached, Kernel->Size);
+        LogPrint(L"OK\r\n");
+        Warm = TRUE;
+        status = CheckKernelDigest(Root, Path, Digest, HaveDigest ? Expected : NULL, NULL);
+        if (EFI_ERROR(status))
+            goto free_kernel;
+        goto loaded;
+    }
+
+    /* The harts' ISA in the firmware DTB picks the SHA-256 code */
+    LogPrint(L"Hashing kernel, SHA-256 engine: %s\r\n", Sha256Probe(Tables[TABLE_DTB]));
+    Sha256Init(&Hash);
+    Reader.Hash = &Hash;
+
+    if (!Planned) {
+        LogPrint(L"Reading kernel header... ");
+        HdrSize = sizeof(KernelHdr);
+        if (HdrSize > FileSize)
+            HdrSize = FileSize;
+        ZeroMem(&KernelHdr, sizeof(KernelHdr));
+        status = ReadFile(&Reader, &KernelHdr, HdrSize);
+        if (EFI_ERROR(status)) {
+            LogPrint(L"FAILED: %r\r\n", status);
+            goto out;
+        }
+        LogPrint(L"OK\r\n");
+
+        ImageSize = FileSize;
+        Gzip = Compression == COMPRESSION_GZIP ||
+               (Compression == COMPRESSION_AUTO && IsGzip(&KernelHdr, HdrSize));
+        if (Gzip) {
+            /* Stage the compressed file, then peek at the image it holds */
+            status = StageFile(&Reader, &KernelHdr, HdrSize, FileSize, &Packed);
+            if (EFI_ERROR(status))
+                goto out;
+            ZeroMem(&KernelHdr, sizeof(KernelHdr));
+            GzipDecompress((VOID *)Packed.Addr, FileSize, &KernelHdr,
+                           sizeof(KernelHdr), &HdrSize);
+            ImageSize = GzipOriginalSize((VOID *)Packed.Addr, FileSize);
+        }
+
+        *EfiStub = IsEfiStubImage(&KernelHdr, HdrSize, NULL);
+        Plan.Format = *EfiStub ? KERNEL_EFI_STUB :
+                      IsRiscvImage(&KernelHdr, HdrSize) ? KERNEL_IMAGE : KERNEL_FLAT;
+        Plan.Compression = Gzip ? COMPRESSION_GZIP : COMPRESSION_NONE;
+        LogPrint(L"Kernel format: %s%s\r\n", FormatNames[Plan.Format], Gzip ? L", gzip" : L"");
+
+        status = AllocateKernel(&KernelHdr, HdrSize, ImageSize, Entry->LoadAddr,
+                                *EfiStub, Kernel);
+        if (EFI_ERROR(status))
+            goto free_packed;
+        Plan.LoadAddr = Kernel->Addr;
+        Plan.ImageSize = Kernel->Size;
+        Plan.ImagePages = Kernel->Pages;
+    }
+
+    if (Gzip) {
+        if (!Packed.Addr) {
+            status = StageFile(&Reader, NULL, 0, FileSize, &Packed);
+            if (EFI_ERROR(status))
+                goto free_kernel;
+        }
+        status = VerifyKernel(Root, Path, &Reader, (VOID *)Packed.Addr,
+                              HaveDigest ? Expected : NULL, Digest);
+        if (EFI_ERROR(status))
+            goto free_kernel;
+        LogPrint(L"Decompressing kernel... ");
+        status = GzipDecompress((VOID *)Packed.Addr, Packed.Size,
+                                (VOID *)Kernel->Addr, Kernel->Size, &OutSize);
+        if (EFI_ERROR(status)) {
+            LogPrint(L"FAILED: %r\r\n", status);
+            goto free_kernel;
+        }
+        LogPrint(L"OK (%d bytes)\r\n", OutSize);
+        BS->FreePages(Packed.Addr, Packed.Pages);
+        Packed.Addr = 0;
+    } else {
+        LogPrint(L"Loading kernel into memory... ");
+        if (HdrSize)
+            CopyMem((VOID *)Kernel->Addr, &KernelHdr, HdrSize);
+        status = ReadFile(&Reader, (UINT8 *)Kernel->Addr + HdrSize, FileSize - HdrSize);
+        if (EFI_ERROR(status)) {
+            LogPrint(L"FAILED: %r\r\n", status);
+            goto free_kernel;
+        }
+        LogPrint(L"OK\r\n");
+        status = VerifyKernel(Root, Path, &Reader, (VOID *)Kernel->Addr,
+                              HaveDigest ? Expected : NULL, Digest);
+        if (EFI_ERROR(status))
+            goto free_kernel;
+    }
+
+loaded:
+    if (*EfiStub && !IsEfiStubImage((RISCV_IMAGE_HEADER *)Kernel->Addr, Kernel->Size,
+                                    (VOID *)Kernel->Addr)) {
+        LogPrint(L"Kernel has no valid PE header\r\n");
+        status = EFI_LOAD_ERROR;
+        goto free_kernel;
+    }
+    if (Path && !Warm)
+        WarmCacheStore(WARM_KERNEL, Path, FileSize, &FileTime,
+                       (VOID *)Kernel->Addr, Kernel->Size, Digest);
+    Stats.Kernel.Source = Warm ? SOURCE_WARM : ReaderSource(&Reader);
+    Stats.Kernel.Addr = Kernel->Addr;
+    Stats.Kernel.Size = Kernel->Size;
+    Stats.Format = Plan.Format;
+    Stats.Gzip = Plan.Compression == COMPRESSION_GZIP;
+    CloseReader(&Reader);
+    return EFI_SUCCESS;
+
+free_kernel:
+    BS->FreePages(Kernel->Addr, Kernel->Pages);
+free_packed:
+    if (Packed.Addr)
+        BS->FreePages(Packed.Addr, Packed.Pages);
+out:
+    CloseReader(&Reader);
+    /* Don't keep a plan for something that failed to load */
+    Plan.DevicePathSize = 0;
+    return status;
+}
+
+/*
+ * The sections of the unified kernel image being booted, if any
+ */
+static PAYLOAD Uki[UKI_SECTIONS];
+
+/*
+ * The UKI's command line as a string: the section need not end in a
+ * NUL, and often ends in a newline
+ */
+static CONST CHAR8 *UkiCmdline(VOID)
+{
+    CONST CHAR8 *Section = (CONST CHAR8 *)Uki[UKI_CMDLINE].Addr;
+    UINTN Len = Uki[UKI_CMDLINE].Size;
+    CHAR8 *Cmdline;
+
+    while (Len && (Section[Len - 1] == '\0' || Section[Len - 1] == '\n' ||
+                   Section[Len - 1] == '\r' || Section[Len - 1] == ' '))
+        Len--;
+    if (!Len)
+        return NULL;
+    Cmdline = AllocatePool(Len + 1);
+    if (!Cmdline)
+        return NULL;
+    CopyMem(Cmdline, (VOID *)Section, Len);
+    Cmdline[Len] = '\0';
+    return Cmdline;
+}
+
+/*
+ * Set up the kernel in Uki[UKI_LINUX]. An EFI stub kernel is handed to
+ * LoadImage where it lies; only a flat, Image or gzipped kernel is
+ * copied to its own pages.
+ */
+static EFI_STATUS PlaceUkiKernel(CONFIG_ENTRY *Entry, PAYLOAD *Kernel, BOOLEAN *EfiStub)
+{
+    RISCV_IMAGE_HEADER KernelHdr;
+    PAYLOAD *Linux = &Uki[UKI_LINUX];
+    UINTN HdrSize, ImageSize, OutSize;
+    EFI_STATUS status;
+    BOOLEAN Gzip;
+
+    /* Not planned: the sections say all there is to know */
+    Plan.DevicePathSize = 0;
+
+    Gzip = Entry->Compression == COMPRESSION_GZIP ||
+           (Entry->Compression == COMPRESSION_AUTO &&
+            IsGzip((VOID *)Linux->Addr, Linux->Size));
+    if (!Gzip && IsEfiStubImage((RISCV_IMAGE_HEADER *)Linux->Addr, Linux->Size,
+                                (VOID *)Linux->Addr)) {
+        *EfiStub = TRUE;
+        *Kernel = *Linux;
+        Plan.Format = KERNEL_EFI_STUB;
+    } else {
+        ZeroMem(&KernelHdr, sizeof(KernelHdr));
+        if (Gzip) {
+            GzipDecompress((VOID *)Linux->Addr, Linux->Size, &KernelHdr,
+                           sizeof(KernelHdr), &HdrSize);
+            ImageSize = GzipOriginalSize((VOID *)Linux->Addr, Linux->Size);
+        } else {
+            HdrSize = Linux->Size < sizeof(KernelHdr) ? Linux->Size : sizeof(KernelHdr);
+            CopyMem(&KernelHdr, (VOID *)Linux->Addr, HdrSize);
+            ImageSize = Linux->Size;
+        }
+        *EfiStub = IsEfiStubImage(&KernelHdr, HdrSize, NULL);
+        Plan.Format = *EfiStub ? KERNEL_EFI_STUB :
+                      IsRiscvImage(&KernelHdr, HdrSize) ? KERNEL_IMAGE : KERNEL_FLAT;
+        status = AllocateKernel(&KernelHdr, HdrSize, ImageSize, Entry->LoadAddr,
+                                *EfiStub, Kernel);
+        if (EFI_ERROR(status))
+            return status;
+        if (Gzip) {
+            LogPrint(L"Decompressing kernel... ");
+            status = GzipDecompress((VOID *)Linux->Addr, Linux->Size,
+                                    (VOID *)Kernel->Addr, Kernel->Size, &OutSize);
+            if (EFI_ERROR(status)) {
+                LogPrint(L"FAILED: %r\r\n", status);
+                goto free_kernel;
+            }
+            LogPrint(L"OK (%d bytes)\r\n", OutSize);
+        } else {
+            CopyMem((VOID *)Kernel->Addr, (VOID *)Linux->Addr, Linux->Size);
+        }
+        if (*EfiStub && !IsEfiStubImage((RISCV_IMAGE_HEADER *)Kernel->Addr, Kernel->Size,
+                                        (VOID *)Kernel->Addr)) {
+            LogPrint(L"Kernel has no valid PE header\r\n");
+            status = EFI_LOAD_ERROR;
+            goto free_kernel;
+        }
+    }
+    LogPrint(L"Kernel format: %s%s\r\n", *EfiStub ? L"EFI stub (PE/COFF)" :
+             Plan.Format == KERNEL_IMAGE ? L"RISC-V Image" : L"flat binary",
+             Gzip ? L", gzip" : L"");
+
+    Stats.Kernel.Source = SOURCE_UKI;
+    Stats.Kernel.Addr = Kernel->Addr;
+    Stats.Kernel.Size = Kernel->Size;
+    Stats.Format = Plan.Format;
+    Stats.Gzip = Gzip;
+    return EFI_SUCCESS;
 
-typedef struct {
-    UINT64 Revision;
-    EFI_STATUS (EFIAPI *GetBootHartId)(VOID *This, UINTN *BootHartId);
-} RISCV_EFI_BOOT_PROTOCOL;
+free_kernel:
+    BS->FreePages(Kernel->Addr, Kernel->Pages);
+    return status;
+}
 
 /*
- * Convert big-endian u32 to native
+ * Load a unified kernel image. The file is read in one pass and its
+ * one SHA-256 is checked and logged in place of the kernel's, initrd's
+ * and device tree's. The image stays in memory: the kernel may run from
+ * it, and the other sections are left in Uki[] for the caller.
  */
-static UINT32 fdt32_to_cpu(UINT32 x)
+static EFI_STATUS LoadUki(EFI_FILE_HANDLE Root, CHAR16 *Path, CONFIG_ENTRY *Entry,
+                          PAYLOAD *Kernel, BOOLEAN *EfiStub)
 {
-    return ((x & 0xff000000) >> 24) |
-           ((x & 0x00ff0000) >> 8)  |
-           ((x & 0x0000ff00) << 8)  |
-           ((x & 0x000000ff) << 24);
+    static FAT_FILE Extents;
+    static PAYLOAD Image;
+    EFI_STATUS status;
+    FILE_READER Reader;
+    SHA256_CTX Hash;
+    UINT8 Expected[SHA256_DIGEST_SIZE], Digest[SHA256_DIGEST_SIZE];
+
+    LogPrint(L"Loading unified kernel image %s... ", Path);
+    status = OpenReader(Root, Path, &Extents, &Reader, NULL);
+    if (EFI_ERROR(status)) {
+        LogPrint(L"FAILED: %r\r\n", status);
+        return status;
+    }
+    Sha256Init(&Hash);
+    Reader.Hash = &Hash;
+    status = ReadPayload(&Reader, &Image);
+    CloseReader(&Reader);
+    if (EFI_ERROR(status)) {
+        LogPrint(L"FAILED: %r\r\n", status);
+        return status;
+    }
+    Sha256Final(&Hash, Digest);
+    status = UkiParse((VOID *)Image.Addr, Image.Size, Uki);
+    if (EFI_ERROR(status)) {
+        LogPrint(L"FAILED: %s\r\n", status == EFI_NOT_FOUND ? L"no .linux section" :
+                                                              L"not a PE image");
+        goto free_image;
+    }
+    LogPrint(L"OK (%d bytes%s)\r\n", Image.Size, Reader.Fat ? L", extents" : L"");
+
+    /* One digest covers every section */
+    MeasureFile("uki", Path, Digest);
+    if (ExpectedDigest(Root, Path, CONFIG_STR(&Config, Entry->Sha256), L".sha256", Expected)) {
+        LogPrint(L"Verifying UKI SHA-256... ");
+        if (CompareMem(Digest, Expected, SHA256_DIGEST_SIZE) != 0) {
+            LogPrint(L"MISMATCH\r\n");
+            status = EFI_SECURITY_VIOLATION;
+            goto free_image;
+        }
+        LogPrint(L"OK\r\n");
+    }
+    if (SignaturesRequired) {
+        status = VerifySignature(Root, Path, NULL, Digest, L"UKI");
+        if (EFI_ERROR(status))
+            goto free_image;
+    }
+
+    status = PlaceUkiKernel(Entry, Kernel, EfiStub);
+    if (EFI_ERROR(status))
+        goto free_image;
+    return EFI_SUCCESS;
+
+free_image:
+    BS->FreePages(Image.Addr, Image.Pages);
+    ZeroMem(Uki, sizeof(Uki));
+    return status;
 }
 
 /*
- * Get DTB size from header
+ * Append this boot's statistics to the ESP, if loader.conf asks for it.
+ * Not being able to is no reason to fail the boot.
  */
-static UINT32 GetDtbSize(VOID *Dtb)
+static VOID WriteStats(EFI_FILE_HANDLE Root)
 {
-    UINT32 *hdr = (UINT32 *)Dtb;
-    if (fdt32_to_cpu(hdr[0]) != FDT_MAGIC)
-        return 0;
-    return fdt32_to_cpu(hdr[1]);  /* totalsize field */
+    EFI_STATUS status;
+
+    if (!(Config.Flags & CONFIG_STATS))
+        return;
+    LogPrint(L"Writing boot statistics... ");
+    status = StatsWrite(Root, &Stats);
+    if (EFI_ERROR(status))
+        LogPrint(L"FAILED: %r\r\n", status);
+    else
+        LogPrint(L"OK\r\n");
+}
+
+/*
+ * Pass the command line and initrd to a flat kernel through /chosen
+ */
+static EFI_STATUS FixupChosen(VOID *Dtb, CONST CHAR8 *Cmdline, PAYLOAD *Initrd)
+{
+    EFI_STATUS status = EFI_SUCCESS;
+    INTN Chosen = FdtChosen(Dtb);
+
+    if (Chosen < 0)
+        return EFI_NOT_FOUND;
+    if (Cmdline)
+        status = FdtSetPropString(Dtb, Chosen, "bootargs", Cmdline);
+    if (!EFI_ERROR(status) && Initrd) {
+        status = FdtSetPropU64(Dtb, Chosen, "linux,initrd-start", Initrd->Addr);
+        if (!EFI_ERROR(status))
+            status = FdtSetPropU64(Dtb, Chosen, "linux,initrd-end",
+                                   Initrd->Addr + Initrd->Size);
+    }
+    return status;
+}
+
+#define RNG_SEED_SIZE      64
+
+/* rng-seed, then kaslr-seed, from firmware */
+static UINT8 Seed[RNG_SEED_SIZE + sizeof(UINT64)];
+static BOOLEAN Seeded;
+
+/*
+ * Without an RNG protocol, use the seed an earlier stage left in the
+ * Linux random seed table: { UINT32 Size; UINT8 Bits[Size]; }. It is
+ * wiped once taken, as the kernel would after reading it.
+ */
+static BOOLEAN TakeRandomSeedTable(VOID)
+{
+    UINT8 *Table = Tables[TABLE_RANDOM_SEED];
+    UINT32 Size;
+
+    if (!Table)
+        return FALSE;
+    CopyMem(&Size, Table, sizeof(Size));
+    if (Size < sizeof(Seed))
+        return FALSE;
+    CopyMem(Seed, Table + sizeof(Size), sizeof(Seed));
+    ZeroMem(Table + sizeof(Size), Size);
+    return TRUE;
+}
+
+/*
+ * Get entropy for the kernel from firmware, and add /chosen/rng-seed
+ * and kaslr-seed to hold it. They are added as zeros and only filled
+ * in by FillRngSeed after the tree is measured, so its digest does not
+ * cover the secret and stays the same from boot to boot.
+ */
+static EFI_STATUS AddRngSeed(VOID *Dtb)
+{
+    static CONST UINT8 Zero[RNG_SEED_SIZE];
+    RNG_PROTOCOL *Rng;
+    EFI_STATUS status;
+    INTN Chosen;
+
+    status = LibLocateProtocol(&RngProtocolGuid, (VOID **)&Rng);
+    if (!EFI_ERROR(status))
+        status = Rng->GetRNG(Rng, NULL, sizeof(Seed), Seed);
+    if (EFI_ERROR(status) && !TakeRandomSeedTable())
+        return status;
+
+    Chosen = FdtChosen(Dtb);
+    if (Chosen < 0)
+        return EFI_NOT_FOUND;
+    status = FdtSetProp(Dtb, Chosen, "rng-seed", Zero, RNG_SEED_SIZE);
+    if (!EFI_ERROR(status))
+        status = FdtSetProp(Dtb, Chosen, "kaslr-seed", Zero, sizeof(UINT64));
+    Seeded = !EFI_ERROR(status);
+    return status;
+}
+
+static VOID FillRngSeed(VOID *Dtb)
+{
+    INTN Chosen = FdtChosen(Dtb);
+    VOID *Val;
+    UINT32 Len;
+
+    if (!Seeded)
+        return;
+    Val = (VOID *)FdtGetProp(Dtb, Chosen, "rng-seed", &Len);
+    if (Val && Len == RNG_SEED_SIZE)
+        CopyMem(Val, Seed, RNG_SEED_SIZE);
+    Val = (VOID *)FdtGetProp(Dtb, Chosen, "kaslr-seed", &Len);
+    if (Val && Len == sizeof(UINT64))
+        CopyMem(Val, Seed + RNG_SEED_SIZE, sizeof(UINT64));
+    ZeroMem(Seed, sizeof(Seed));
+}
+
+/*
+ * Tell a flat kernel where the ACPI RSDP and SMBIOS 3 entry point are,
+ * which it otherwise finds only through the EFI system table, and keep
+ * the memory ACPI and SMBIOS live in out of its hands. An EFI stub
+ * kernel gets the configuration tables itself.
+ */
+static EFI_STATUS PublishFirmwareTables(VOID *Dtb)
+{
+    EFI_MEMORY_DESCRIPTOR *Desc;
+    EFI_STATUS status = EFI_SUCCESS;
+    UINT8 *Map, *Structures;
+    UINTN MapSize, DescSize, i;
+    UINT32 Size;
+    INTN Chosen;
+
+    if (!Tables[TABLE_ACPI20] && !Tables[TABLE_SMBIOS3])
+        return EFI_SUCCESS;
+    Chosen = FdtChosen(Dtb);
+    if (Chosen < 0)
+        return EFI_NOT_FOUND;
+
+    if (Tables[TABLE_ACPI20]) {
+        status = FdtSetPropU64(Dtb, Chosen, "acpi-rsdp", (UINTN)Tables[TABLE_ACPI20]);
+        Map = (UINT8 *)ReadMemoryMap(&MapSize, &DescSize);
+        for (i = 0; Map && !EFI_ERROR(status) && i + DescSize <= MapSize; i += DescSize) {
+            Desc = (EFI_MEMORY_DESCRIPTOR *)(Map + i);
+            if (Desc->Type == EfiACPIReclaimMemory || Desc->Type == EfiACPIMemoryNVS)
+                status = FdtAddMemReserve(Dtb, Desc->PhysicalStart,
+                                          Desc->NumberOfPages * EFI_PAGE_SIZE);
+        }
+    }
+    if (!EFI_ERROR(status) && Tables[TABLE_SMBIOS3]) {
+        status = FdtSetPropU64(Dtb, Chosen, "smbios3-entrypoint",
+                               (UINTN)Tables[TABLE_SMBIOS3]);
+        Structures = SmbiosStructures(&Size);
+        if (!EFI_ERROR(status))
+            status = FdtAddMemReserve(Dtb, (UINTN)Tables[TABLE_SMBIOS3], 0x18);
+        if (!EFI_ERROR(status) && Structures && Size)
+            status = FdtAddMemReserve(Dtb, (UINTN)Structures, Size);
+    }
+    return status;
+}
+
+/*
+ * Copy the next space-separated path of List into Path. Returns FALSE
+ * at the end of the list.
+ */
+static BOOLEAN NextPath(CONST CHAR8 **List, CHAR16 *Path)
+{
+    CONST CHAR8 *p = *List;
+    UINTN Len, i;
+
+    if (!p)
+        return FALSE;
+    while (*p == ' ' || *p == '\t')
+        p++;
+    for (Len = 0; p[Len] && p[Len] != ' ' && p[Len] != '\t'; Len++)
+        ;
+    if (!Len)
+        return FALSE;
+    for (i = 0; i < Len && i + 1 < CONFIG_MAX_PATH; i++)
+        Path[i] = p[i];
+    Path[i] = 0;
+    *List = p + Len;
+    return TRUE;
+}
+
+/*
+ * Read a device tree file as stored, then log and check it like the
+ * initrd. Digest is its SHA-256. It is left gzipped, if it is, for
+ * UnpackDevicetree: with a cache hit it need not be.
+ */
+static EFI_STATUS LoadDevicetree(EFI_FILE_HANDLE Root, CHAR16 *Path, PAYLOAD *Out,
+                                 UINT8 *Digest)
+{
+    static FAT_FILE Extents;
+    EFI_STATUS status;
+    FILE_READER Reader;
+    SHA256_CTX Hash;
+
+    LogPrint(L"Loading device tree %s... ", Path);
+    status = OpenReader(Root, Path, &Extents, &Reader, NULL);
+    if (EFI_ERROR(status)) {
+        LogPrint(L"FAILED: %r\r\n", status);
+        return status;
+    }
+    Sha256Init(&Hash);
+    Reader.Hash = &Hash;
+    status = ReadPayload(&Reader, Out);
+    CloseReader(&Reader);
+    if (EFI_ERROR(status)) {
+        LogPrint(L"FAILED: %r\r\n", status);
+        return status;
+    }
+    Sha256Final(&Hash, Digest);
+    Stats.Dtb.Source = ReaderSource(&Reader);
+    LogPrint(L"OK (%d bytes%s)\r\n", Out->Size,
+             IsGzip((VOID *)Out->Addr, Out->Size) ? L", gzip" : L"");
+
+    MeasureFile("devicetree", Path, Digest);
+    if (SignaturesRequired) {
+        status = VerifySignature(Root, Path, NULL, Digest, L"device tree");
+        if (EFI_ERROR(status))
+            BS->FreePages(Out->Addr, Out->Pages);
+    }
+    return status;
+}
+
+/*
+ * Decompress a device tree from LoadDevicetree if it is gzipped, and
+ * check that it is one. Dtb is freed on failure.
+ */
+static EFI_STATUS UnpackDevicetree(PAYLOAD *Dtb)
+{
+    EFI_STATUS status;
+    PAYLOAD Packed;
+    UINTN Size;
+
+    if (IsGzip((VOID *)Dtb->Addr, Dtb->Size)) {
+        LogPrint(L"Decompressing device tree... ");
+        Packed = *Dtb;
+        status = AllocatePayload(GzipOriginalSize((VOID *)Packed.Addr, Packed.Size), NULL, Dtb);
+        if (!EFI_ERROR(status)) {
+            status = GzipDecompress((VOID *)Packed.Addr, Packed.Size,
+                                    (VOID *)Dtb->Addr, Dtb->Size, &Size);
+            if (EFI_ERROR(status))
+                BS->FreePages(Dtb->Addr, Dtb->Pages);
+        }
+        BS->FreePages(Packed.Addr, Packed.Pages);
+        if (EFI_ERROR(status)) {
+            LogPrint(L"FAILED: %r\r\n", status);
+            return status;
+        }
+        LogPrint(L"OK (%d bytes)\r\n", Dtb->Size);
+    }
+    if (!FdtCheckHeader((VOID *)Dtb->Addr, Dtb->Size)) {
+        LogPrint(L"Device tree file is not a device tree blob\r\n");
+        BS->FreePages(Dtb->Addr, Dtb->Pages);
+        return EFI_LOAD_ERROR;
+    }
+    return EFI_SUCCESS;
 }
 
 /*
- * Find the Device Tree Blob in EFI configuration tables
+ * Read a device tree overlay, then log and check it like the initrd
  */
-static VOID *FindDtb(EFI_SYSTEM_TABLE *ST)
+static EFI_STATUS LoadOverlay(EFI_FILE_HANDLE Root, CHAR16 *Path, PAYLOAD *Out,
+                              UINT8 *Digest)
+{
+    static FAT_FILE Extents;
+    EFI_STATUS status;
+    FILE_READER Reader;
+    SHA256_CTX Hash;
+
+    LogPrint(L"Loading overlay %s... ", Path);
+    status = OpenReader(Root, Path, &Extents, &Reader, NULL);
+    if (EFI_ERROR(status)) {
+        LogPrint(L"FAILED: %r\r\n", status);
+        return status;
+    }
+    Sha256Init(&Hash);
+    Reader.Hash = &Hash;
+    status = ReadPayload(&Reader, Out);
+    CloseReader(&Reader);
+    if (EFI_ERROR(status)) {
+        LogPrint(L"FAILED: %r\r\n", status);
+        return status;
+    }
+    if (!FdtCheckHeader((VOID *)Out->Addr, Out->Size)) {
+        LogPrint(L"FAILED: not a device tree blob\r\n");
+        status = EFI_LOAD_ERROR;
+        goto fail;
+    }
+    LogPrint(L"OK (%d bytes)\r\n", Out->Size);
+
+    Sha256Final(&Hash, Digest);
+    MeasureFile("dtbo", Path, Digest);
+    if (SignaturesRequired) {
+        status = VerifySignature(Root, Path, NULL, Digest, L"overlay");
+        if (EFI_ERROR(status))
+            goto fail;
+    }
+    return EFI_SUCCESS;
+
+fail:
+    BS->FreePages(Out->Addr, Out->Pages);
+    return status;
+}
+
+static VOID FreeOverlays(PAYLOAD *Overlays, UINTN Count)
 {
     UINTN i;
-    
-    for (i = 0; i < ST->NumberOfTableEntries; i++) {
-        EFI_GUID *g = &ST->ConfigurationTable[i].VendorGuid;
-        /* Note: gnu-efi 3.0 CompareGuid returns 0 when GUIDs are EQUAL */
-        if (CompareGuid(g, &DtbTableGuid) == 0) {
-            return ST->ConfigurationTable[i].VendorTable;
+
+    for (i = 0; i < Count; i++)
+        BS->FreePages(Overlays[i].Addr, Overlays[i].Pages);
+}
+
+/*
+ * Read the overlays an entry lists, before the DTB is relocated, so
+ * the copy can be made with room for them. Total is their size.
+ */
+static EFI_STATUS LoadOverlays(EFI_FILE_HANDLE Root, CONFIG_ENTRY *Entry,
+                               PAYLOAD *Overlays, UINT8 (*Digests)[SHA256_DIGEST_SIZE],
+                               UINTN *Count, UINTN *Total)
+{
+    CONST CHAR8 *List = CONFIG_STR(&Config, Entry->Dtbo);
+    CHAR16 Path[CONFIG_MAX_PATH];
+    EFI_STATUS status;
+
+    *Count = 0;
+    *Total = 0;
+    while (NextPath(&List, Path)) {
+        if (*Count == OVERLAY_MAX) {
+            LogPrint(L"More than %d overlays\r\n", OVERLAY_MAX);
+            status = EFI_OUT_OF_RESOURCES;
+            goto fail;
         }
+        status = LoadOverlay(Root, Path, &Overlays[*Count], Digests[*Count]);
+        if (EFI_ERROR(status))
+            goto fail;
+        *Total += Overlays[*Count].Size;
+        (*Count)++;
     }
-    return NULL;
+    return EFI_SUCCESS;
+
+fail:
+    FreeOverlays(Overlays, *Count);
+    return status;
 }
 
 /*
- * Get the boot hart ID via RISC-V EFI boot protocol
+ * Apply the loaded overlays to the relocated DTB, in order, and free them
  */
-static UINTN GetBootHartId(EFI_SYSTEM_TABLE *ST)
+static EFI_STATUS ApplyOverlays(VOID *Dtb, PAYLOAD *Overlays, UINTN Count)
 {
     EFI_STATUS status;
-    RISCV_EFI_BOOT_PROTOCOL *riscv_boot;
-    UINTN hart_id = 0;
+    UINTN i;
 
-    status = LibLocateProtocol(&RiscvBootProtocolGuid, (VOID **)&riscv_boot);
-    if (!EFI_ERROR(status) && riscv_boot && riscv_boot->GetBootHartId) {
-        riscv_boot->GetBootHartId(riscv_boot, &hart_id);
+    if (!Count)
+        return EFI_SUCCESS;
+    LogPrint(L"Applying %d overlays... ", Count);
+    status = OverlayBegin(Dtb);
+    for (i = 0; i < Count && !EFI_ERROR(status); i++) {
+        status = OverlayApply(Dtb, (VOID *)Overlays[i].Addr, Overlays[i].Size);
+        if (EFI_ERROR(status))
+            LogPrint(L"(overlay %d) ", i + 1);
     }
-    return hart_id;
+    OverlayEnd();
+    FreeOverlays(Overlays, Count);
+    if (EFI_ERROR(status))
+        LogPrint(L"FAILED: %r\r\n", status);
+    else
+        LogPrint(L"OK\r\n");
+    return status;
+}
+
+/*
+ * Whether the board is Board: one of the firmware tree's compatible
+ * strings, its model, or the SMBIOS product name
+ */
+static BOOLEAN BoardMatches(VOID *FwDtb, CONST CHAR8 *Product, CONST CHAR8 *Board)
+{
+    CONST CHAR8 *Compat, *Model;
+    UINT32 Len, i;
+
+    if (Product && strcmpa(Product, Board) == 0)
+        return TRUE;
+    if (!FwDtb)
+        return FALSE;
+    Model = FdtGetProp(FwDtb, 0, "model", &Len);
+    if (Model && Len > 0 && Model[Len - 1] == '\0' && strcmpa(Model, Board) == 0)
+        return TRUE;
+    Compat = FdtGetProp(FwDtb, 0, "compatible", &Len);
+    if (!Compat || Len == 0 || Compat[Len - 1] != '\0')
+        return FALSE;
+    for (i = 0; i < Len; i += strlena(Compat + i) + 1) {
+        if (strcmpa(Compat + i, Board) == 0)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+/*
+ * Pick the first devicetree line of loader.conf that is for this board
+ */
+static BOOLEAN SelectDevicetree(VOID *FwDtb, CHAR16 *Path)
+{
+    CONST CHAR8 *Product = SmbiosProduct(), *Line, *Board;
+    UINTN i;
+
+    for (i = 0; i < Config.DtbCount; i++) {
+        Line = CONFIG_STR(&Config, Config.Dtbs[i]);
+        Board = Line;
+        if (!NextPath(&Board, Path))
+            continue;
+        while (*Board == ' ' || *Board == '\t')
+            Board++;
+        if (!*Board || BoardMatches(FwDtb, Product, Board))
+            return TRUE;
+    }
+    return FALSE;
+}
+
+/*
+ * The device tree cache key: the SHA-256 of the devicetree file's
+ * digest or of the firmware tree, then of each overlay's digest.
+ * Digests are those the files were read with, so keying on contents
+ * costs no I/O beyond loading them, and a file replaced with one of the
+ * same size and timestamp can never bring back a stale tree.
+ */
+static VOID DtbCacheKey(VOID *FwDtb, UINT8 (*Digests)[SHA256_DIGEST_SIZE], UINTN Count,
+                        UINT8 *Key)
+{
+    SHA256_CTX Hash;
+    UINTN i;
+
+    Sha256Init(&Hash);
+    if (FwDtb)
+        Sha256Update(&Hash, FwDtb, GetDtbSize(FwDtb));
+    for (i = 0; i < Count; i++)
+        Sha256Update(&Hash, Digests[i], SHA256_DIGEST_SIZE);
+    Sha256Final(&Hash, Key);
+}
+
+/*
+ * Make the tree for a flat kernel, before the per-boot fixups: the
+ * firmware's or the devicetree file picked for the board, with the
+ * entry's overlays applied, relocated with room to spare. Comes from
+ * the device tree cache where it can. *Dtb is NULL if there is no tree.
+ */
+static EFI_STATUS PrepareDtb(EFI_FILE_HANDLE Root, CONFIG_ENTRY *Entry, VOID *FwDtb,
+                             BOOLEAN FromTable, VOID **Dtb)
+{
+    static UINT8 Digests[DTB_CACHE_FILES][SHA256_DIGEST_SIZE];
+    PAYLOAD Overlays[OVERLAY_MAX], DtbFile;
+    UINT8 Key[SHA256_DIGEST_SIZE];
+    CHAR16 DtbPath[CONFIG_MAX_PATH];
+    UINTN OverlayCount, OverlaySize, Count = 0;
+    BOOLEAN FromFile = FALSE, Cacheable;
+    EFI_STATUS status;
+    VOID *Base, *Cached;
+
+    *Dtb = NULL;
+    /* A tree in the configuration table is the firmware's final word */
+    if (!FromTable && Config.DtbCount) {
+        FromFile = SelectDevicetree(FwDtb, DtbPath);
+        if (!FromFile)
+            LogPrint(L"No devicetree for this board in %s\r\n", CONFIG_PATH);
+    }
+    if (!FromFile && !FwDtb)
+        return EFI_SUCCESS;
+
+    /*
+     * Every file is read, hashed and measured once, here; the cache
+     * only saves what comes after
+     */
+    Base = FwDtb;
+    Stats.Dtb.Source = SOURCE_FIRMWARE;
+    if (FromFile) {
+        status = LoadDevicetree(Root, DtbPath, &DtbFile, Digests[Count++]);
+        if (EFI_ERROR(status))
+            return status;
+    }
+    status = LoadOverlays(Root, Entry, Overlays, Digests + Count, &OverlayCount, &OverlaySize);
+    if (EFI_ERROR(status))
+        goto free_file;
+    Count += OverlayCount;
+
+    /* Unsigned, the cache could stand in for signed files */
+    Cacheable = (Config.Flags & CONFIG_DTB_CACHE) && !SignaturesRequired && Count;
+    if (Cacheable) {
+        DtbCacheKey(FromFile ? NULL : FwDtb, Digests, Count, Key);
+        if (!EFI_ERROR(DtbCacheLoad(Root, Key, &Cached))) {
+            FreeOverlays(Overlays, OverlayCount);
+            if (FromFile)
+                BS->FreePages(DtbFile.Addr, DtbFile.Pages);
+            *Dtb = FdtRelocate(Cached, FDT_EXTRA_SPACE);
+            FreePool(Cached);
+            if (!*Dtb) {
+                LogPrint(L"Relocating cached device tree... FAILED\r\n");
+                return EFI_OUT_OF_RESOURCES;
+            }
+            LogPrint(L"Device tree from cache\r\n");
+            Stats.Dtb.Source = SOURCE_CACHE;
+            return EFI_SUCCESS;
+        }
+    }
+
+    if (FromFile) {
+        status = UnpackDevicetree(&DtbFile);
+        if (EFI_ERROR(status)) {
+            FreeOverlays(Overlays, OverlayCount);
+            return status;
+        }
+        Base = (VOID *)DtbFile.Addr;
+    }
+    *Dtb = FdtRelocate(Base, FDT_EXTRA_SPACE + OverlaySize);
+    if (!*Dtb) {
+        LogPrint(L"Relocating device tree... FAILED\r\n");
+        FreeOverlays(Overlays, OverlayCount);
+        status = EFI_OUT_OF_RESOURCES;
+    }
+free_file:
+    if (FromFile)
+        BS->FreePages(DtbFile.Addr, DtbFile.Pages);
+    if (EFI_ERROR(status))
+        return status;
+    status = ApplyOverlays(*Dtb, Overlays, OverlayCount);
+    if (EFI_ERROR(status))
+        return status;
+
+    /* Not being able to cache the tree is no reason to fail the boot */
+    if (Cacheable) {
+        LogPrint(L"Writing device tree cache... ");
+        status = DtbCacheStore(Root, Key, *Dtb);
+        if (EFI_ERROR(status))
+            LogPrint(L"FAILED: %r\r\n", status);
+        else
+            LogPrint(L"OK\r\n");
+    }
+    return EFI_SUCCESS;
+}
+
+/*
+ * Open the root of the volume the loader was loaded from, and set up
+ * direct FAT32 reads from it if possible
+ */
+static EFI_STATUS OpenEsp(EFI_LOADED_IMAGE *LoadedImage, EFI_FILE_HANDLE *Root)
+{
+    EFI_FILE_IO_INTERFACE *Volume;
+    EFI_STATUS status;
+
+    /* Get file system protocol */
+    LogPrint(L"Getting file system protocol... ");
+    status = BS->HandleProtocol(LoadedImage->DeviceHandle,
+                                &gEfiSimpleFileSystemProtocolGuid,
+                                (VOID **)&Volume);
+    if (EFI_ERROR(status)) {
+        LogPrint(L"FAILED: %r\r\n", status);
+        return status;
+    }
+    LogPrint(L"OK\r\n");
+
+    /* Open root directory */
+    LogPrint(L"Opening root directory... ");
+    status = PROF_CALL(PROF_OPEN_VOLUME, 0, Volume->OpenVolume(Volume, Root));
+    if (EFI_ERROR(status)) {
+        LogPrint(L"FAILED: %r\r\n", status);
+        return status;
+    }
+    LogPrint(L"OK\r\n");
+
+    /* Large files are read straight from the partition when it is FAT32 */
+    if (EFI_ERROR(FatOpenVolume(LoadedImage->DeviceHandle, &FatVolume)))
+        FatVolume.Dev.BlockIo = NULL;
+    return EFI_SUCCESS;
+}
+
+/*
+ * Run a benchmark entry: time reads of its file and show the table
+ */
+static EFI_STATUS RunBenchmark(EFI_FILE_HANDLE Root, EFI_LOADED_IMAGE *LoadedImage,
+                               CONFIG_ENTRY *Entry)
+{
+    CHAR16 Path[CONFIG_MAX_PATH];
+    EFI_FILE_HANDLE File;
+    EFI_STATUS status;
+    UINTN Size;
+
+    AsciiToUnicode(Path, CONFIG_STR(&Config, Entry->Benchmark), CONFIG_MAX_PATH);
+    status = OpenFile(Root, Path, &File, &Size, NULL);
+    if (!EFI_ERROR(status)) {
+        status = Benchmark(File, Size, Path, LoadedImage->DeviceHandle, &FatVolume,
+                           GetTimebase(Tables[TABLE_DTB]));
+        File->Close(File);
+    }
+    if (EFI_ERROR(status))
+        LogPrint(L"Benchmark FAILED: %r\r\n", status);
+    return status;
 }
 
 /*
@@ -106,161 +2026,300 @@ efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable)
 {
     EFI_STATUS status;
     EFI_LOADED_IMAGE *LoadedImage;
-    EFI_FILE_IO_INTERFACE *Volume;
-    EFI_FILE_HANDLE RootDir, KernelFile;
-    EFI_FILE_INFO *FileInfo;
-    UINTN FileInfoSize;
-    UINT8 FileInfoBuffer[512];
-    UINTN KernelSize;
-    EFI_PHYSICAL_ADDRESS KernelAddr;
-    UINTN Pages;
+    EFI_FILE_HANDLE RootDir;
+    CONFIG_ENTRY *Entry;
+    CHAR16 KernelPath[CONFIG_MAX_PATH], InitrdPath[CONFIG_MAX_PATH], *Path = NULL;
+    CONST CHAR8 *Cmdline;
+    PAYLOAD Kernel, InitrdBuf, *Initrd = NULL;
+    BOOLEAN EfiStub, Cached, Warm;
     VOID *Dtb;
     UINTN HartId;
-    
+
     /* Memory map variables */
     UINT8 MemoryMapBuffer[MAX_MEMORY_MAP];
     UINTN MemoryMapSize, MapKey, DescriptorSize;
     UINT32 DescriptorVersion;
-    
+    UINT64 Timebase, ExitStart, ExitDone;
+
     kernel_entry_t KernelEntry;
 
     /* Initialize gnu-efi library */
     InitializeLib(ImageHandle, SystemTable);
 
+    /* Only in profiling builds: account every firmware call from here on */
+    ProfInit();
+    Stats.Start = ReadTime();
+
+    /* Without reserved pages the log still works, it just ends with the loader */
+    LogInit();
+    IndexTables();
+
     /* Print banner */
-    Print(L"\r\n");
-    Print(L"========================================\r\n");
-    Print(L"  RISC-V EFI Bootloader\r\n");
-    Print(L"========================================\r\n\r\n");
+    LogPrint(L"\r\n");
+    LogPrint(L"========================================\r\n");
+    LogPrint(L"  RISC-V EFI Bootloader\r\n");
+    LogPrint(L"========================================\r\n\r\n");
+
+    /* A public key compiled in makes payload signatures mandatory */
+    if (LOADER_PUBKEY[0]) {
+        if (!ParseHexDigest((CONST CHAR8 *)LOADER_PUBKEY, sizeof(LOADER_PUBKEY) - 1, PublicKey)) {
+            LogPrint(L"Embedded public key is invalid\r\n");
+            goto halt;
+        }
+        SignaturesRequired = TRUE;
+        LogPrint(L"Signed kernels and initrds required\r\n");
+    }
+
+    /* Without a log the boot goes on, just unmeasured */
+    LogPrint(L"Creating event log... ");
+    status = EventLogInit();
+    if (EFI_ERROR(status)) {
+        LogPrint(L"FAILED: %r\r\n", status);
+    } else {
+        Measured = TRUE;
+        LogPrint(L"OK\r\n");
+    }
 
     /* Get loaded image protocol */
-    Print(L"Getting loaded image protocol... ");
+    LogPrint(L"Getting loaded image protocol... ");
     status = BS->HandleProtocol(ImageHandle, &gEfiLoadedImageProtocolGuid,
                                 (VOID **)&LoadedImage);
     if (EFI_ERROR(status)) {
-        Print(L"FAILED: %r\r\n", status);
+        LogPrint(L"FAILED: %r\r\n", status);
         goto halt;
     }
-    Print(L"OK\r\n");
+    LogPrint(L"OK\r\n");
 
-    /* Get file system protocol */
-    Print(L"Getting file system protocol... ");
-    status = BS->HandleProtocol(LoadedImage->DeviceHandle,
-                                &gEfiSimpleFileSystemProtocolGuid,
-                                (VOID **)&Volume);
-    if (EFI_ERROR(status)) {
-        Print(L"FAILED: %r\r\n", status);
+    /* A loader with its payloads built in has no use for the ESP */
+    status = EmbedOpen(Uki);
+    if (!EFI_ERROR(status)) {
+        LogPrint(L"Booting embedded payloads\r\n");
+        RootDir = NULL;
+        BuiltinConfig(&Config);
+    } else if (status != EFI_NOT_FOUND) {
+        LogPrint(L"Unpacking embedded payloads... FAILED: %r\r\n", status);
         goto halt;
+    } else {
+        status = OpenEsp(LoadedImage, &RootDir);
+        if (EFI_ERROR(status))
+            goto halt;
+
+        /* Load boot configuration */
+        LogPrint(L"Loading %s... ", CONFIG_PATH);
+        status = LoadConfig(RootDir, &Config, &Cached);
+        if (status == EFI_NOT_FOUND)
+            LogPrint(L"not found, using built-in defaults\r\n");
+        else if (EFI_ERROR(status))
+            LogPrint(L"FAILED: %r, using built-in defaults\r\n", status);
+        else
+            LogPrint(L"OK (%d entries%s)\r\n", Config.EntryCount, Cached ? L", cached" : L"");
     }
-    Print(L"OK\r\n");
+    LogSetQuiet((Config.Flags & CONFIG_QUIET) != 0);
+    EndStage(STAGE_CONFIG);
 
-    /* Open root directory */
-    Print(L"Opening root directory... ");
-    status = Volume->OpenVolume(Volume, &RootDir);
-    if (EFI_ERROR(status)) {
-        Print(L"FAILED: %r\r\n", status);
-        goto halt;
+    /*
+     * The OS could rewrite the region before a warm reset, so cached
+     * copies are not used where payloads must be signed
+     */
+    if (Config.WarmCacheSize && !SignaturesRequired) {
+        LogPrint(L"Reserving warm cache at 0x%lx... ", Config.WarmCacheAddr);
+        status = WarmCacheOpen(Config.WarmCacheAddr, Config.WarmCacheSize, &Warm);
+        if (EFI_ERROR(status)) {
+            LogPrint(L"FAILED: %r\r\n", status);
+        } else {
+            WarmCache = TRUE;
+            LogPrint(L"OK%s\r\n", Warm ? L"" : L" (empty)");
+        }
     }
-    Print(L"OK\r\n");
 
-    /* Open kernel file */
-    Print(L"Opening kernel file %s... ", KERNEL_PATH);
-    status = RootDir->Open(RootDir, &KernelFile, KERNEL_PATH,
-                           EFI_FILE_MODE_READ, 0);
-    if (EFI_ERROR(status)) {
-        Print(L"FAILED: %r\r\n", status);
-        Print(L"\r\nPlease place kernel at %s on the ESP.\r\n", KERNEL_PATH);
-        goto halt;
+    if (LoadBootPlan(&Plan))
+        LogPrint(L"Boot plan found\r\n");
+
+    Entry = SelectEntry(&Config, LoadedImage);
+    LogPrint(L"Boot entry: %a\r\n", CONFIG_STR(&Config, Entry->Name));
+    Stats.Entry = CONFIG_STR(&Config, Entry->Name);
+
+    /* A benchmark entry boots nothing: it reports, then returns to the firmware */
+    if (RootDir && Entry->Benchmark) {
+        status = RunBenchmark(RootDir, LoadedImage, Entry);
+        RootDir->Close(RootDir);
+        LogPrint(L"\r\nPress any key to return to the firmware...\r\n");
+        LogFlush();
+        WaitForSingleEvent(ST->ConIn->WaitForKey, 0);
+        return status;
+    }
+    if (RootDir && (Entry->Kernel || Entry->Uki)) {
+        AsciiToUnicode(KernelPath, CONFIG_STR(&Config, Entry->Kernel ? Entry->Kernel : Entry->Uki),
+                       CONFIG_MAX_PATH);
+        Path = KernelPath;
     }
-    Print(L"OK\r\n");
+    if (Entry->Initrd)
+        AsciiToUnicode(InitrdPath, CONFIG_STR(&Config, Entry->Initrd), CONFIG_MAX_PATH);
+    if (RootDir && Entry->Initrd && !Entry->Uki)
+        StartInitrd(RootDir, InitrdPath);
 
-    /* Get kernel file info */
-    Print(L"Getting kernel file info... ");
-    FileInfoSize = sizeof(FileInfoBuffer);
-    status = KernelFile->GetInfo(KernelFile, &gEfiFileInfoGuid,
-                                  &FileInfoSize, FileInfoBuffer);
-    if (EFI_ERROR(status)) {
-        Print(L"FAILED: %r\r\n", status);
+    if (!RootDir)
+        status = PlaceUkiKernel(Entry, &Kernel, &EfiStub);
+    else if (Entry->Uki)
+        status = LoadUki(RootDir, Path, Entry, &Kernel, &EfiStub);
+    else
+        status = LoadKernel(RootDir, LoadedImage, Path, Entry, &Kernel, &EfiStub);
+    if (EFI_ERROR(status))
         goto halt;
-    }
-    FileInfo = (EFI_FILE_INFO *)FileInfoBuffer;
-    KernelSize = FileInfo->FileSize;
-    Print(L"OK (%d bytes)\r\n", KernelSize);
+    EndStage(STAGE_KERNEL);
 
-    /* Allocate memory for kernel */
-    Print(L"Allocating memory at 0x%lx... ", KERNEL_LOAD_ADDR);
-    KernelAddr = KERNEL_LOAD_ADDR;
-    Pages = EFI_SIZE_TO_PAGES(KernelSize);
-    status = BS->AllocatePages(AllocateAddress, EfiLoaderCode, Pages, &KernelAddr);
-    if (EFI_ERROR(status)) {
-        Print(L"(trying any address) ");
-        status = BS->AllocatePages(AllocateAnyPages, EfiLoaderCode, Pages, &KernelAddr);
-        if (EFI_ERROR(status)) {
-            Print(L"FAILED: %r\r\n", status);
+    /* A UKI's sections take the place of the entry's initrd and command line */
+    Cmdline = UkiCmdline();
+    if (!Cmdline)
+        Cmdline = CONFIG_STR(&Config, Entry->Cmdline);
+    if (Cmdline)
+        EventLogMeasure(PCR_CMDLINE, Cmdline, strlena(Cmdline), Cmdline, strlena(Cmdline));
+
+    if (Uki[UKI_INITRD].Size) {
+        InitrdBuf = Uki[UKI_INITRD];
+        Initrd = &InitrdBuf;
+        LogPrint(L"Initrd %s at 0x%lx (%d bytes)\r\n", RootDir ? L"from UKI" : L"embedded",
+                 Initrd->Addr, Initrd->Size);
+        Stats.Initrd.Source = SOURCE_UKI;
+        Stats.Initrd.Addr = Initrd->Addr;
+        Stats.Initrd.Size = Initrd->Size;
+    } else if (Entry->Initrd) {
+        status = LoadInitrd(RootDir, InitrdPath, Entry, &InitrdBuf);
+        if (EFI_ERROR(status))
             goto halt;
-        }
+        Initrd = &InitrdBuf;
+        EndStage(STAGE_INITRD);
     }
-    Print(L"OK at 0x%lx\r\n", KernelAddr);
 
-    /* Load kernel into memory */
-    Print(L"Loading kernel into memory... ");
-    status = KernelFile->Read(KernelFile, &KernelSize, (VOID *)KernelAddr);
-    if (EFI_ERROR(status)) {
-        Print(L"FAILED: %r\r\n", status);
+    /* EFI stub kernels do their own DTB and ExitBootServices handling */
+    if (EfiStub) {
+        /* It finds the UKI's device tree where it would find the firmware's */
+        if (Uki[UKI_DTB].Size && FdtCheckHeader((VOID *)Uki[UKI_DTB].Addr, Uki[UKI_DTB].Size)) {
+            LogPrint(L"Installing UKI device tree... ");
+            status = BS->InstallConfigurationTable(&DtbTableGuid, (VOID *)Uki[UKI_DTB].Addr);
+            if (EFI_ERROR(status)) {
+                LogPrint(L"FAILED: %r\r\n", status);
+                goto halt;
+            }
+            LogPrint(L"OK\r\n");
+            Tables[TABLE_DTB] = (VOID *)Uki[UKI_DTB].Addr;
+        }
+        Stats.Timebase = GetTimebase(Tables[TABLE_DTB]);
+        WriteStats(RootDir);
+        if (RootDir)
+            RootDir->Close(RootDir);
+        SaveBootPlan(&Plan);
+        IoTuneSave();
+        BootEfiStub(ImageHandle, LoadedImage, Path,
+                    &Kernel, Initrd, Cmdline);
         goto halt;
     }
-    Print(L"OK\r\n");
-
-    /* Close file handles */
-    KernelFile->Close(KernelFile);
-    RootDir->Close(RootDir);
 
     /* Find device tree - try EFI config table first, fall back to OpenSBI location */
-    Print(L"Looking for device tree... ");
-    VOID *OrigDtb = FindDtb(ST);
-    UINT32 DtbSize = 0;
-    
-    if (OrigDtb) {
-        DtbSize = GetDtbSize(OrigDtb);
-        if (DtbSize > 0) {
-            Print(L"EFI config table at 0x%lx (%d bytes)\r\n", (UINT64)OrigDtb, DtbSize);
-        } else {
-            OrigDtb = NULL;  /* Invalid, try fallback */
+    LogPrint(L"Looking for device tree... ");
+    VOID *FwDtb = NULL, *UkiDtb = NULL;
+
+    /* A UKI's own tree stands in for the firmware's */
+    if (Uki[UKI_DTB].Size && FdtCheckHeader((VOID *)Uki[UKI_DTB].Addr, Uki[UKI_DTB].Size))
+        FwDtb = UkiDtb = (VOID *)Uki[UKI_DTB].Addr;
+
+    /* A planned fallback location is only trusted while it still holds a DTB */
+    if (!FwDtb && Plan.DtbIndex == PLAN_DTB_FALLBACK) {
+        FwDtb = FallbackDtb();
+        if (!FwDtb)
+            Plan.DtbIndex = PLAN_DTB_NONE;
+    }
+    if (!FwDtb) {
+        FwDtb = FindDtb(&Plan.DtbIndex);
+        if (FwDtb && GetDtbSize(FwDtb) == 0)
+            FwDtb = NULL;  /* Invalid, try fallback */
+        if (!FwDtb) {
+            FwDtb = FallbackDtb();
+            Plan.DtbIndex = FwDtb ? PLAN_DTB_FALLBACK : PLAN_DTB_NONE;
         }
     }
-    
-    /* Fall back to OpenSBI's DTB location */
-    if (!OrigDtb || DtbSize == 0) {
-        OrigDtb = (VOID *)DTB_LOAD_ADDR;
-        DtbSize = GetDtbSize(OrigDtb);
-        if (DtbSize > 0) {
-            Print(L"OpenSBI location at 0x%lx (%d bytes)\r\n", (UINT64)OrigDtb, DtbSize);
-        } else {
-            Print(L"NOT FOUND\r\n");
-            OrigDtb = NULL;
+    if (!FwDtb)
+        LogPrint(L"NOT FOUND\r\n");
+    else if (FwDtb == UkiDtb)
+        LogPrint(L"%s at 0x%lx (%d bytes)\r\n", RootDir ? L"UKI section" : L"embedded",
+                 (UINT64)FwDtb, GetDtbSize(FwDtb));
+    else if (Plan.DtbIndex == PLAN_DTB_FALLBACK)
+        LogPrint(L"OpenSBI location at 0x%lx (%d bytes)\r\n", (UINT64)FwDtb, GetDtbSize(FwDtb));
+    else
+        LogPrint(L"EFI config table at 0x%lx (%d bytes)\r\n", (UINT64)FwDtb, GetDtbSize(FwDtb));
+    Plan.DtbSize = FwDtb ? GetDtbSize(FwDtb) : 0;
+
+    /* Copy the DTB for overlays, /chosen and the regions the loader hands over */
+    Stats.Stage = STAGE_DTB;
+    status = PrepareDtb(RootDir, Entry, FwDtb,
+                        UkiDtb || Plan.DtbIndex < PLAN_DTB_FALLBACK, &Dtb);
+    if (EFI_ERROR(status))
+        goto halt;
+    if (UkiDtb && Stats.Dtb.Source == SOURCE_FIRMWARE)
+        Stats.Dtb.Source = SOURCE_UKI;
+    if (Dtb) {
+        LogPrint(L"Updating device tree... ");
+        status = FixupChosen(Dtb, Cmdline, Initrd);
+        if (!EFI_ERROR(status) && WarmCache)
+            status = WarmCachePublish(Dtb);
+        /* The loader's own log is a nicety: a tree that cannot take it still boots */
+        if (!EFI_ERROR(status) && EFI_ERROR(LogPublish(Dtb)))
+            LogPrint(L"(no ramoops node) ");
+        if (!EFI_ERROR(status) && EFI_ERROR(FramebufferPublish(Dtb)))
+            LogPrint(L"(no framebuffer node) ");
+        if (!EFI_ERROR(status) && EFI_ERROR(PublishFirmwareTables(Dtb)))
+            LogPrint(L"(no ACPI/SMBIOS properties) ");
+        /* So is entropy: without it the kernel gathers its own, only later */
+        if (!EFI_ERROR(status) && EFI_ERROR(AddRngSeed(Dtb)))
+            LogPrint(L"(no RNG seed) ");
+        /* The published log size includes the DTB's own event, added below */
+        if (!EFI_ERROR(status) && Measured)
+            status = EventLogPublish(Dtb, EventLogEntrySize(sizeof(DtbEvent) - 1));
+        if (EFI_ERROR(status)) {
+            LogPrint(L"FAILED: %r\r\n", status);
+            goto halt;
         }
+        FdtPack(Dtb);
+        LogPrint(L"OK at 0x%lx\r\n", (UINT64)Dtb);
+        Stats.Dtb.Addr = (UINT64)Dtb;
+        Stats.Dtb.Size = GetDtbSize(Dtb);
+        if (Measured)
+            EventLogMeasure(PCR_FILES, Dtb, GetDtbSize(Dtb), DtbEvent, sizeof(DtbEvent) - 1);
+        FillRngSeed(Dtb);
+    } else if (Cmdline || Initrd) {
+        LogPrint(L"WARNING: no device tree, command line and initrd not passed\r\n");
     }
-    
-    /* Use the DTB in place (it's already in a good location) */
-    Dtb = OrigDtb;
 
     /* Get boot hart ID */
-    Print(L"Getting boot hart ID... ");
+    LogPrint(L"Getting boot hart ID... ");
     HartId = GetBootHartId(ST);
-    Print(L"OK (hart %d)\r\n", HartId);
+    LogPrint(L"OK (hart %d)\r\n", HartId);
+
+    EndStage(STAGE_DTB);
+
+    /* Remember what was resolved for the next boot */
+    SaveBootPlan(&Plan);
+    IoTuneSave();
+
+    Stats.Timebase = Timebase = GetTimebase(Dtb);
+    WriteStats(RootDir);
+    if (RootDir)
+        RootDir->Close(RootDir);
 
     /* Get memory map for ExitBootServices */
-    Print(L"\r\nPreparing to exit boot services...\r\n");
+    LogPrint(L"\r\nPreparing to exit boot services...\r\n");
+    LogHandover();
     MemoryMapSize = sizeof(MemoryMapBuffer);
     status = BS->GetMemoryMap(&MemoryMapSize, (EFI_MEMORY_DESCRIPTOR *)MemoryMapBuffer,
                               &MapKey, &DescriptorSize, &DescriptorVersion);
     if (EFI_ERROR(status)) {
-        Print(L"Failed to get memory map: %r\r\n", status);
+        LogPrint(L"Failed to get memory map: %r\r\n", status);
         goto halt;
     }
 
     /* Exit boot services */
-    Print(L"Exiting boot services...\r\n");
+    LogPrint(L"Exiting boot services...\r\n");
+    ExitStart = ReadTime();
     status = BS->ExitBootServices(ImageHandle, MapKey);
     if (EFI_ERROR(status)) {
         /* Memory map may have changed, try once more */
@@ -270,8 +2329,13 @@ efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable)
         status = BS->ExitBootServices(ImageHandle, MapKey);
     }
 
+    /* From here on the log goes to the SBI console */
+    LogBootServicesExited();
+    ExitDone = ReadTime();
+
     if (EFI_ERROR(status)) {
-        /* Can't print after failed ExitBootServices */
+        LogPrint(L"ExitBootServices failed: %r\r\n", status);
+        LogFlush();
         while (1) {
             __asm__ volatile("wfi");
         }
@@ -283,7 +2347,15 @@ efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable)
      *   a0 = hart id
      *   a1 = device tree pointer
      */
-    KernelEntry = (kernel_entry_t)KernelAddr;
+    KernelEntry = (kernel_entry_t)Kernel.Addr;
+    if (Timebase)
+        LogPrint(L"Boot services exited in %ld us, entering kernel at 0x%lx after %ld us\r\n",
+                 (ExitDone - ExitStart) * 1000000 / Timebase, Kernel.Addr,
+                 (ReadTime() - ExitStart) * 1000000 / Timebase);
+    else
+        LogPrint(L"Boot services exited, entering kernel at 0x%lx\r\n", Kernel.Addr);
+    ProfReport();
+    LogHandover();
     KernelEntry(HartId, Dtb);
 
     /* Should never reach here */
@@ -292,7 +2364,10 @@ efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable)
     }
 
 halt:
-    Print(L"\r\nBoot failed. Press any key...\r\n");
+    CancelInitrd();
+    ProfReport();
+    LogPrint(L"\r\nBoot failed. Press any key...\r\n");
+    LogFlush();
     WaitForSingleEvent(ST->ConIn->WaitForKey, 0);
     return EFI_LOAD_ERROR;
 }
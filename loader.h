@@ -0,0 +1,660 @@
+/*
+ * RISC-V EFI Bootloader - shared definitions
+ */
+
+#ifndef LOADER_H
+#define LOADER_H
+
+#include <efi.h>
+#include <efilib.h>
+
+/* Configuration defaults, used when \loader.conf is absent */
+#define KERNEL_PATH        L"\\kernel.bin"
+#define KERNEL_LOAD_ADDR   0x80200000ULL  /* Standard RISC-V Linux kernel load address */
+#define DTB_LOAD_ADDR      0x82200000ULL  /* DTB location (matches OpenSBI convention) */
+#define CONFIG_PATH        L"\\loader.conf"
+
+/* Vendor GUID for the loader's own EFI variables */
+extern EFI_GUID LoaderVendorGuid;
+
+/*
+ * A file loaded into page allocations
+ */
+typedef struct {
+    EFI_PHYSICAL_ADDRESS Addr;
+    UINTN Size;             /* Bytes of data */
+    UINTN Pages;            /* Pages allocated at Addr */
+} PAYLOAD;
+
+/*
+ * RISC-V Linux Image header (Documentation/arch/riscv/boot-image-header.rst)
+ */
+#define RISCV_IMAGE_MAGIC2 0x05435352    /* "RSC\x05" */
+#define PE_DOS_MAGIC       0x5a4d        /* "MZ" */
+#define PE_NT_MAGIC        0x00004550    /* "PE\0\0" */
+
+typedef struct {
+    UINT32 code0;
+    UINT32 code1;
+    UINT64 text_offset;
+    UINT64 image_size;
+    UINT64 flags;
+    UINT32 version;
+    UINT32 res1;
+    UINT64 res2;
+    UINT64 magic;
+    UINT32 magic2;
+    UINT32 res3;        /* PE header offset for EFI stub kernels */
+} RISCV_IMAGE_HEADER;
+
+/*
+ * Console log (log.c)
+ */
+#define LOG_RING_SIZE      0x4000         /* Bytes, a power of two for ramoops */
+
+EFI_STATUS LogInit(VOID);
+UINTN LogPrint(CONST CHAR16 *Fmt, ...);
+VOID LogFlush(VOID);
+VOID LogSetQuiet(BOOLEAN On);
+VOID LogHandover(VOID);
+VOID LogBootServicesExited(VOID);
+EFI_STATUS LogPublish(VOID *Fdt);
+
+/* efistub.c */
+BOOLEAN IsRiscvImage(RISCV_IMAGE_HEADER *Hdr, UINTN Size);
+BOOLEAN IsEfiStubImage(RISCV_IMAGE_HEADER *Hdr, UINTN Size, VOID *Buffer);
+EFI_STATUS BootEfiStub(EFI_HANDLE ImageHandle, EFI_LOADED_IMAGE *LoadedImage,
+                       CHAR16 *Path, PAYLOAD *Kernel, PAYLOAD *Initrd,
+                       CONST CHAR8 *Cmdline);
+
+/*
+ * Unified kernel images (uki.c)
+ */
+enum {
+    UKI_LINUX,
+    UKI_INITRD,
+    UKI_DTB,
+    UKI_CMDLINE,
+    UKI_SECTIONS
+};
+
+EFI_STATUS UkiParse(CONST VOID *Image, UINTN Size, PAYLOAD *Sections);
+
+/*
+ * Payloads built into the loader (embed.c), as UKI sections
+ */
+EFI_STATUS EmbedOpen(PAYLOAD *Sections);
+
+/*
+ * Boot configuration (config.c)
+ *
+ * The compiled form is position independent: strings live in a pool
+ * and entries refer to them by offset, so the structure can be stored
+ * in an EFI variable and used as-is on the next boot.
+ */
+#define CONFIG_MAGIC         0x4643524c   /* "LRCF" */
+#define CONFIG_VERSION       10
+#define CONFIG_MAX_ENTRIES   8
+#define CONFIG_MAX_DTBS      8
+#define CONFIG_POOL_SIZE     3072
+#define CONFIG_MAX_PATH      256
+
+enum {
+    COMPRESSION_AUTO = 0,
+    COMPRESSION_NONE,
+    COMPRESSION_GZIP,
+};
+
+typedef struct {
+    UINT16 Name;            /* Pool offsets, 0 = not set */
+    UINT16 Kernel;          /* Not set for raw partition kernels */
+    UINT16 Uki;             /* Unified kernel image, instead of Kernel */
+    UINT16 Benchmark;       /* File to time reads of, instead of booting */
+    UINT16 Initrd;
+    UINT16 Cmdline;
+    UINT32 Compression;
+    UINT16 Sha256;          /* Expected kernel digest, as hex */
+    UINT16 InitrdBlake3;    /* Expected initrd digest, as hex */
+    UINT16 Dtbo;            /* Device tree overlays, space separated */
+    UINT64 LoadAddr;        /* 0 = KERNEL_LOAD_ADDR */
+    EFI_GUID Partition;     /* Raw kernel partition type, if Kernel is not set */
+} CONFIG_ENTRY;
+
+typedef struct {
+    UINT32 Magic;
+    UINT32 Version;
+    UINT64 SourceSize;      /* Cache key: size and mtime of loader.conf */
+    EFI_TIME SourceTime;
+    UINT16 EntryCount;
+    UINT16 Default;
+    UINT16 PoolUsed;
+    UINT16 Flags;           /* CONFIG_* */
+    UINT64 WarmCacheAddr;   /* Warm-boot cache region, size 0 = none */
+    UINT64 WarmCacheSize;
+    UINT16 DtbCount;
+    UINT16 Dtbs[CONFIG_MAX_DTBS];   /* "<path> [<board>]", for boards without a DTB */
+    CONFIG_ENTRY Entries[CONFIG_MAX_ENTRIES];
+    CHAR8 Pool[CONFIG_POOL_SIZE];
+} LOADER_CONFIG;
+
+#define CONFIG_QUIET         0x0001       /* No console output on success */
+#define CONFIG_STATS         0x0002       /* Append boot statistics to the ESP */
+#define CONFIG_DTB_CACHE     0x0004       /* Keep the prepared device tree on the ESP */
+
+#define CONFIG_STR(Cfg, Off) ((Off) ? (CHAR8 *)&(Cfg)->Pool[Off] : NULL)
+
+EFI_STATUS LoadConfig(EFI_FILE_HANDLE Root, LOADER_CONFIG *Cfg, BOOLEAN *Cached);
+VOID BuiltinConfig(LOADER_CONFIG *Cfg);
+CONFIG_ENTRY *SelectEntry(LOADER_CONFIG *Cfg, EFI_LOADED_IMAGE *LoadedImage);
+VOID AsciiToUnicode(CHAR16 *Dst, CONST CHAR8 *Src, UINTN DstLen);
+
+/*
+ * Byte-addressed BlockIo reads (blockio.c)
+ */
+
+/* EFI_BLOCK_IO2_PROTOCOL, for reads queued while the loader works on */
+typedef struct {
+    EFI_EVENT Event;
+    EFI_STATUS TransactionStatus;
+} BLOCK_IO2_TOKEN;
+
+typedef struct _BLOCK_IO2_PROTOCOL {
+    EFI_BLOCK_IO_MEDIA *Media;
+    EFI_STATUS (EFIAPI *Reset)(struct _BLOCK_IO2_PROTOCOL *This, BOOLEAN ExtendedVerification);
+    EFI_STATUS (EFIAPI *ReadBlocksEx)(struct _BLOCK_IO2_PROTOCOL *This, UINT32 MediaId,
+                                      EFI_LBA Lba, BLOCK_IO2_TOKEN *Token,
+                                      UINTN BufferSize, VOID *Buffer);
+    VOID *WriteBlocksEx;
+    VOID *FlushBlocksEx;
+} BLOCK_IO2_PROTOCOL;
+
+typedef struct {
+    EFI_BLOCK_IO *BlockIo;  /* NULL if not open */
+    BLOCK_IO2_PROTOCOL *BlockIo2;   /* NULL if reads cannot be queued */
+    UINT32 MediaId;
+    UINT32 BlockSize;
+    UINT64 Base;            /* Byte offset that reads are relative to */
+    UINTN MaxTransfer;      /* Bytes per ReadBlocks, 0 = unlimited */
+    UINT8 *Bounce;          /* One block, for partial reads */
+    struct _IO_TUNE *Tune;  /* Transfer size measurements, NULL if none */
+} BLOCK_DEVICE;
+
+/* Handed each piece of a read as soon as it has landed */
+typedef VOID (*BLOCK_SINK)(VOID *Context, VOID *Data, UINTN Size);
+
+/* A queued read; reads that cannot be queued complete at once */
+typedef struct {
+    BLOCK_IO2_TOKEN Token;
+    EFI_STATUS Status;      /* Once done */
+    BOOLEAN Pending;
+} BLOCK_REQUEST;
+
+EFI_STATUS BlockOpen(EFI_BLOCK_IO *BlockIo, UINT64 Base, BLOCK_DEVICE *Dev);
+VOID BlockOpenQueue(BLOCK_DEVICE *Dev, EFI_HANDLE Handle);
+VOID BlockClose(BLOCK_DEVICE *Dev);
+EFI_STATUS BlockRead(BLOCK_DEVICE *Dev, UINT64 Offset, VOID *Buffer, UINTN Size);
+EFI_STATUS BlockReadSink(BLOCK_DEVICE *Dev, UINT64 Offset, VOID *Buffer, UINTN Size,
+                         BLOCK_SINK Sink, VOID *Context);
+EFI_STATUS BlockReadAsync(BLOCK_DEVICE *Dev, UINT64 Offset, VOID *Buffer, UINTN Size,
+                          BLOCK_REQUEST *Req);
+BOOLEAN BlockRequestDone(BLOCK_REQUEST *Req);
+VOID BlockRequestFree(BLOCK_REQUEST *Req);
+
+/*
+ * Transfer size tuning (iotune.c)
+ */
+#define TUNE_SIZES         7              /* 128 KiB to 4 MiB, and unlimited */
+
+typedef struct _IO_TUNE IO_TUNE;
+
+VOID IoTuneOpen(BLOCK_DEVICE *Dev, EFI_HANDLE Handle);
+UINTN IoTuneLimit(BLOCK_DEVICE *Dev, UINTN Size);
+VOID IoTuneSample(BLOCK_DEVICE *Dev, UINTN Size, UINT64 Ticks);
+VOID IoTuneSave(VOID);
+
+/*
+ * Cooperative tasks (sched.c)
+ */
+typedef struct _TASK {
+    BOOLEAN (*Step)(struct _TASK *Task);   /* Some progress; TRUE once finished */
+    EFI_STATUS Status;
+    BOOLEAN Finished;
+    struct _TASK *Next;
+} TASK;
+
+VOID SchedStart(TASK *Task);
+VOID SchedYield(VOID);
+EFI_STATUS SchedWait(TASK *Task);
+
+/*
+ * Direct FAT32 reader (fat.c)
+ *
+ * Files are described by their volume byte extents, so a file that
+ * was resolved once can be read again without walking directories.
+ */
+#define FAT_MAX_EXTENTS      32
+#define FAT_DIRECT_MIN       0x100000     /* Smaller files go through SimpleFileSystem */
+
+typedef struct {
+    BLOCK_DEVICE Dev;       /* Dev.BlockIo is NULL if the volume is not usable */
+    UINT32 ClusterSize;
+    UINT32 ClusterCount;
+    UINT32 RootCluster;
+    UINT64 FatOffset;       /* Byte offsets within the partition */
+    UINT64 DataOffset;
+} FAT_VOLUME;
+
+typedef struct {
+    UINT64 Offset;
+    UINT64 Length;
+} FAT_EXTENT;
+
+typedef struct {
+    UINT64 Size;
+    UINT64 DirentOffset;    /* Where the directory entry lives */
+    UINT8 Dirent[32];       /* The entry as found, to detect changes */
+    UINT32 ExtentCount;
+    UINT32 Reserved;
+    FAT_EXTENT Extents[FAT_MAX_EXTENTS];
+} FAT_FILE;
+
+EFI_STATUS FatOpenVolume(EFI_HANDLE Device, FAT_VOLUME *Vol);
+EFI_STATUS FatLookup(FAT_VOLUME *Vol, CONST CHAR16 *Path, FAT_FILE *File);
+BOOLEAN FatFileUnchanged(FAT_VOLUME *Vol, FAT_FILE *File);
+EFI_STATUS FatRead(FAT_VOLUME *Vol, FAT_FILE *File, UINT64 Offset,
+                   VOID *Buffer, UINTN Size, BLOCK_SINK Sink, VOID *Context);
+EFI_STATUS FatReadAsync(FAT_VOLUME *Vol, FAT_FILE *File, UINT64 Offset,
+                        VOID *Buffer, UINTN *Size, BLOCK_REQUEST *Req);
+
+/*
+ * Raw partition kernels (rawpart.c)
+ *
+ * Header in the first block of the partition; the image starts at
+ * HeaderSize, which must be a multiple of the block size.
+ */
+#define RAW_KERNEL_MAGIC     0x4e524b52   /* "RKRN" */
+
+typedef struct {
+    UINT32 Magic;
+    UINT32 HeaderSize;
+    UINT64 ImageSize;
+    UINT32 Compression;     /* COMPRESSION_*, AUTO detects */
+    UINT32 Crc32;           /* Of the ImageSize bytes as stored */
+    UINT8 Signature[64];    /* Ed25519, checked if a public key is compiled in */
+} RAW_KERNEL_HEADER;
+
+EFI_STATUS RawPartitionOpen(EFI_GUID *Type, BLOCK_DEVICE *Dev, RAW_KERNEL_HEADER *Hdr);
+
+/*
+ * Storage throughput benchmark (bench.c)
+ */
+EFI_STATUS Benchmark(EFI_FILE_HANDLE File, UINTN FileSize, CHAR16 *Path,
+                     EFI_HANDLE Device, FAT_VOLUME *Vol, UINT64 Timebase);
+
+/*
+ * Boot plan (bootplan.c)
+ *
+ * The decisions made while booting an entry, persisted in an EFI
+ * variable so that the next boot of the same, unchanged kernel can
+ * go straight to the bulk read instead of re-deriving them.
+ */
+#define PLAN_MAGIC           0x4e4c504c   /* "LPLN" */
+#define PLAN_VERSION         2
+#define PLAN_MAX_DEVICE_PATH 256
+#define PLAN_DTB_NONE        0xffffffff
+#define PLAN_DTB_FALLBACK    0xfffffffe   /* Found at DTB_LOAD_ADDR */
+
+enum {
+    KERNEL_FLAT = 0,
+    KERNEL_IMAGE,
+    KERNEL_EFI_STUB,
+};
+
+typedef struct {
+    UINT32 Magic;
+    UINT32 Version;
+
+    /* Key: the kernel file as it was, and the entry settings used */
+    UINT64 FileSize;
+    EFI_TIME FileTime;
+    UINT64 RequestedAddr;
+    UINT32 RequestedCompression;
+    UINT32 DevicePathSize;
+    UINT8 DevicePath[PLAN_MAX_DEVICE_PATH];
+
+    /* Decisions */
+    UINT32 Format;              /* KERNEL_* */
+    UINT32 Compression;         /* COMPRESSION_NONE or COMPRESSION_GZIP */
+    UINT64 LoadAddr;
+    UINT64 ImageSize;           /* Decompressed size */
+    UINT64 ImagePages;
+    UINT32 DtbIndex;            /* ConfigurationTable index or PLAN_DTB_* */
+    UINT32 DtbSize;
+
+    /* Kernel extents on a FAT32 ESP, ExtentCount 0 if not read directly */
+    FAT_FILE KernelExtents;
+} BOOT_PLAN;
+
+BOOLEAN LoadBootPlan(BOOT_PLAN *Plan);
+VOID SaveBootPlan(BOOT_PLAN *Plan);
+BOOLEAN BootPlanMatchesPath(BOOT_PLAN *Plan, EFI_DEVICE_PATH *FilePath,
+                            CONFIG_ENTRY *Entry);
+BOOLEAN BootPlanSetKey(BOOT_PLAN *Plan, EFI_DEVICE_PATH *FilePath,
+                       CONFIG_ENTRY *Entry, UINT64 FileSize, EFI_TIME *FileTime);
+
+/*
+ * Boot statistics (stats.c)
+ */
+#define STATS_MAX_SIZE     0x10000        /* Bytes, the log is rotated beyond this */
+
+enum {
+    STAGE_CONFIG,
+    STAGE_KERNEL,
+    STAGE_INITRD,
+    STAGE_DTB,
+    STAGES
+};
+
+enum {
+    SOURCE_NONE = 0,        /* Not loaded */
+    SOURCE_FILE,            /* Through SimpleFileSystem */
+    SOURCE_FAT,             /* FAT32 extents over BlockIo */
+    SOURCE_RAW,             /* Raw GPT partition */
+    SOURCE_WARM,            /* Warm-boot cache */
+    SOURCE_FIRMWARE,        /* Handed over by firmware */
+    SOURCE_CACHE,           /* Device tree cache */
+    SOURCE_UKI,             /* Section of a unified kernel image */
+};
+
+typedef struct {
+    UINT32 Source;          /* SOURCE_* */
+    UINT64 Addr;
+    UINT64 Size;            /* In memory */
+} STATS_PAYLOAD;
+
+typedef struct {
+    UINT64 Timebase;        /* Of the time CSR, 0 = unknown */
+    UINT64 Start;           /* ReadTime() on entry */
+    UINT64 End[STAGES];     /* ReadTime() as each stage ended, 0 = skipped */
+    UINT64 ReadBytes[STAGES];
+    UINT64 ReadTicks[STAGES];
+    UINTN Stage;            /* The stage under way */
+    UINT32 Retries;         /* Reads or allocations that had to fall back */
+    CONST CHAR8 *Entry;
+    UINT32 Format;          /* KERNEL_* */
+    BOOLEAN Gzip;
+    STATS_PAYLOAD Kernel;
+    STATS_PAYLOAD Initrd;
+    STATS_PAYLOAD Dtb;
+} BOOT_STATS;
+
+EFI_STATUS StatsWrite(EFI_FILE_HANDLE Root, BOOT_STATS *Stats);
+
+/*
+ * Flattened device tree (fdt.c)
+ *
+ * Node and property offsets are byte offsets into the structure
+ * block, as in libfdt. Negative values are errors.
+ */
+#define FDT_MAGIC          0xd00dfeed
+#define FDT_EXTRA_SPACE    0x10000        /* Room for fixups after relocation */
+
+/*
+ * Convert big-endian u32/u64 to native (and back)
+ */
+static inline UINT32 fdt32_to_cpu(UINT32 x)
+{
+    return ((x & 0xff000000) >> 24) |
+           ((x & 0x00ff0000) >> 8)  |
+           ((x & 0x0000ff00) << 8)  |
+           ((x & 0x000000ff) << 24);
+}
+
+static inline UINT64 fdt64_to_cpu(UINT64 x)
+{
+    return ((UINT64)fdt32_to_cpu((UINT32)x) << 32) | fdt32_to_cpu((UINT32)(x >> 32));
+}
+
+#define cpu_to_fdt32 fdt32_to_cpu
+#define cpu_to_fdt64 fdt64_to_cpu
+
+UINT32 GetDtbSize(VOID *Dtb);
+VOID *FdtRelocate(VOID *Dtb, UINTN Extra);
+INTN FdtPathOffset(VOID *Fdt, CONST char *Path);
+INTN FdtSubnodeOffset(VOID *Fdt, INTN Parent, CONST char *Name);
+INTN FdtAddSubnode(VOID *Fdt, INTN Parent, CONST char *Name);
+INTN FdtFirstSubnode(VOID *Fdt, INTN Parent);
+INTN FdtNextSubnode(VOID *Fdt, INTN Node);
+INTN FdtNextNode(VOID *Fdt, INTN Offset, INTN *Depth);
+CONST char *FdtGetName(VOID *Fdt, INTN Node);
+INTN FdtFirstProp(VOID *Fdt, INTN Node);
+INTN FdtNextProp(VOID *Fdt, INTN Prop);
+VOID *FdtPropAt(VOID *Fdt, INTN Prop, CONST char **Name, UINT32 *Len);
+BOOLEAN FdtCheckHeader(VOID *Fdt, UINTN Size);
+VOID FdtTrackOffsets(INTN *Offsets, UINTN Count);
+INTN FdtChosen(VOID *Fdt);
+CONST VOID *FdtGetProp(VOID *Fdt, INTN Node, CONST char *Name, UINT32 *Len);
+EFI_STATUS FdtSetProp(VOID *Fdt, INTN Node, CONST char *Name,
+                      CONST VOID *Val, UINT32 Len);
+EFI_STATUS FdtSetPropU64(VOID *Fdt, INTN Node, CONST char *Name, UINT64 Val);
+EFI_STATUS FdtSetPropString(VOID *Fdt, INTN Node, CONST char *Name,
+                            CONST CHAR8 *Str);
+EFI_STATUS FdtAddMemReserve(VOID *Fdt, UINT64 Addr, UINT64 Size);
+VOID FdtPack(VOID *Fdt);
+
+/*
+ * Framebuffer handoff (fb.c)
+ */
+EFI_STATUS FramebufferPublish(VOID *Fdt);
+
+/*
+ * Device tree overlays (overlay.c)
+ */
+#define OVERLAY_MAX        16             /* Per boot entry */
+
+EFI_STATUS OverlayBegin(VOID *Fdt);
+EFI_STATUS OverlayApply(VOID *Fdt, VOID *Dtbo, UINTN Size);
+VOID OverlayEnd(VOID);
+
+/*
+ * SHA-256 (sha256.c)
+ */
+#define SHA256_DIGEST_SIZE 32
+
+typedef struct {
+    UINT32 State[8];
+    UINT64 Length;
+    UINT8 Buffer[64];
+    UINTN Used;
+} SHA256_CTX;
+
+CONST CHAR16 *Sha256Probe(VOID *Dtb);
+VOID Sha256Init(SHA256_CTX *Ctx);
+VOID Sha256Update(SHA256_CTX *Ctx, CONST VOID *Data, UINTN Size);
+VOID Sha256Final(SHA256_CTX *Ctx, UINT8 *Digest);
+BOOLEAN ParseHexDigest(CONST CHAR8 *Hex, UINTN Len, UINT8 *Digest);
+
+/*
+ * Device tree cache (dtbcache.c)
+ *
+ * The tree as prepared from a devicetree file and overlays, keyed by
+ * the digests of those files.
+ */
+#define DTB_CACHE_FILES    (1 + OVERLAY_MAX)
+
+EFI_STATUS DtbCacheLoad(EFI_FILE_HANDLE Root, CONST UINT8 *Key, VOID **Dtb);
+EFI_STATUS DtbCacheStore(EFI_FILE_HANDLE Root, CONST UINT8 *Key, VOID *Dtb);
+
+/*
+ * Payload signatures (ed25519.c)
+ *
+ * Ed25519 over the 32-byte SHA-256 of the payload as stored. The
+ * public key is compiled in, as 64 hex digits in LOADER_PUBKEY (see
+ * ED25519_PUBKEY in the Makefile); when it is empty nothing is checked.
+ */
+#define ED25519_KEY_SIZE       32
+#define ED25519_SIGNATURE_SIZE 64
+
+#ifndef LOADER_PUBKEY
+#define LOADER_PUBKEY      ""
+#endif
+
+BOOLEAN Ed25519Verify(CONST UINT8 *PublicKey, CONST UINT8 *Sig,
+                      CONST VOID *Msg, UINTN MsgLen);
+
+/*
+ * Boot event log (eventlog.c)
+ *
+ * The configuration table has the layout of Linux's
+ * linux_efi_tpm_eventlog; Version 2 is the crypto-agile format.
+ */
+#define EVENT_LOG_SIZE     0x4000         /* Whole pages, allocated up front */
+#define EVENT_LOG_VERSION  2
+#define PCR_CMDLINE        8
+#define PCR_FILES          9
+
+typedef struct {
+    UINT32 Size;            /* Bytes of events so far */
+    UINT32 FinalEventsPrebootSize;
+    UINT8 Version;
+    UINT8 Events[];
+} LOADER_EVENT_LOG;
+
+extern EFI_GUID LoaderEventLogGuid;
+
+EFI_STATUS EventLogInit(VOID);
+UINTN EventLogEntrySize(UINTN DataSize);
+EFI_STATUS EventLogAppend(UINT32 Pcr, CONST UINT8 *Digest, CONST VOID *Data, UINTN DataSize);
+EFI_STATUS EventLogMeasure(UINT32 Pcr, CONST VOID *Buffer, UINTN Size,
+                           CONST VOID *Data, UINTN DataSize);
+EFI_STATUS EventLogPublish(VOID *Fdt, UINTN Pending);
+
+/*
+ * Warm-boot payload cache (warmcache.c)
+ */
+enum {
+    WARM_KERNEL = 0,
+    WARM_INITRD,
+    WARM_SLOTS,
+};
+
+EFI_STATUS WarmCacheOpen(UINT64 Addr, UINT64 Size, BOOLEAN *Warm);
+BOOLEAN WarmCacheLookup(UINTN Slot, CONST CHAR16 *Path, UINT64 FileSize, EFI_TIME *FileTime,
+                        VOID **Data, UINTN *Size, UINT8 *Digest);
+VOID WarmCacheStore(UINTN Slot, CONST CHAR16 *Path, UINT64 FileSize, EFI_TIME *FileTime,
+                    CONST VOID *Data, UINTN Size, CONST UINT8 *Digest);
+EFI_STATUS WarmCachePublish(VOID *Fdt);
+
+/*
+ * BLAKE3 (blake3.c)
+ */
+#define BLAKE3_DIGEST_SIZE 32
+
+EFI_STATUS Blake3Hash(CONST VOID *Data, UINTN Size, VOID *Dtb, UINTN BootHartId,
+                      UINT8 *Digest, UINTN *Harts);
+
+/*
+ * SBI calls (sbi.c)
+ */
+#define SBI_SUCCESS        0
+#define SBI_EXT_HSM        0x48534d      /* "HSM" */
+
+typedef struct {
+    INTN Error;
+    UINTN Value;
+} SBI_RET;
+
+SBI_RET SbiCall(UINTN Ext, UINTN Fid, UINTN Arg0, UINTN Arg1, UINTN Arg2);
+BOOLEAN SbiProbe(UINTN Ext);
+VOID SbiConsoleWrite(CONST CHAR8 *Buf, UINTN Len);
+
+/*
+ * Ticks of the time CSR, at /cpus/timebase-frequency
+ */
+static inline UINT64 ReadTime(VOID)
+{
+    UINT64 t;
+
+    __asm__ __volatile__("rdtime %0" : "=r"(t));
+    return t;
+}
+
+/*
+ * CPU cycles, for profiling
+ */
+static inline UINT64 ReadCycle(VOID)
+{
+    UINT64 c;
+
+    __asm__ __volatile__("rdcycle %0" : "=r"(c));
+    return c;
+}
+
+/*
+ * Firmware call profile (prof.c), built with LOADER_PROFILE
+ */
+enum {
+    PROF_ALLOCATE_PAGES,
+    PROF_FREE_PAGES,
+    PROF_GET_MEMORY_MAP,
+    PROF_ALLOCATE_POOL,
+    PROF_FREE_POOL,
+    PROF_INSTALL_PROTOCOL,
+    PROF_HANDLE_PROTOCOL,
+    PROF_LOCATE_HANDLE_BUFFER,
+    PROF_LOCATE_PROTOCOL,
+    PROF_INSTALL_CONFIG_TABLE,
+    PROF_LOAD_IMAGE,
+    PROF_START_IMAGE,
+    PROF_UNLOAD_IMAGE,
+    PROF_EXIT_BOOT_SERVICES,
+    PROF_STALL,
+    PROF_CALCULATE_CRC32,
+    PROF_COPY_MEM,
+    PROF_GET_VARIABLE,
+    PROF_SET_VARIABLE,
+    /* Protocol calls, accounted at the call site with PROF_CALL */
+    PROF_OPEN_VOLUME,
+    PROF_FILE_OPEN,
+    PROF_FILE_GET_INFO,
+    PROF_FILE_READ,
+    PROF_READ_BLOCKS,
+    PROF_SERVICES
+};
+
+#ifdef LOADER_PROFILE
+VOID ProfInit(VOID);
+VOID ProfAccount(UINTN Service, UINT64 Bytes, UINT64 Start);
+VOID ProfReport(VOID);
+
+/* Evaluate a firmware call, then account it with Bytes (evaluated after) */
+#define PROF_CALL(Service, Bytes, Call) ({                 \
+    UINT64 ProfStart_ = ReadCycle();                       \
+    EFI_STATUS ProfStatus_ = (Call);                       \
+    ProfAccount(Service, Bytes, ProfStart_);               \
+    ProfStatus_;                                           \
+})
+#else
+static inline VOID ProfInit(VOID) {}
+static inline VOID ProfReport(VOID) {}
+#define PROF_CALL(Service, Bytes, Call) (Call)
+#endif
+
+/*
+ * Secondary harts (smp.c)
+ */
+#define SMP_MAX_HARTS      32
+
+typedef VOID (*SMP_WORKER)(VOID *Arg);
+
+UINTN SmpRun(VOID *Dtb, UINTN BootHartId, SMP_WORKER Worker, VOID *Arg);
+
+/*
+ * gzip decompression (inflate.c)
+ */
+BOOLEAN IsGzip(CONST VOID *Buf, UINTN Size);
+UINTN GzipOriginalSize(CONST VOID *Buf, UINTN Size);
+EFI_STATUS GzipDecompress(CONST VOID *Src, UINTN SrcSize,
+                          VOID *Dst, UINTN DstSize, UINTN *OutSize);
+
+#endif /* LOADER_H */
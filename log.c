@@ -0,0 +1,217 @@
+/*
+ * Console log
+ *
+ * On a serial console every line printed costs milliseconds at
+ * 115200 baud, all of it spent synchronously in ConOut. Progress
+ * messages are therefore formatted into a ring buffer and written out
+ * in one go, when the loader hands over to the kernel or gives up. In
+ * quiet mode nothing is written on a successful boot, but a failure
+ * still shows the whole log. If the ring fills up, the oldest text is
+ * dropped.
+ *
+ * The ring is laid out as a pstore/ramoops console zone and lives in
+ * reserved memory, so it outlasts ExitBootServices: messages logged
+ * after the console is gone still land in it, and a flat kernel is
+ * pointed at it by a ramoops node under /reserved-memory. The booted
+ * system then shows the loader's log as /sys/fs/pstore/console-ramoops-0.
+ * Text is stored as ASCII with bare newlines, as pstore expects.
+ *
+ * Once boot services are gone, flushes go to the SBI console instead
+ * of ConOut, still as a single write where the SBI has DBCN.
+ */
+
+#include "loader.h"
+
+#define LOG_LINE_MAX       512            /* CHAR16s per LogPrint call */
+#define PSTORE_SIG         0x43474244     /* "DBGC", struct persistent_ram_buffer */
+
+typedef struct {
+    UINT32 Sig;
+    UINT32 Start;           /* Next write position */
+    UINT32 Size;            /* Bytes in use */
+    UINT8 Data[];
+} LOG_RING;
+
+#define LOG_CAPACITY       (LOG_RING_SIZE - sizeof(LOG_RING))
+
+/* Used until LogInit has reserved the ring, or if it could not */
+static UINT32 Early[LOG_RING_SIZE / sizeof(UINT32)];
+static LOG_RING *Ring = (LOG_RING *)Early;
+static BOOLEAN Reserved;
+
+static UINTN Unshown;       /* Bytes at the end not yet on the console */
+static BOOLEAN Quiet;
+static BOOLEAN Exited;      /* ConOut is gone, use the SBI console */
+
+/* Room for every newline to become CR LF */
+static CHAR16 Wide[2 * LOG_CAPACITY + 1];
+
+static VOID Append(CONST CHAR16 *Str, UINTN Len)
+{
+    UINTN i;
+
+    for (i = 0; i < Len; i++) {
+        if (Str[i] == '\r')
+            continue;
+        Ring->Data[Ring->Start++] = Str[i] < 0x80 ? (UINT8)Str[i] : '?';
+        if (Ring->Start == LOG_CAPACITY)
+            Ring->Start = 0;
+        if (Ring->Size < LOG_CAPACITY)
+            Ring->Size++;
+        if (Unshown < LOG_CAPACITY)
+            Unshown++;
+    }
+}
+
+/*
+ * Move the ring into reserved pages, so it survives the handover
+ */
+EFI_STATUS LogInit(VOID)
+{
+    EFI_PHYSICAL_ADDRESS Addr;
+    EFI_STATUS status;
+
+    status = BS->AllocatePages(AllocateAnyPages, EfiReservedMemoryType,
+                               EFI_SIZE_TO_PAGES(LOG_RING_SIZE), &Addr);
+    if (EFI_ERROR(status))
+        return status;
+    CopyMem((VOID *)Addr, Early, LOG_RING_SIZE);
+    Ring = (LOG_RING *)Addr;
+    Ring->Sig = PSTORE_SIG;
+    Reserved = TRUE;
+    return EFI_SUCCESS;
+}
+
+/*
+ * Print to the log, with the format of Print. Safe after
+ * ExitBootServices.
+ */
+UINTN LogPrint(CONST CHAR16 *Fmt, ...)
+{
+    CHAR16 Line[LOG_LINE_MAX];
+    va_list Args;
+    UINTN Len;
+
+    va_start(Args, Fmt);
+    Len = VSPrint(Line, sizeof(Line), Fmt, Args);
+    va_end(Args);
+    Append(Line, Len);
+    return Len;
+}
+
+/*
+ * Write what the console has not shown yet, oldest text first
+ */
+VOID LogFlush(VOID)
+{
+    CHAR8 *Narrow = (CHAR8 *)Wide;
+    UINTN Pos, n = 0, i;
+
+    Pos = (Ring->Start + LOG_CAPACITY - Unshown) % LOG_CAPACITY;
+    for (; Unshown > 0; Unshown--) {
+        if (Ring->Data[Pos] == '\n')
+            Wide[n++] = '\r';
+        Wide[n++] = Ring->Data[Pos];
+        Pos = (Pos + 1) % LOG_CAPACITY;
+    }
+    Wide[n] = 0;
+    if (!n)
+        return;
+    if (!Exited) {
+        ST->ConOut->OutputString(ST->ConOut, Wide);
+        return;
+    }
+    /* Narrowing in place is safe: each byte lands at or before its source */
+    for (i = 0; i < n; i++)
+        Narrow[i] = (CHAR8)Wide[i];
+    SbiConsoleWrite(Narrow, n);
+}
+
+VOID LogSetQuiet(BOOLEAN On)
+{
+    Quiet = On;
+}
+
+/*
+ * The boot is going ahead: show the log unless in quiet mode
+ */
+VOID LogHandover(VOID)
+{
+    if (!Quiet)
+        LogFlush();
+    Unshown = 0;
+}
+
+/*
+ * ExitBootServices has been called, successfully or not: ConOut can
+ * no longer be used
+ */
+VOID LogBootServicesExited(VOID)
+{
+    Exited = TRUE;
+}
+
+/*
+ * Describe the ring to a flat kernel as a ramoops console zone. A
+ * ring that never left loader memory is not published.
+ */
+EFI_STATUS LogPublish(VOID *Fdt)
+{
+    CONST UINT32 *Cells;
+    UINT32 Reg[4], Val, Len, AddrCells = 2, SizeCells = 2, n = 0;
+    INTN Parent, Node;
+    EFI_STATUS status;
+    char Name[32];
+    UINTN i;
+
+    if (!Reserved)
+        return EFI_SUCCESS;
+
+    Parent = FdtSubnodeOffset(Fdt, 0, "reserved-memory");
+    if (Parent < 0) {
+        Parent = FdtAddSubnode(Fdt, 0, "reserved-memory");
+        if (Parent < 0)
+            return EFI_BUFFER_TOO_SMALL;
+        Val = cpu_to_fdt32(2);
+        status = FdtSetProp(Fdt, Parent, "#address-cells", &Val, sizeof(Val));
+        if (!EFI_ERROR(status))
+            status = FdtSetProp(Fdt, Parent, "#size-cells", &Val, sizeof(Val));
+        if (!EFI_ERROR(status))
+            status = FdtSetProp(Fdt, Parent, "ranges", NULL, 0);
+        if (EFI_ERROR(status))
+            return status;
+    } else {
+        Cells = FdtGetProp(Fdt, Parent, "#address-cells", &Len);
+        if (Cells && Len == 4)
+            AddrCells = fdt32_to_cpu(*Cells);
+        Cells = FdtGetProp(Fdt, Parent, "#size-cells", &Len);
+        if (Cells && Len == 4)
+            SizeCells = fdt32_to_cpu(*Cells);
+        if (AddrCells < 1 || AddrCells > 2 || SizeCells < 1 || SizeCells > 2 ||
+            (AddrCells == 1 && (UINT64)Ring >> 32))
+            return EFI_UNSUPPORTED;
+    }
+
+    if (AddrCells == 2)
+        Reg[n++] = cpu_to_fdt32((UINT32)((UINT64)Ring >> 32));
+    Reg[n++] = cpu_to_fdt32((UINT32)(UINT64)Ring);
+    if (SizeCells == 2)
+        Reg[n++] = 0;
+    Reg[n++] = cpu_to_fdt32(LOG_RING_SIZE);
+
+    Len = SPrint(Wide, sizeof(Wide), L"ramoops@%lx", (UINT64)Ring);
+    for (i = 0; i <= Len; i++)
+        Name[i] = (char)Wide[i];
+
+    Node = FdtAddSubnode(Fdt, Parent, Name);
+    if (Node < 0)
+        return EFI_BUFFER_TOO_SMALL;
+    status = FdtSetPropString(Fdt, Node, "compatible", (CONST CHAR8 *)"ramoops");
+    if (!EFI_ERROR(status))
+        status = FdtSetProp(Fdt, Node, "reg", Reg, n * sizeof(UINT32));
+    if (!EFI_ERROR(status)) {
+        Val = cpu_to_fdt32(LOG_RING_SIZE);
+        status = FdtSetProp(Fdt, Node, "console-size", &Val, sizeof(Val));
+    }
+    return status;
+}
@@ -0,0 +1,497 @@
+/*
+ * Device tree overlays
+ *
+ * Overlays (.dtbo, as built by dtc -@) are applied to the relocated
+ * device tree the way libfdt's fdt_overlay_apply does it:
+ *
+ *   - the overlay's phandles are moved above the highest one in the
+ *     tree, and the references to them listed in __local_fixups__
+ *     follow;
+ *   - references to labels of the tree, listed in __fixups__, are
+ *     resolved through the tree's __symbols__;
+ *   - each fragment's __overlay__ node is merged into its target,
+ *     given by phandle ("target") or path ("target-path");
+ *   - the overlay's own __symbols__ are added to the tree's, so later
+ *     overlays can refer to its labels.
+ *
+ * Fragment targets are looked up in a hash of phandle to node offset,
+ * built before the first overlay and extended with the phandles each
+ * overlay brings in. It is sized for twice the tree's phandles, so
+ * overlays have room to add theirs; should it fill up anyway, or not be
+ * allocated at all, phandles it misses are found by scanning the tree.
+ * fdt.c keeps the offsets current as the tree is edited, so no overlay
+ * has to scan the tree to find a target, however many are applied.
+ *
+ * Overlays are edited in place while being applied.
+ */
+
+#include "loader.h"
+
+#define PHANDLE_SLOTS_MIN  2048           /* Power of two */
+#define OVERLAY_MAX_PATH   256
+#define OVERLAY_MAX_DEPTH  16
+
+static UINT32 *SlotPhandle;     /* 0 = free */
+static INTN *SlotNode;
+static UINTN Slots;             /* Power of two, or 0 */
+static BOOLEAN Overflow;        /* Some phandles are not in the table */
+static UINT32 MaxPhandle;
+
+static UINTN AsciiLen(CONST char *s)
+{
+    UINTN n = 0;
+
+    while (s[n])
+        n++;
+    return n;
+}
+
+/* Cells referred to by fixups need not be aligned */
+static UINT32 GetU32(CONST UINT8 *p)
+{
+    return ((UINT32)p[0] << 24) | ((UINT32)p[1] << 16) | ((UINT32)p[2] << 8) | p[3];
+}
+
+static VOID PutU32(UINT8 *p, UINT32 v)
+{
+    p[0] = (UINT8)(v >> 24);
+    p[1] = (UINT8)(v >> 16);
+    p[2] = (UINT8)(v >> 8);
+    p[3] = (UINT8)v;
+}
+
+static BOOLEAN IsPhandleProp(CONST char *Name)
+{
+    CONST char *Phandle = "phandle", *Linux = "linux,phandle";
+
+    return CompareMem(Name, Phandle, AsciiLen(Phandle) + 1) == 0 ||
+           CompareMem(Name, Linux, AsciiLen(Linux) + 1) == 0;
+}
+
+static UINT32 NodePhandle(VOID *Fdt, INTN Node)
+{
+    CONST UINT8 *Val;
+    UINT32 Len;
+
+    Val = FdtGetProp(Fdt, Node, "phandle", &Len);
+    if (!Val)
+        Val = FdtGetProp(Fdt, Node, "linux,phandle", &Len);
+    return Val && Len == 4 ? GetU32(Val) : 0;
+}
+
+static UINTN SlotOf(UINT32 Phandle)
+{
+    return (Phandle * 2654435761U) & (Slots - 1);
+}
+
+static VOID MapAdd(UINT32 Phandle, INTN Node)
+{
+    UINTN i = SlotOf(Phandle), n;
+
+    if (Phandle == 0 || Phandle == 0xffffffff)
+        return;
+    if (Phandle > MaxPhandle)
+        MaxPhandle = Phandle;
+    for (n = 0; n < Slots; n++, i = (i + 1) & (Slots - 1)) {
+        if (SlotPhandle[i] == 0 || SlotPhandle[i] == Phandle) {
+            SlotPhandle[i] = Phandle;
+            SlotNode[i] = Node;
+            return;
+        }
+    }
+    Overflow = TRUE;
+}
+
+static INTN MapFind(VOID *Fdt, UINT32 Phandle)
+{
+    UINTN i = SlotOf(Phandle), n;
+    INTN Node, Depth = 0;
+
+    for (n = 0; n < Slots && SlotPhandle[i]; n++, i = (i + 1) & (Slots - 1)) {
+        if (SlotPhandle[i] == Phandle)
+            return SlotNode[i];
+    }
+    if (!Overflow || Phandle == 0)
+        return -1;
+    for (Node = 0; Node >= 0; Node = FdtNextNode(Fdt, Node, &Depth)) {
+        if (NodePhandle(Fdt, Node) == Phandle)
+            return Node;
+    }
+    return -1;
+}
+
+/*
+ * Absolute path of a node, found by walking the tree down to it
+ */
+static BOOLEAN NodePath(VOID *Fdt, INTN Target, char *Buf, UINTN Size)
+{
+    CONST char *Names[OVERLAY_MAX_DEPTH];
+    INTN Node = 0, Depth = 0, d;
+    UINTN Len = 0, n;
+
+    while (Node >= 0 && Node != Target) {
+        Node = FdtNextNode(Fdt, Node, &Depth);
+        if (Node >= 0 && Depth < OVERLAY_MAX_DEPTH)
+            Names[Depth] = FdtGetName(Fdt, Node);
+    }
+    if (Node < 0 || Depth >= OVERLAY_MAX_DEPTH)
+        return FALSE;
+
+    Buf[Len++] = '/';
+    for (d = 1; d <= Depth; d++) {
+        n = AsciiLen(Names[d]);
+        if (Len + n + 2 > Size)
+            return FALSE;
+        if (d > 1)
+            Buf[Len++] = '/';
+        CopyMem(Buf + Len, (VOID *)Names[d], n);
+        Len += n;
+    }
+    Buf[Len] = '\0';
+    return TRUE;
+}
+
+/*
+ * Start applying overlays to Fdt: count its phandles, then index them
+ */
+EFI_STATUS OverlayBegin(VOID *Fdt)
+{
+    INTN Node, Depth = 0;
+    UINTN Count = 0, i;
+
+    for (Node = 0; Node >= 0; Node = FdtNextNode(Fdt, Node, &Depth))
+        Count += NodePhandle(Fdt, Node) != 0;
+    for (Slots = PHANDLE_SLOTS_MIN; Slots < 2 * Count; Slots *= 2)
+        ;
+    SlotPhandle = AllocatePool(Slots * sizeof(*SlotPhandle));
+    SlotNode = AllocatePool(Slots * sizeof(*SlotNode));
+    if (SlotPhandle && SlotNode) {
+        ZeroMem(SlotPhandle, Slots * sizeof(*SlotPhandle));
+        for (i = 0; i < Slots; i++)
+            SlotNode[i] = -1;
+    } else {
+        /* No table: every target is found by scanning the tree */
+        OverlayEnd();
+    }
+    Overflow = Slots == 0;
+    MaxPhandle = 0;
+
+    Depth = 0;
+    for (Node = 0; Node >= 0; Node = FdtNextNode(Fdt, Node, &Depth))
+        MapAdd(NodePhandle(Fdt, Node), Node);
+    FdtTrackOffsets(SlotNode, Slots);
+    return EFI_SUCCESS;
+}
+
+VOID OverlayEnd(VOID)
+{
+    FdtTrackOffsets(NULL, 0);
+    if (SlotPhandle)
+        FreePool(SlotPhandle);
+    if (SlotNode)
+        FreePool(SlotNode);
+    SlotPhandle = NULL;
+    SlotNode = NULL;
+    Slots = 0;
+}
+
+/*
+ * Move all of the overlay's phandles up by Delta
+ */
+static EFI_STATUS RenumberPhandles(VOID *Dtbo, UINT32 Delta)
+{
+    CONST char *Name;
+    UINT8 *Val;
+    UINT32 Len, Phandle;
+    INTN Node = 0, Depth = 0, Prop;
+
+    for (; Node >= 0; Node = FdtNextNode(Dtbo, Node, &Depth)) {
+        for (Prop = FdtFirstProp(Dtbo, Node); Prop >= 0; Prop = FdtNextProp(Dtbo, Prop)) {
+            Val = FdtPropAt(Dtbo, Prop, &Name, &Len);
+            if (!IsPhandleProp(Name) || Len != 4)
+                continue;
+            Phandle = GetU32(Val) + Delta;
+            if (Phandle <= Delta || Phandle == 0xffffffff)
+                return EFI_LOAD_ERROR;
+            PutU32(Val, Phandle);
+        }
+    }
+    return EFI_SUCCESS;
+}
+
+/*
+ * Follow the phandles moved by Delta in the overlay's references to
+ * its own nodes. Fixups mirrors the overlay tree from Node down; each
+ * of its properties lists the offsets of phandle cells in the property
+ * of the same name.
+ */
+static EFI_STATUS LocalFixups(VOID *Dtbo, INTN Fixups, INTN Node, UINT32 Delta)
+{
+    CONST char *Name;
+    UINT8 *Offsets, *Val;
+    UINT32 Len, ValLen, Off, i;
+    INTN Prop, Sub, Child;
+    EFI_STATUS status;
+
+    for (Prop = FdtFirstProp(Dtbo, Fixups); Prop >= 0; Prop = FdtNextProp(Dtbo, Prop)) {
+        Offsets = FdtPropAt(Dtbo, Prop, &Name, &Len);
+        Val = (UINT8 *)FdtGetProp(Dtbo, Node, Name, &ValLen);
+        if (!Val || Len % 4)
+            return EFI_LOAD_ERROR;
+        for (i = 0; i < Len; i += 4) {
+            Off = GetU32(Offsets + i);
+            if (ValLen < 4 || Off > ValLen - 4)
+                return EFI_LOAD_ERROR;
+            PutU32(Val + Off, GetU32(Val + Off) + Delta);
+        }
+    }
+    for (Sub = FdtFirstSubnode(Dtbo, Fixups); Sub >= 0; Sub = FdtNextSubnode(Dtbo, Sub)) {
+        Child = FdtSubnodeOffset(Dtbo, Node, FdtGetName(Dtbo, Sub));
+        if (Child < 0)
+            return EFI_LOAD_ERROR;
+        status = LocalFixups(Dtbo, Sub, Child, Delta);
+        if (EFI_ERROR(status))
+            return status;
+    }
+    return EFI_SUCCESS;
+}
+
+/*
+ * Write Phandle into the cell named by a "<path>:<property>:<offset>"
+ * reference in the overlay
+ */
+static EFI_STATUS ApplyFixup(VOID *Dtbo, CONST char *Ref, UINTN RefLen, UINT32 Phandle)
+{
+    char Buf[OVERLAY_MAX_PATH];
+    char *Prop = NULL, *Off = NULL;
+    UINT8 *Val;
+    UINT32 Len, Offset = 0;
+    UINTN i;
+    INTN Node;
+
+    if (RefLen >= sizeof(Buf))
+        return EFI_LOAD_ERROR;
+    CopyMem(Buf, (VOID *)Ref, RefLen);
+    Buf[RefLen] = '\0';
+    for (i = 0; i < RefLen; i++) {
+        if (Buf[i] != ':')
+            continue;
+        Buf[i] = '\0';
+        if (!Prop) {
+            Prop = &Buf[i + 1];
+        } else {
+            Off = &Buf[i + 1];
+            break;
+        }
+    }
+    if (!Off || !*Off)
+        return EFI_LOAD_ERROR;
+    for (; *Off; Off++) {
+        if (*Off < '0' || *Off > '9')
+            return EFI_LOAD_ERROR;
+        Offset = Offset * 10 + (*Off - '0');
+    }
+
+    Node = FdtPathOffset(Dtbo, Buf);
+    Val = Node >= 0 ? (UINT8 *)FdtGetProp(Dtbo, Node, Prop, &Len) : NULL;
+    if (!Val || Len < 4 || Offset > Len - 4)
+        return EFI_LOAD_ERROR;
+    PutU32(Val + Offset, Phandle);
+    return EFI_SUCCESS;
+}
+
+/*
+ * Resolve the overlay's references to labels of the tree
+ */
+static EFI_STATUS ExternalFixups(VOID *Fdt, VOID *Dtbo, INTN Fixups)
+{
+    CONST char *Label, *Path, *Ref, *End;
+    UINT32 Len, PathLen, Phandle;
+    INTN Symbols, Prop, Node;
+    EFI_STATUS status;
+    UINTN n;
+
+    Symbols = FdtSubnodeOffset(Fdt, 0, "__symbols__");
+    for (Prop = FdtFirstProp(Dtbo, Fixups); Prop >= 0; Prop = FdtNextProp(Dtbo, Prop)) {
+        Ref = FdtPropAt(Dtbo, Prop, &Label, &Len);
+        Path = Symbols >= 0 ? FdtGetProp(Fdt, Symbols, Label, &PathLen) : NULL;
+        Node = Path && PathLen > 0 && Path[PathLen - 1] == '\0' ? FdtPathOffset(Fdt, Path) : -1;
+        Phandle = Node >= 0 ? NodePhandle(Fdt, Node) : 0;
+        if (!Phandle) {
+            LogPrint(L"(no label %a) ", Label);
+            return EFI_NOT_FOUND;
+        }
+        for (End = Ref + Len; Ref < End; Ref += n + 1) {
+            for (n = 0; Ref + n < End && Ref[n]; n++)
+                ;
+            status = ApplyFixup(Dtbo, Ref, n, Phandle);
+            if (EFI_ERROR(status))
+                return status;
+        }
+    }
+    return EFI_SUCCESS;
+}
+
+/*
+ * Copy the properties and subnodes of an overlay node into Target
+ */
+static EFI_STATUS MergeNode(VOID *Fdt, INTN Target, VOID *Dtbo, INTN Node)
+{
+    CONST char *Name;
+    VOID *Val;
+    UINT32 Len;
+    INTN Prop, Sub, Child;
+    EFI_STATUS status;
+
+    for (Prop = FdtFirstProp(Dtbo, Node); Prop >= 0; Prop = FdtNextProp(Dtbo, Prop)) {
+        Val = FdtPropAt(Dtbo, Prop, &Name, &Len);
+        status = FdtSetProp(Fdt, Target, Name, Val, Len);
+        if (EFI_ERROR(status))
+            return status;
+        if (IsPhandleProp(Name) && Len == 4)
+            MapAdd(GetU32(Val), Target);
+    }
+    for (Sub = FdtFirstSubnode(Dtbo, Node); Sub >= 0; Sub = FdtNextSubnode(Dtbo, Sub)) {
+        Name = FdtGetName(Dtbo, Sub);
+        Child = FdtSubnodeOffset(Fdt, Target, Name);
+        if (Child < 0)
+            Child = FdtAddSubnode(Fdt, Target, Name);
+        if (Child < 0)
+            return EFI_BUFFER_TOO_SMALL;
+        status = MergeNode(Fdt, Child, Dtbo, Sub);
+        if (EFI_ERROR(status))
+            return status;
+    }
+    return EFI_SUCCESS;
+}
+
+/*
+ * The node of the tree a fragment applies to
+ */
+static INTN FragmentTarget(VOID *Fdt, VOID *Dtbo, INTN Fragment)
+{
+    CONST char *Path;
+    CONST UINT8 *Phandle;
+    UINT32 Len;
+
+    Phandle = FdtGetProp(Dtbo, Fragment, "target", &Len);
+    if (Phandle && Len == 4)
+        return MapFind(Fdt, GetU32(Phandle));
+    Path = FdtGetProp(Dtbo, Fragment, "target-path", &Len);
+    if (Path && Len > 0 && Path[Len - 1] == '\0')
+        return FdtPathOffset(Fdt, Path);
+    return -1;
+}
+
+static BOOLEAN IsFragment(VOID *Dtbo, INTN Node)
+{
+    CONST char *Name = FdtGetName(Dtbo, Node);
+
+    return Name[0] != '_' || Name[1] != '_';
+}
+
+/*
+ * Add the overlay's labels to the tree's __symbols__, with their
+ * "/<fragment>/__overlay__/..." paths rewritten to where the nodes
+ * ended up
+ */
+static EFI_STATUS MergeSymbols(VOID *Fdt, VOID *Dtbo, INTN OverlaySymbols)
+{
+    CONST char *Overlay = "/__overlay__";
+    CONST char *Label, *Path, *Rest;
+    char Fragment[OVERLAY_MAX_PATH], NewPath[OVERLAY_MAX_PATH];
+    UINT32 Len;
+    UINTN n, m;
+    INTN Symbols, Prop, Frag, Target;
+    EFI_STATUS status;
+
+    Symbols = FdtSubnodeOffset(Fdt, 0, "__symbols__");
+    if (Symbols < 0)
+        Symbols = FdtAddSubnode(Fdt, 0, "__symbols__");
+    if (Symbols < 0)
+        return EFI_BUFFER_TOO_SMALL;
+
+    for (Prop = FdtFirstProp(Dtbo, OverlaySymbols); Prop >= 0;
+         Prop = FdtNextProp(Dtbo, Prop)) {
+        Path = FdtPropAt(Dtbo, Prop, &Label, &Len);
+        if (Len < 2 || Path[0] != '/' || Path[Len - 1] != '\0')
+            continue;
+
+        /* Only labels inside a fragment's __overlay__ node move */
+        for (n = 1; Path[n] && Path[n] != '/'; n++)
+            ;
+        m = AsciiLen(Overlay);
+        if (n >= sizeof(Fragment) || CompareMem(Path + n, (VOID *)Overlay, m) != 0 ||
+            (Path[n + m] != '\0' && Path[n + m] != '/'))
+            continue;
+        CopyMem(Fragment, (VOID *)Path, n);
+        Fragment[n] = '\0';
+        Rest = Path + n + m;
+
+        Frag = FdtPathOffset(Dtbo, Fragment);
+        Target = Frag >= 0 ? FragmentTarget(Fdt, Dtbo, Frag) : -1;
+        if (Target < 0 || !NodePath(Fdt, Target, NewPath, sizeof(NewPath)))
+            return EFI_NOT_FOUND;
+        n = AsciiLen(NewPath);
+        if (n == 1 && *Rest)
+            n = 0;
+        m = AsciiLen(Rest);
+        if (n + m + 1 > sizeof(NewPath))
+            return EFI_BUFFER_TOO_SMALL;
+        CopyMem(NewPath + n, (VOID *)Rest, m + 1);
+
+        status = FdtSetProp(Fdt, Symbols, Label, NewPath, n + m + 1);
+        if (EFI_ERROR(status))
+            return status;
+    }
+    return EFI_SUCCESS;
+}
+
+/*
+ * Apply one overlay of Size bytes, between OverlayBegin and OverlayEnd.
+ * On failure the tree may be partly modified.
+ */
+EFI_STATUS OverlayApply(VOID *Fdt, VOID *Dtbo, UINTN Size)
+{
+    UINT32 Delta = MaxPhandle;
+    INTN Fixups, Symbols, Frag, Node, Target;
+    EFI_STATUS status;
+
+    if (!FdtCheckHeader(Dtbo, Size))
+        return EFI_LOAD_ERROR;
+
+    status = RenumberPhandles(Dtbo, Delta);
+    if (EFI_ERROR(status))
+        return status;
+    Fixups = FdtSubnodeOffset(Dtbo, 0, "__local_fixups__");
+    if (Fixups >= 0) {
+        status = LocalFixups(Dtbo, Fixups, 0, Delta);
+        if (EFI_ERROR(status))
+            return status;
+    }
+    Fixups = FdtSubnodeOffset(Dtbo, 0, "__fixups__");
+    if (Fixups >= 0) {
+        status = ExternalFixups(Fdt, Dtbo, Fixups);
+        if (EFI_ERROR(status))
+            return status;
+    }
+
+    for (Frag = FdtFirstSubnode(Dtbo, 0); Frag >= 0; Frag = FdtNextSubnode(Dtbo, Frag)) {
+        Node = FdtSubnodeOffset(Dtbo, Frag, "__overlay__");
+        if (!IsFragment(Dtbo, Frag) || Node < 0)
+            continue;
+        Target = FragmentTarget(Fdt, Dtbo, Frag);
+        if (Target < 0) {
+            LogPrint(L"(no target for %a) ", FdtGetName(Dtbo, Frag));
+            return EFI_NOT_FOUND;
+        }
+        status = MergeNode(Fdt, Target, Dtbo, Node);
+        if (EFI_ERROR(status))
+            return status;
+    }
+
+    Symbols = FdtSubnodeOffset(Dtbo, 0, "__symbols__");
+    if (Symbols >= 0)
+        return MergeSymbols(Fdt, Dtbo, Symbols);
+    return EFI_SUCCESS;
+}
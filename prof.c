@@ -0,0 +1,314 @@
+/*
+ * Firmware call profile
+ *
+ * Built with "make PROFILE=1", the loader counts the calls it makes
+ * into firmware, the bytes they move and the cycles (rdcycle) spent in
+ * them, per service, and prints the totals as a table just before the
+ * kernel is entered or the boot is given up.
+ *
+ * Boot and runtime services are wrapped: ProfInit copies the firmware's
+ * tables and points the gnu-efi globals BS and RT at the copies, whose
+ * entries account for the call around the original. The firmware's own
+ * tables are left alone, so the kernel sees them unchanged. File and
+ * block I/O protocols belong to the firmware's drivers and cannot be
+ * wrapped this way; their calls are accounted where the loader makes
+ * them, with PROF_CALL.
+ */
+
+#include "loader.h"
+
+#ifdef LOADER_PROFILE
+
+typedef struct {
+    UINTN Calls;
+    UINT64 Bytes;
+    UINT64 Cycles;
+} PROF_COUNTER;
+
+static CONST CHAR16 *Names[PROF_SERVICES] = {
+    [PROF_ALLOCATE_PAGES]       = L"AllocatePages",
+    [PROF_FREE_PAGES]           = L"FreePages",
+    [PROF_GET_MEMORY_MAP]       = L"GetMemoryMap",
+    [PROF_ALLOCATE_POOL]        = L"AllocatePool",
+    [PROF_FREE_POOL]            = L"FreePool",
+    [PROF_INSTALL_PROTOCOL]     = L"InstallProtocolInterface",
+    [PROF_HANDLE_PROTOCOL]      = L"HandleProtocol",
+    [PROF_LOCATE_HANDLE_BUFFER] = L"LocateHandleBuffer",
+    [PROF_LOCATE_PROTOCOL]      = L"LocateProtocol",
+    [PROF_INSTALL_CONFIG_TABLE] = L"InstallConfigurationTable",
+    [PROF_LOAD_IMAGE]           = L"LoadImage",
+    [PROF_START_IMAGE]          = L"StartImage",
+    [PROF_UNLOAD_IMAGE]         = L"UnloadImage",
+    [PROF_EXIT_BOOT_SERVICES]   = L"ExitBootServices",
+    [PROF_STALL]                = L"Stall",
+    [PROF_CALCULATE_CRC32]      = L"CalculateCrc32",
+    [PROF_COPY_MEM]             = L"CopyMem",
+    [PROF_GET_VARIABLE]         = L"GetVariable",
+    [PROF_SET_VARIABLE]         = L"SetVariable",
+    [PROF_OPEN_VOLUME]          = L"OpenVolume",
+    [PROF_FILE_OPEN]            = L"File.Open",
+    [PROF_FILE_GET_INFO]        = L"File.GetInfo",
+    [PROF_FILE_READ]            = L"File.Read",
+    [PROF_READ_BLOCKS]          = L"ReadBlocks",
+};
+
+static PROF_COUNTER Counters[PROF_SERVICES];
+static UINT64 StartCycle;
+
+static EFI_BOOT_SERVICES *FwBs;
+static EFI_RUNTIME_SERVICES *FwRt;
+static EFI_BOOT_SERVICES ProfBs;
+static EFI_RUNTIME_SERVICES ProfRt;
+
+VOID ProfAccount(UINTN Service, UINT64 Bytes, UINT64 Start)
+{
+    PROF_COUNTER *c = &Counters[Service];
+
+    c->Cycles += ReadCycle() - Start;
+    c->Bytes += Bytes;
+    c->Calls++;
+}
+
+static EFI_STATUS EFIAPI ProfAllocatePages(EFI_ALLOCATE_TYPE Type, EFI_MEMORY_TYPE MemoryType,
+                                           UINTN Pages, EFI_PHYSICAL_ADDRESS *Memory)
+{
+    UINT64 Start = ReadCycle();
+    EFI_STATUS status = FwBs->AllocatePages(Type, MemoryType, Pages, Memory);
+
+    ProfAccount(PROF_ALLOCATE_PAGES, (UINT64)Pages * EFI_PAGE_SIZE, Start);
+    return status;
+}
+
+static EFI_STATUS EFIAPI ProfFreePages(EFI_PHYSICAL_ADDRESS Memory, UINTN Pages)
+{
+    UINT64 Start = ReadCycle();
+    EFI_STATUS status = FwBs->FreePages(Memory, Pages);
+
+    ProfAccount(PROF_FREE_PAGES, (UINT64)Pages * EFI_PAGE_SIZE, Start);
+    return status;
+}
+
+static EFI_STATUS EFIAPI ProfGetMemoryMap(UINTN *MemoryMapSize, EFI_MEMORY_DESCRIPTOR *MemoryMap,
+                                          UINTN *MapKey, UINTN *DescriptorSize,
+                                          UINT32 *DescriptorVersion)
+{
+    UINT64 Start = ReadCycle();
+    EFI_STATUS status = FwBs->GetMemoryMap(MemoryMapSize, MemoryMap, MapKey,
+                                           DescriptorSize, DescriptorVersion);
+
+    ProfAccount(PROF_GET_MEMORY_MAP, *MemoryMapSize, Start);
+    return status;
+}
+
+static EFI_STATUS EFIAPI ProfAllocatePool(EFI_MEMORY_TYPE PoolType, UINTN Size, VOID **Buffer)
+{
+    UINT64 Start = ReadCycle();
+    EFI_STATUS status = FwBs->AllocatePool(PoolType, Size, Buffer);
+
+    ProfAccount(PROF_ALLOCATE_POOL, Size, Start);
+    return status;
+}
+
+static EFI_STATUS EFIAPI ProfFreePool(VOID *Buffer)
+{
+    UINT64 Start = ReadCycle();
+    EFI_STATUS status = FwBs->FreePool(Buffer);
+
+    ProfAccount(PROF_FREE_POOL, 0, Start);
+    return status;
+}
+
+static EFI_STATUS EFIAPI ProfInstallProtocolInterface(EFI_HANDLE *Handle, EFI_GUID *Protocol,
+                                                      EFI_INTERFACE_TYPE InterfaceType,
+                                                      VOID *Interface)
+{
+    UINT64 Start = ReadCycle();
+    EFI_STATUS status = FwBs->InstallProtocolInterface(Handle, Protocol, InterfaceType, Interface);
+
+    ProfAccount(PROF_INSTALL_PROTOCOL, 0, Start);
+    return status;
+}
+
+static EFI_STATUS EFIAPI ProfHandleProtocol(EFI_HANDLE Handle, EFI_GUID *Protocol, VOID **Interface)
+{
+    UINT64 Start = ReadCycle();
+    EFI_STATUS status = FwBs->HandleProtocol(Handle, Protocol, Interface);
+
+    ProfAccount(PROF_HANDLE_PROTOCOL, 0, Start);
+    return status;
+}
+
+static EFI_STATUS EFIAPI ProfLocateHandleBuffer(EFI_LOCATE_SEARCH_TYPE SearchType, EFI_GUID *Protocol,
+                                                VOID *SearchKey, UINTN *NoHandles,
+                                                EFI_HANDLE **Buffer)
+{
+    UINT64 Start = ReadCycle();
+    EFI_STATUS status = FwBs->LocateHandleBuffer(SearchType, Protocol, SearchKey, NoHandles, Buffer);
+
+    ProfAccount(PROF_LOCATE_HANDLE_BUFFER, 0, Start);
+    return status;
+}
+
+static EFI_STATUS EFIAPI ProfLocateProtocol(EFI_GUID *Protocol, VOID *Registration, VOID **Interface)
+{
+    UINT64 Start = ReadCycle();
+    EFI_STATUS status = FwBs->LocateProtocol(Protocol, Registration, Interface);
+
+    ProfAccount(PROF_LOCATE_PROTOCOL, 0, Start);
+    return status;
+}
+
+static EFI_STATUS EFIAPI ProfInstallConfigurationTable(EFI_GUID *Guid, VOID *Table)
+{
+    UINT64 Start = ReadCycle();
+    EFI_STATUS status = FwBs->InstallConfigurationTable(Guid, Table);
+
+    ProfAccount(PROF_INSTALL_CONFIG_TABLE, 0, Start);
+    return status;
+}
+
+static EFI_STATUS EFIAPI ProfLoadImage(BOOLEAN BootPolicy, EFI_HANDLE ParentImageHandle,
+                                       EFI_DEVICE_PATH *FilePath, VOID *SourceBuffer,
+                                       UINTN SourceSize, EFI_HANDLE *ImageHandle)
+{
+    UINT64 Start = ReadCycle();
+    EFI_STATUS status = FwBs->LoadImage(BootPolicy, ParentImageHandle, FilePath,
+                                        SourceBuffer, SourceSize, ImageHandle);
+
+    ProfAccount(PROF_LOAD_IMAGE, SourceSize, Start);
+    return status;
+}
+
+/* Only returns if the kernel does; its time is the kernel's, not firmware's */
+static EFI_STATUS EFIAPI ProfStartImage(EFI_HANDLE ImageHandle, UINTN *ExitDataSize, CHAR16 **ExitData)
+{
+    UINT64 Start = ReadCycle();
+    EFI_STATUS status = FwBs->StartImage(ImageHandle, ExitDataSize, ExitData);
+
+    ProfAccount(PROF_START_IMAGE, 0, Start);
+    return status;
+}
+
+static EFI_STATUS EFIAPI ProfUnloadImage(EFI_HANDLE ImageHandle)
+{
+    UINT64 Start = ReadCycle();
+    EFI_STATUS status = FwBs->UnloadImage(ImageHandle);
+
+    ProfAccount(PROF_UNLOAD_IMAGE, 0, Start);
+    return status;
+}
+
+static EFI_STATUS EFIAPI ProfExitBootServices(EFI_HANDLE ImageHandle, UINTN MapKey)
+{
+    UINT64 Start = ReadCycle();
+    EFI_STATUS status = FwBs->ExitBootServices(ImageHandle, MapKey);
+
+    ProfAccount(PROF_EXIT_BOOT_SERVICES, 0, Start);
+    return status;
+}
+
+static EFI_STATUS EFIAPI ProfStall(UINTN Microseconds)
+{
+    UINT64 Start = ReadCycle();
+    EFI_STATUS status = FwBs->Stall(Microseconds);
+
+    ProfAccount(PROF_STALL, 0, Start);
+    return status;
+}
+
+static EFI_STATUS EFIAPI ProfCalculateCrc32(VOID *Data, UINTN DataSize, UINT32 *Crc32)
+{
+    UINT64 Start = ReadCycle();
+    EFI_STATUS status = FwBs->CalculateCrc32(Data, DataSize, Crc32);
+
+    ProfAccount(PROF_CALCULATE_CRC32, DataSize, Start);
+    return status;
+}
+
+static VOID EFIAPI ProfCopyMem(VOID *Destination, VOID *Source, UINTN Length)
+{
+    UINT64 Start = ReadCycle();
+
+    FwBs->CopyMem(Destination, Source, Length);
+    ProfAccount(PROF_COPY_MEM, Length, Start);
+}
+
+static EFI_STATUS EFIAPI ProfGetVariable(CHAR16 *VariableName, EFI_GUID *VendorGuid,
+                                         UINT32 *Attributes, UINTN *DataSize, VOID *Data)
+{
+    UINT64 Start = ReadCycle();
+    EFI_STATUS status = FwRt->GetVariable(VariableName, VendorGuid, Attributes, DataSize, Data);
+
+    ProfAccount(PROF_GET_VARIABLE, EFI_ERROR(status) ? 0 : *DataSize, Start);
+    return status;
+}
+
+static EFI_STATUS EFIAPI ProfSetVariable(CHAR16 *VariableName, EFI_GUID *VendorGuid,
+                                         UINT32 Attributes, UINTN DataSize, VOID *Data)
+{
+    UINT64 Start = ReadCycle();
+    EFI_STATUS status = FwRt->SetVariable(VariableName, VendorGuid, Attributes, DataSize, Data);
+
+    ProfAccount(PROF_SET_VARIABLE, DataSize, Start);
+    return status;
+}
+
+/*
+ * Route the loader's boot and runtime service calls through the
+ * profiled tables. Call right after InitializeLib.
+ */
+VOID ProfInit(VOID)
+{
+    StartCycle = ReadCycle();
+
+    FwBs = BS;
+    ProfBs = *BS;
+    ProfBs.AllocatePages = ProfAllocatePages;
+    ProfBs.FreePages = ProfFreePages;
+    ProfBs.GetMemoryMap = ProfGetMemoryMap;
+    ProfBs.AllocatePool = ProfAllocatePool;
+    ProfBs.FreePool = ProfFreePool;
+    ProfBs.InstallProtocolInterface = ProfInstallProtocolInterface;
+    ProfBs.HandleProtocol = ProfHandleProtocol;
+    ProfBs.LocateHandleBuffer = ProfLocateHandleBuffer;
+    ProfBs.LocateProtocol = ProfLocateProtocol;
+    ProfBs.InstallConfigurationTable = ProfInstallConfigurationTable;
+    ProfBs.LoadImage = ProfLoadImage;
+    ProfBs.StartImage = ProfStartImage;
+    ProfBs.UnloadImage = ProfUnloadImage;
+    ProfBs.ExitBootServices = ProfExitBootServices;
+    ProfBs.Stall = ProfStall;
+    ProfBs.CalculateCrc32 = ProfCalculateCrc32;
+    ProfBs.CopyMem = ProfCopyMem;
+    BS = &ProfBs;
+
+    FwRt = RT;
+    ProfRt = *RT;
+    ProfRt.GetVariable = ProfGetVariable;
+    ProfRt.SetVariable = ProfSetVariable;
+    RT = &ProfRt;
+}
+
+/*
+ * Print the table to the log. Safe after ExitBootServices.
+ */
+VOID ProfReport(VOID)
+{
+    UINT64 Total = ReadCycle() - StartCycle, Cycles = 0;
+    PROF_COUNTER *c;
+    UINTN i;
+
+    LogPrint(L"\r\nFirmware call profile:\r\n");
+    LogPrint(L"  %-26s %8s %12s %14s\r\n", L"Service", L"Calls", L"Bytes", L"Cycles");
+    for (i = 0; i < PROF_SERVICES; i++) {
+        c = &Counters[i];
+        if (!c->Calls)
+            continue;
+        LogPrint(L"  %-26s %8d %12ld %14ld\r\n", Names[i], c->Calls, c->Bytes, c->Cycles);
+        if (i != PROF_START_IMAGE)
+            Cycles += c->Cycles;
+    }
+    LogPrint(L"  %ld of %ld cycles since start spent in firmware\r\n", Cycles, Total);
+}
+
+#endif /* LOADER_PROFILE */
@@ -0,0 +1,168 @@
+/*
+ * Raw partition kernels
+ *
+ * For setups that want no file system in the boot path, the kernel can
+ * live in a dedicated GPT partition identified by its type GUID. The
+ * partition starts with a RAW_KERNEL_HEADER in its first block; the
+ * image follows at HeaderSize, so the bulk of it is read with a single
+ * ReadBlocks straight into the kernel buffer.
+ *
+ * The GPT is read from each whole-disk BlockIo, so no PartitionInfo
+ * protocol support is needed from the firmware.
+ */
+
+#include "loader.h"
+
+#define GPT_HEADER_LBA     1
+#define GPT_SIGNATURE      0x5452415020494645ULL  /* "EFI PART" */
+#define GPT_HEADER_SIZE    92                     /* Defined fields, without padding */
+#define GPT_MAX_ENTRIES    0x10000                /* Sanity bound on the array size */
+
+typedef struct {
+    UINT64 Signature;
+    UINT32 Revision;
+    UINT32 HeaderSize;
+    UINT32 HeaderCrc32;
+    UINT32 Reserved;
+    UINT64 MyLba;
+    UINT64 AlternateLba;
+    UINT64 FirstUsableLba;
+    UINT64 LastUsableLba;
+    EFI_GUID DiskGuid;
+    UINT64 EntryLba;
+    UINT32 EntryCount;
+    UINT32 EntrySize;
+    UINT32 EntryArrayCrc32;
+} GPT_HEADER;
+
+typedef struct {
+    EFI_GUID TypeGuid;
+    EFI_GUID UniqueGuid;
+    UINT64 StartingLba;
+    UINT64 EndingLba;
+    UINT64 Attributes;
+    CHAR16 Name[36];
+} GPT_ENTRY;
+
+static BOOLEAN CheckCrc(VOID *Data, UINTN Size, UINT32 Expected)
+{
+    UINT32 Crc;
+
+    return !EFI_ERROR(BS->CalculateCrc32(Data, Size, &Crc)) && Crc == Expected;
+}
+
+/*
+ * Find a partition of the given type in a disk's primary GPT
+ */
+static EFI_STATUS FindGptPartition(BLOCK_DEVICE *Disk, EFI_GUID *Type,
+                                   UINT64 *Start, UINT64 *End)
+{
+    EFI_STATUS status;
+    GPT_HEADER Hdr;
+    UINT8 *Entries;
+    UINTN ArraySize, i;
+    UINT32 Crc;
+
+    status = PROF_CALL(PROF_READ_BLOCKS, Disk->BlockSize,
+                       Disk->BlockIo->ReadBlocks(Disk->BlockIo, Disk->MediaId, GPT_HEADER_LBA,
+                                                 Disk->BlockSize, Disk->Bounce));
+    if (EFI_ERROR(status))
+        return status;
+    CopyMem(&Hdr, Disk->Bounce, sizeof(Hdr));
+    if (Hdr.Signature != GPT_SIGNATURE || Hdr.HeaderSize < GPT_HEADER_SIZE ||
+        Hdr.HeaderSize > Disk->BlockSize)
+        return EFI_NOT_FOUND;
+
+    /* The header CRC covers HeaderSize bytes with its own field zeroed */
+    Crc = Hdr.HeaderCrc32;
+    ((GPT_HEADER *)Disk->Bounce)->HeaderCrc32 = 0;
+    if (!CheckCrc(Disk->Bounce, Hdr.HeaderSize, Crc))
+        return EFI_CRC_ERROR;
+
+    if (Hdr.EntrySize < sizeof(GPT_ENTRY) || Hdr.EntryCount > GPT_MAX_ENTRIES)
+        return EFI_NOT_FOUND;
+    ArraySize = (UINTN)Hdr.EntryCount * Hdr.EntrySize;
+    Entries = AllocatePool(ArraySize);
+    if (!Entries)
+        return EFI_OUT_OF_RESOURCES;
+    status = BlockRead(Disk, Hdr.EntryLba * Disk->BlockSize, Entries, ArraySize);
+    if (!EFI_ERROR(status) && !CheckCrc(Entries, ArraySize, Hdr.EntryArrayCrc32))
+        status = EFI_CRC_ERROR;
+
+    if (!EFI_ERROR(status)) {
+        status = EFI_NOT_FOUND;
+        for (i = 0; i < Hdr.EntryCount; i++) {
+            GPT_ENTRY *Ent = (GPT_ENTRY *)(Entries + i * Hdr.EntrySize);
+
+            if (CompareGuid(&Ent->TypeGuid, Type) == 0 &&
+                Ent->EndingLba >= Ent->StartingLba) {
+                *Start = Ent->StartingLba;
+                *End = Ent->EndingLba;
+                status = EFI_SUCCESS;
+                break;
+            }
+        }
+    }
+    FreePool(Entries);
+    return status;
+}
+
+/*
+ * Read and check the header at the start of a raw kernel partition
+ */
+static EFI_STATUS ReadRawHeader(BLOCK_DEVICE *Disk, UINT64 Start, UINT64 End,
+                                RAW_KERNEL_HEADER *Hdr)
+{
+    EFI_STATUS status;
+    UINT64 PartSize = (End - Start + 1) * Disk->BlockSize;
+
+    status = BlockRead(Disk, Start * Disk->BlockSize, Hdr, sizeof(*Hdr));
+    if (EFI_ERROR(status))
+        return status;
+    if (Hdr->Magic != RAW_KERNEL_MAGIC || Hdr->HeaderSize < sizeof(*Hdr) ||
+        Hdr->HeaderSize % Disk->BlockSize != 0 || Hdr->ImageSize == 0 ||
+        Hdr->HeaderSize > PartSize || Hdr->ImageSize > PartSize - Hdr->HeaderSize ||
+        Hdr->Compression > COMPRESSION_GZIP)
+        return EFI_VOLUME_CORRUPTED;
+    return EFI_SUCCESS;
+}
+
+/*
+ * Locate the raw kernel partition of type Type on any disk. On success
+ * Dev reads the image itself: offset 0 is its first byte.
+ */
+EFI_STATUS RawPartitionOpen(EFI_GUID *Type, BLOCK_DEVICE *Dev, RAW_KERNEL_HEADER *Hdr)
+{
+    EFI_STATUS status;
+    EFI_HANDLE *Handles;
+    UINTN Count, i;
+    UINT64 Start, End;
+
+    status = BS->LocateHandleBuffer(ByProtocol, &gEfiBlockIoProtocolGuid, NULL,
+                                    &Count, &Handles);
+    if (EFI_ERROR(status))
+        return status;
+
+    status = EFI_NOT_FOUND;
+    for (i = 0; i < Count; i++) {
+        EFI_BLOCK_IO *BlockIo;
+
+        if (EFI_ERROR(BS->HandleProtocol(Handles[i], &gEfiBlockIoProtocolGuid,
+                                         (VOID **)&BlockIo)) ||
+            BlockIo->Media->LogicalPartition)
+            continue;
+        if (EFI_ERROR(BlockOpen(BlockIo, 0, Dev)))
+            continue;
+        if (!EFI_ERROR(FindGptPartition(Dev, Type, &Start, &End))) {
+            status = ReadRawHeader(Dev, Start, End, Hdr);
+            if (!EFI_ERROR(status)) {
+                Dev->Base = Start * Dev->BlockSize + Hdr->HeaderSize;
+                IoTuneOpen(Dev, Handles[i]);
+                break;
+            }
+        }
+        BlockClose(Dev);
+    }
+    FreePool(Handles);
+    return status;
+}
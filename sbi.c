@@ -0,0 +1,64 @@
+/*
+ * SBI calls
+ *
+ * The loader runs in S-mode under UEFI, so the SBI implementation
+ * (usually OpenSBI) is reachable with ecall for the few things UEFI
+ * does not provide, such as starting secondary harts or a console
+ * after ExitBootServices.
+ */
+
+#include "loader.h"
+
+#define SBI_EXT_LEGACY_PUTCHAR 0x01
+#define SBI_EXT_BASE       0x10
+#define SBI_BASE_PROBE     3
+#define SBI_EXT_DBCN       0x4442434e    /* "DBCN" */
+#define SBI_DBCN_WRITE     0
+
+SBI_RET SbiCall(UINTN Ext, UINTN Fid, UINTN Arg0, UINTN Arg1, UINTN Arg2)
+{
+    register UINTN a0 __asm__("a0") = Arg0;
+    register UINTN a1 __asm__("a1") = Arg1;
+    register UINTN a2 __asm__("a2") = Arg2;
+    register UINTN a6 __asm__("a6") = Fid;
+    register UINTN a7 __asm__("a7") = Ext;
+    SBI_RET Ret;
+
+    __asm__ __volatile__("ecall"
+                         : "+r"(a0), "+r"(a1)
+                         : "r"(a2), "r"(a6), "r"(a7)
+                         : "memory");
+    Ret.Error = (INTN)a0;
+    Ret.Value = a1;
+    return Ret;
+}
+
+BOOLEAN SbiProbe(UINTN Ext)
+{
+    SBI_RET Ret = SbiCall(SBI_EXT_BASE, SBI_BASE_PROBE, Ext, 0, 0);
+
+    return Ret.Error == SBI_SUCCESS && Ret.Value != 0;
+}
+
+/*
+ * Write to the SBI console: with one debug console write where the
+ * DBCN extension exists, else a legacy putchar per byte. Buf must be
+ * addressable physically, which it is under UEFI's 1:1 mapping.
+ */
+VOID SbiConsoleWrite(CONST CHAR8 *Buf, UINTN Len)
+{
+    static INTN HaveDbcn = -1;
+    SBI_RET Ret;
+
+    if (HaveDbcn < 0)
+        HaveDbcn = SbiProbe(SBI_EXT_DBCN);
+    while (HaveDbcn && Len > 0) {
+        Ret = SbiCall(SBI_EXT_DBCN, SBI_DBCN_WRITE, Len, (UINTN)Buf, 0);
+        if (Ret.Error != SBI_SUCCESS || Ret.Value == 0 || Ret.Value > Len)
+            break;
+        Buf += Ret.Value;
+        Len -= Ret.Value;
+    }
+    for (; Len > 0; Buf++, Len--)
+        SbiCall(SBI_EXT_LEGACY_PUTCHAR, 0, *Buf, 0, 0);
+}
@@ -0,0 +1,68 @@
+/*
+ * Cooperative tasks
+ *
+ * Boot services give the loader a single thread and no preemption, so
+ * overlapping work is done by hand: a task is a step function that
+ * makes a little progress without blocking (checks queued reads, queues
+ * more) and says when it is done. Long-running loops elsewhere, kernel
+ * decompression and hashing, call SchedYield between chunks to let the
+ * tasks move; whoever needs a task's result waits for it with
+ * SchedWait.
+ *
+ * Tasks live in their owner's memory. A finished task is dropped from
+ * the run list; it is not freed.
+ */
+
+#include "loader.h"
+
+static TASK *RunList;
+static BOOLEAN Running;
+
+/*
+ * Run Task's first step, and keep it running from SchedYield until it
+ * is finished
+ */
+VOID SchedStart(TASK *Task)
+{
+    Task->Status = EFI_SUCCESS;
+    Task->Finished = Task->Step(Task);
+    if (Task->Finished)
+        return;
+    Task->Next = RunList;
+    RunList = Task;
+}
+
+/*
+ * Give every unfinished task one step. Steps do not yield themselves;
+ * a yield from within one returns at once.
+ */
+VOID SchedYield(VOID)
+{
+    TASK **Link = &RunList;
+    TASK *Task;
+
+    if (Running)
+        return;
+    Running = TRUE;
+    while ((Task = *Link)) {
+        Task->Finished = Task->Step(Task);
+        if (Task->Finished)
+            *Link = Task->Next;
+        else
+            Link = &Task->Next;
+    }
+    Running = FALSE;
+}
+
+/*
+ * Step everything until Task is finished, and return how it went
+ */
+EFI_STATUS SchedWait(TASK *Task)
+{
+    while (!Task->Finished) {
+        SchedYield();
+        if (!Task->Finished)
+            BS->Stall(10);
+    }
+    return Task->Status;
+}
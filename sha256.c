@@ -0,0 +1,268 @@
+/*
+ * SHA-256 (FIPS 180-4)
+ *
+ * Used to verify kernels as they are read: the reader hashes each
+ * chunk, or each device transfer of a direct read, right after it
+ * lands in memory, while it is still in cache.
+ *
+ * The block function comes in three flavours, picked once at boot from
+ * the ISA the device tree advertises for every hart:
+ *   - Zknh: sha256sum0/sum1/sig0/sig1 instructions
+ *   - Zbkb: 32-bit rotates (roriw) instead of shift/shift/or
+ *   - plain C
+ * The instructions are emitted with .insn so the loader still builds
+ * with -march=rv64gc. Zvknh is not used: the loader does not enable
+ * or save vector state, which it would have to do under UEFI.
+ */
+
+#include "loader.h"
+
+static CONST UINT32 K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static CONST UINT32 H0[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+#define CH(x, y, z)        (((x) & (y)) ^ (~(x) & (z)))
+#define MAJ(x, y, z)       (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+#define LOAD_BE32(p)       (((UINT32)(p)[0] << 24) | ((UINT32)(p)[1] << 16) | \
+                            ((UINT32)(p)[2] << 8) | (p)[3])
+
+/*
+ * One block function per engine, sharing the round structure. Each
+ * engine defines SUM0, SUM1, SIG0 and SIG1 before expanding it.
+ */
+#define SHA256_BLOCKS(Name)                                                 \
+static VOID Name(UINT32 *State, CONST UINT8 *Data, UINTN Blocks)            \
+{                                                                           \
+    UINT32 W[64];                                                           \
+    UINT32 a, b, c, d, e, f, g, h, t1, t2;                                  \
+    UINTN i;                                                                \
+                                                                            \
+    while (Blocks--) {                                                      \
+        for (i = 0; i < 16; i++)                                            \
+            W[i] = LOAD_BE32(Data + 4 * i);                                 \
+        for (; i < 64; i++)                                                 \
+            W[i] = SIG1(W[i - 2]) + W[i - 7] + SIG0(W[i - 15]) + W[i - 16]; \
+                                                                            \
+        a = State[0]; b = State[1]; c = State[2]; d = State[3];             \
+        e = State[4]; f = State[5]; g = State[6]; h = State[7];             \
+        for (i = 0; i < 64; i++) {                                          \
+            t1 = h + SUM1(e) + CH(e, f, g) + K[i] + W[i];                   \
+            t2 = SUM0(a) + MAJ(a, b, c);                                    \
+            h = g; g = f; f = e; e = d + t1;                                \
+            d = c; c = b; b = a; a = t1 + t2;                               \
+        }                                                                   \
+        State[0] += a; State[1] += b; State[2] += c; State[3] += d;         \
+        State[4] += e; State[5] += f; State[6] += g; State[7] += h;         \
+        Data += 64;                                                         \
+    }                                                                       \
+}
+
+/* Plain C */
+#define ROR(x, n)          (((x) >> (n)) | ((x) << (32 - (n))))
+#define SUM0(x)            (ROR(x, 2) ^ ROR(x, 13) ^ ROR(x, 22))
+#define SUM1(x)            (ROR(x, 6) ^ ROR(x, 11) ^ ROR(x, 25))
+#define SIG0(x)            (ROR(x, 7) ^ ROR(x, 18) ^ ((x) >> 3))
+#define SIG1(x)            (ROR(x, 17) ^ ROR(x, 19) ^ ((x) >> 10))
+SHA256_BLOCKS(BlocksGeneric)
+#undef ROR
+
+#if defined(__riscv) && __riscv_xlen == 64
+/* Zbkb: roriw rd, rs1, n (OP-IMM-32, funct3 5, funct7 0x30) */
+#define ROR(x, n) ({ UINT32 r_; __asm__(".insn i 0x1b, 5, %0, %1, 0x600 + " #n : "=r"(r_) : "r"(x)); r_; })
+SHA256_BLOCKS(BlocksZbkb)
+#undef ROR
+#undef SUM0
+#undef SUM1
+#undef SIG0
+#undef SIG1
+
+/* Zknh: sha256sum0/sum1/sig0/sig1 (OP-IMM, funct3 1, imm 0x100-0x103) */
+#define ZKNH(Imm, x) ({ UINT32 r_; __asm__(".insn i 0x13, 1, %0, %1, " #Imm : "=r"(r_) : "r"(x)); r_; })
+#define SUM0(x)            ZKNH(0x100, x)
+#define SUM1(x)            ZKNH(0x101, x)
+#define SIG0(x)            ZKNH(0x102, x)
+#define SIG1(x)            ZKNH(0x103, x)
+SHA256_BLOCKS(BlocksZknh)
+#endif
+
+static VOID (*Blocks)(UINT32 *State, CONST UINT8 *Data, UINTN Blocks) = BlocksGeneric;
+
+/*
+ * Look for an extension in a riscv,isa string ("rv64imac_zbkb_...")
+ * or riscv,isa-extensions string list
+ */
+static BOOLEAN IsaHas(CONST char *Isa, UINT32 Len, CONST char *Ext)
+{
+    UINT32 Start = 0, i, j;
+
+    for (i = 0; i <= Len; i++) {
+        if (i < Len && Isa[i] != '_' && Isa[i] != '\0')
+            continue;
+        for (j = 0; Start + j < i && Ext[j]; j++) {
+            char c = Isa[Start + j];
+
+            if ((c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c) != Ext[j])
+                break;
+        }
+        if (Start + j == i && Ext[j] == '\0')
+            return TRUE;
+        Start = i + 1;
+    }
+    return FALSE;
+}
+
+/*
+ * True if every hart under /cpus advertises Ext
+ */
+static BOOLEAN AllHartsHave(VOID *Dtb, CONST char *Ext)
+{
+    INTN Cpus = FdtPathOffset(Dtb, "/cpus");
+    INTN Cpu;
+    BOOLEAN Found = FALSE;
+
+    if (Cpus < 0)
+        return FALSE;
+    for (Cpu = FdtFirstSubnode(Dtb, Cpus); Cpu >= 0; Cpu = FdtNextSubnode(Dtb, Cpu)) {
+        CONST char *Isa;
+        UINT32 Len;
+
+        if (!FdtGetProp(Dtb, Cpu, "device_type", &Len))
+            continue;           /* cpu-map and the like */
+        Isa = FdtGetProp(Dtb, Cpu, "riscv,isa-extensions", &Len);
+        if (!Isa)
+            Isa = FdtGetProp(Dtb, Cpu, "riscv,isa", &Len);
+        if (!Isa || !IsaHas(Isa, Len, Ext))
+            return FALSE;
+        Found = TRUE;
+    }
+    return Found;
+}
+
+/*
+ * Pick the block function for this machine. Returns the engine name.
+ */
+CONST CHAR16 *Sha256Probe(VOID *Dtb)
+{
+    Blocks = BlocksGeneric;
+#if defined(__riscv) && __riscv_xlen == 64
+    if (Dtb && (AllHartsHave(Dtb, "zknh") || AllHartsHave(Dtb, "zkn") ||
+                AllHartsHave(Dtb, "zk"))) {
+        Blocks = BlocksZknh;
+        return L"Zknh";
+    }
+    /* Zbb has the same roriw */
+    if (Dtb && (AllHartsHave(Dtb, "zbkb") || AllHartsHave(Dtb, "zbb"))) {
+        Blocks = BlocksZbkb;
+        return L"Zbkb";
+    }
+#else
+    (VOID)Dtb;
+    (VOID)AllHartsHave;
+#endif
+    return L"generic";
+}
+
+VOID Sha256Init(SHA256_CTX *Ctx)
+{
+    CopyMem(Ctx->State, (VOID *)H0, sizeof(H0));
+    Ctx->Length = 0;
+    Ctx->Used = 0;
+}
+
+VOID Sha256Update(SHA256_CTX *Ctx, CONST VOID *Data, UINTN Size)
+{
+    CONST UINT8 *p = Data;
+    UINTN n;
+
+    Ctx->Length += Size;
+    if (Ctx->Used) {
+        n = 64 - Ctx->Used;
+        if (n > Size)
+            n = Size;
+        CopyMem(Ctx->Buffer + Ctx->Used, (VOID *)p, n);
+        Ctx->Used += n;
+        p += n;
+        Size -= n;
+        if (Ctx->Used < 64)
+            return;
+        Blocks(Ctx->State, Ctx->Buffer, 1);
+        Ctx->Used = 0;
+    }
+    /* Whole blocks are hashed in place */
+    if (Size >= 64) {
+        Blocks(Ctx->State, p, Size / 64);
+        p += Size & ~(UINTN)63;
+        Size &= 63;
+    }
+    if (Size) {
+        CopyMem(Ctx->Buffer, (VOID *)p, Size);
+        Ctx->Used = Size;
+    }
+}
+
+VOID Sha256Final(SHA256_CTX *Ctx, UINT8 *Digest)
+{
+    UINT64 Bits = Ctx->Length * 8;
+    UINTN i;
+
+    Ctx->Buffer[Ctx->Used++] = 0x80;
+    if (Ctx->Used > 56) {
+        SetMem(Ctx->Buffer + Ctx->Used, 64 - Ctx->Used, 0);
+        Blocks(Ctx->State, Ctx->Buffer, 1);
+        Ctx->Used = 0;
+    }
+    SetMem(Ctx->Buffer + Ctx->Used, 56 - Ctx->Used, 0);
+    for (i = 0; i < 8; i++)
+        Ctx->Buffer[56 + i] = (UINT8)(Bits >> (56 - 8 * i));
+    Blocks(Ctx->State, Ctx->Buffer, 1);
+
+    for (i = 0; i < 8; i++) {
+        Digest[4 * i] = (UINT8)(Ctx->State[i] >> 24);
+        Digest[4 * i + 1] = (UINT8)(Ctx->State[i] >> 16);
+        Digest[4 * i + 2] = (UINT8)(Ctx->State[i] >> 8);
+        Digest[4 * i + 3] = (UINT8)Ctx->State[i];
+    }
+}
+
+/*
+ * Parse a 32-byte digest (SHA-256 or BLAKE3) from 64 hex digits;
+ * trailing text, as in sha256sum or b3sum output, is ignored
+ */
+BOOLEAN ParseHexDigest(CONST CHAR8 *Hex, UINTN Len, UINT8 *Digest)
+{
+    UINTN i;
+
+    if (Len < 2 * SHA256_DIGEST_SIZE)
+        return FALSE;
+    for (i = 0; i < 2 * SHA256_DIGEST_SIZE; i++) {
+        CHAR8 c = Hex[i];
+        UINT8 v;
+
+        if (c >= '0' && c <= '9')
+            v = c - '0';
+        else if (c >= 'a' && c <= 'f')
+            v = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            v = c - 'A' + 10;
+        else
+            return FALSE;
+        if (i & 1)
+            Digest[i / 2] |= v;
+        else
+            Digest[i / 2] = v << 4;
+    }
+    return Len == 2 * SHA256_DIGEST_SIZE || Hex[i] == ' ' || Hex[i] == '\t' ||
+           Hex[i] == '\r' || Hex[i] == '\n';
+}
@@ -0,0 +1,170 @@
+/*
+ * Secondary harts
+ *
+ * UEFI runs on the boot hart only; the other harts wait in the SBI
+ * implementation, stopped, until the kernel starts them. For bulk
+ * work such as hashing a large initrd the loader borrows them through
+ * the SBI HSM extension: each one is started on a small stack, runs
+ * the worker and stops itself again, and the loader waits until all
+ * of them are stopped, so the kernel finds them as firmware left them.
+ *
+ * Secondary harts start with the MMU off. UEFI maps memory 1:1, so
+ * the loader's code and data are at the same addresses either way.
+ * Workers must not call UEFI services, which are not reentrant.
+ */
+
+#include "loader.h"
+
+#define SBI_HSM_HART_START      0
+#define SBI_HSM_HART_STOP       1
+#define SBI_HSM_HART_GET_STATUS 2
+#define HSM_STATE_STOPPED       1
+
+#define SMP_STACK_SIZE          0x4000
+#define SMP_WAIT_US             1000000   /* Per hart, for it to finish and stop */
+
+typedef struct _HART_SLOT HART_SLOT;
+
+/* SmpEntry relies on StackTop and Main being the first two fields */
+struct _HART_SLOT {
+    UINT64 StackTop;
+    VOID (*Main)(UINTN HartId, HART_SLOT *Slot);
+    SMP_WORKER Worker;
+    VOID *Arg;
+    UINTN HartId;
+    UINT32 Done;
+};
+
+static HART_SLOT Slots[SMP_MAX_HARTS];
+
+/*
+ * Where hart_start sends a secondary hart: a0 = hart ID, a1 = its slot
+ */
+VOID SmpEntry(VOID) __attribute__((visibility("hidden")));
+__asm__(
+    "    .text\n"
+    "    .balign 4\n"
+    "    .globl SmpEntry\n"
+    "    .hidden SmpEntry\n"
+    "SmpEntry:\n"
+    "    ld      sp, 0(a1)\n"
+    "    ld      t0, 8(a1)\n"
+    "    jr      t0\n"
+);
+
+static VOID SecondaryMain(UINTN HartId, HART_SLOT *Slot)
+{
+    (VOID)HartId;
+    Slot->Worker(Slot->Arg);
+    __atomic_store_n(&Slot->Done, 1, __ATOMIC_RELEASE);
+    SbiCall(SBI_EXT_HSM, SBI_HSM_HART_STOP, 0, 0, 0);
+    for (;;)
+        __asm__ volatile("wfi");
+}
+
+static INTN HartStatus(UINTN HartId)
+{
+    SBI_RET Ret = SbiCall(SBI_EXT_HSM, SBI_HSM_HART_GET_STATUS, HartId, 0, 0);
+
+    return Ret.Error == SBI_SUCCESS ? (INTN)Ret.Value : -1;
+}
+
+/*
+ * Collect the IDs of the enabled harts under /cpus, other than the boot hart
+ */
+static UINTN FindHarts(VOID *Dtb, UINTN BootHartId, UINTN *HartIds, UINTN Max)
+{
+    INTN Cpus = FdtPathOffset(Dtb, "/cpus");
+    INTN Cpu;
+    CONST UINT32 *Cells;
+    UINT32 Len, AddrCells = 1;
+    UINTN Count = 0;
+
+    if (Cpus < 0)
+        return 0;
+    Cells = FdtGetProp(Dtb, Cpus, "#address-cells", &Len);
+    if (Cells && Len == 4)
+        AddrCells = fdt32_to_cpu(*Cells);
+    if (AddrCells < 1 || AddrCells > 2)
+        return 0;
+
+    for (Cpu = FdtFirstSubnode(Dtb, Cpus); Cpu >= 0 && Count < Max;
+         Cpu = FdtNextSubnode(Dtb, Cpu)) {
+        CONST char *Type, *Status;
+        CONST UINT32 *Reg;
+        UINTN HartId;
+
+        Type = FdtGetProp(Dtb, Cpu, "device_type", &Len);
+        if (!Type || Len != 4 || CompareMem(Type, "cpu", 4) != 0)
+            continue;
+        Status = FdtGetProp(Dtb, Cpu, "status", &Len);
+        if (Status && (Len < 2 || Status[0] != 'o' || Status[1] != 'k'))
+            continue;
+        Reg = FdtGetProp(Dtb, Cpu, "reg", &Len);
+        if (!Reg || Len < 4 * AddrCells)
+            continue;
+        HartId = fdt32_to_cpu(Reg[0]);
+        if (AddrCells == 2)
+            HartId = (HartId << 32) | fdt32_to_cpu(Reg[1]);
+        if (HartId != BootHartId)
+            HartIds[Count++] = HartId;
+    }
+    return Count;
+}
+
+/*
+ * Run Worker(Arg) on the boot hart and on every stopped secondary
+ * hart, returning once all of them are done and the secondaries are
+ * stopped again. Returns the number of harts that ran the worker.
+ */
+UINTN SmpRun(VOID *Dtb, UINTN BootHartId, SMP_WORKER Worker, VOID *Arg)
+{
+    UINTN HartIds[SMP_MAX_HARTS - 1];
+    UINTN Count = 0, Started = 0, i, Waited;
+    EFI_PHYSICAL_ADDRESS Stacks = 0;
+    BOOLEAN Lost = FALSE;
+
+    if (Dtb && SbiProbe(SBI_EXT_HSM))
+        Count = FindHarts(Dtb, BootHartId, HartIds, SMP_MAX_HARTS - 1);
+    if (Count && EFI_ERROR(BS->AllocatePages(AllocateAnyPages, EfiLoaderData,
+                                             EFI_SIZE_TO_PAGES(Count * SMP_STACK_SIZE),
+                                             &Stacks)))
+        Count = 0;
+
+    for (i = 0; i < Count; i++) {
+        HART_SLOT *Slot = &Slots[Started];
+
+        if (HartStatus(HartIds[i]) != HSM_STATE_STOPPED)
+            continue;
+        Slot->StackTop = Stacks + (Started + 1) * SMP_STACK_SIZE;
+        Slot->Main = SecondaryMain;
+        Slot->Worker = Worker;
+        Slot->Arg = Arg;
+        Slot->HartId = HartIds[i];
+        Slot->Done = 0;
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (SbiCall(SBI_EXT_HSM, SBI_HSM_HART_START, HartIds[i],
+                    (UINTN)SmpEntry, (UINTN)Slot).Error == SBI_SUCCESS)
+            Started++;
+    }
+
+    Worker(Arg);
+
+    for (i = 0; i < Started; i++) {
+        for (Waited = 0; Waited < SMP_WAIT_US; Waited += 10) {
+            if (__atomic_load_n(&Slots[i].Done, __ATOMIC_ACQUIRE) &&
+                HartStatus(Slots[i].HartId) == HSM_STATE_STOPPED)
+                break;
+            BS->Stall(10);
+        }
+        if (Waited >= SMP_WAIT_US) {
+            LogPrint(L"Hart %d did not stop\r\n", Slots[i].HartId);
+            Lost = TRUE;
+        }
+    }
+
+    /* A hart that is still running keeps its stack */
+    if (Count && !Lost)
+        BS->FreePages(Stacks, EFI_SIZE_TO_PAGES(Count * SMP_STACK_SIZE));
+    return Started + 1;
+}
@@ -0,0 +1,186 @@
+/*
+ * Boot statistics
+ *
+ * With "stats" in loader.conf, every boot appends one line to
+ * \loader-stats.log on the ESP just before the loader hands over: a
+ * JSON object with the boot entry, the kernel's format, where each
+ * payload came from, was loaded and how big it is, how long each stage
+ * took and how fast its reads were, and how many reads or allocations
+ * had to fall back. Fleet collectors read the file from the mounted
+ * ESP instead of capturing the serial console.
+ *
+ * Stage times are in microseconds of the time CSR and only present
+ * when the device tree gives its frequency. Once the file would grow
+ * beyond STATS_MAX_SIZE it is renamed to \loader-stats.log.1, replacing
+ * the previous one, and a new file is started.
+ */
+
+#include "loader.h"
+
+#define STATS_PATH         L"\\loader-stats.log"
+#define STATS_OLD_PATH     L"\\loader-stats.log.1"
+#define STATS_OLD_NAME     L"loader-stats.log.1"   /* Rename target, same directory */
+#define STATS_VERSION      1
+#define STATS_MAX_RECORD   1024           /* Characters per line */
+#define STATS_MAX_NAME     64
+
+static CONST CHAR16 *StageNames[STAGES] = {
+    [STAGE_CONFIG] = L"config",
+    [STAGE_KERNEL] = L"kernel",
+    [STAGE_INITRD] = L"initrd",
+    [STAGE_DTB]    = L"dtb",
+};
+
+static CONST CHAR16 *SourceNames[] = {
+    [SOURCE_NONE]     = L"none",
+    [SOURCE_FILE]     = L"file",
+    [SOURCE_FAT]      = L"fat",
+    [SOURCE_RAW]      = L"raw",
+    [SOURCE_WARM]     = L"warm",
+    [SOURCE_FIRMWARE] = L"firmware",
+    [SOURCE_CACHE]    = L"cache",
+    [SOURCE_UKI]      = L"uki",
+};
+
+static CONST CHAR16 *FormatNames[] = {
+    [KERNEL_FLAT]     = L"flat",
+    [KERNEL_IMAGE]    = L"image",
+    [KERNEL_EFI_STUB] = L"efi-stub",
+};
+
+static CHAR16 Record[STATS_MAX_RECORD];
+
+static UINTN Append(UINTN Len, CONST CHAR16 *Fmt, ...)
+{
+    va_list Args;
+
+    va_start(Args, Fmt);
+    Len += VSPrint(Record + Len, sizeof(Record) - Len * sizeof(CHAR16), Fmt, Args);
+    va_end(Args);
+    return Len;
+}
+
+static UINTN AppendPayload(UINTN Len, CONST CHAR16 *Name, STATS_PAYLOAD *p)
+{
+    if (p->Source == SOURCE_NONE)
+        return Len;
+    return Append(Len, L",\"%s_src\":\"%s\",\"%s_addr\":\"0x%lx\",\"%s_size\":%ld",
+                  Name, SourceNames[p->Source], Name, p->Addr, Name, p->Size);
+}
+
+/*
+ * The entry name as a JSON string body: it comes from loader.conf
+ */
+static VOID QuoteName(CONST CHAR8 *Name, CHAR8 *Out)
+{
+    UINTN i;
+
+    for (i = 0; Name && Name[i] && i < STATS_MAX_NAME - 1; i++)
+        Out[i] = Name[i] < 0x20 || Name[i] >= 0x7f || Name[i] == '"' || Name[i] == '\\' ?
+                 '_' : Name[i];
+    Out[i] = 0;
+}
+
+/*
+ * Format the record as one line of ASCII, in place. Returns its length.
+ */
+static UINTN FormatRecord(BOOT_STATS *Stats)
+{
+    CHAR8 Name[STATS_MAX_NAME];
+    CHAR8 *Line = (CHAR8 *)Record;
+    UINT64 Prev = Stats->Start, Ticks;
+    UINTN Len, i;
+
+    QuoteName(Stats->Entry, Name);
+    Len = Append(0, L"{\"v\":%d,\"entry\":\"%a\",\"format\":\"%s\",\"gzip\":%s,\"retries\":%d",
+                 STATS_VERSION, Name, FormatNames[Stats->Format],
+                 Stats->Gzip ? L"true" : L"false", Stats->Retries);
+    Len = AppendPayload(Len, L"kernel", &Stats->Kernel);
+    Len = AppendPayload(Len, L"initrd", &Stats->Initrd);
+    Len = AppendPayload(Len, L"dtb", &Stats->Dtb);
+    Len = Append(Len, L",\"timebase\":%ld", Stats->Timebase);
+
+    for (i = 0; i < STAGES; i++) {
+        if (!Stats->End[i])
+            continue;
+        Ticks = Stats->End[i] - Prev;
+        Prev = Stats->End[i];
+        if (Stats->Timebase)
+            Len = Append(Len, L",\"%s_us\":%ld", StageNames[i],
+                         Ticks * 1000000 / Stats->Timebase);
+        if (!Stats->ReadBytes[i])
+            continue;
+        Len = Append(Len, L",\"%s_read\":%ld", StageNames[i], Stats->ReadBytes[i]);
+        if (Stats->Timebase && Stats->ReadTicks[i])
+            Len = Append(Len, L",\"%s_read_kbps\":%ld", StageNames[i],
+                         Stats->ReadBytes[i] * Stats->Timebase / Stats->ReadTicks[i] / 1024);
+    }
+    if (Stats->Timebase)
+        Len = Append(Len, L",\"total_us\":%ld",
+                     (ReadTime() - Stats->Start) * 1000000 / Stats->Timebase);
+    Len = Append(Len, L"}\n");
+
+    /* Narrowing in place is safe: each byte lands before its source */
+    for (i = 0; i < Len; i++)
+        Line[i] = (CHAR8)Record[i];
+    return Len;
+}
+
+/*
+ * Move a full log aside: \loader-stats.log.1 is replaced
+ */
+static EFI_STATUS Rotate(EFI_FILE_HANDLE Root, EFI_FILE_HANDLE File, EFI_FILE_INFO *Info)
+{
+    UINT8 Buffer[SIZE_OF_EFI_FILE_INFO + sizeof(STATS_OLD_NAME)];
+    EFI_FILE_INFO *NewInfo = (EFI_FILE_INFO *)Buffer;
+    EFI_FILE_HANDLE Old;
+
+    /* Delete closes the handle, whether or not it succeeds */
+    if (!EFI_ERROR(Root->Open(Root, &Old, STATS_OLD_PATH,
+                              EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE, 0)))
+        Old->Delete(Old);
+
+    CopyMem(NewInfo, Info, SIZE_OF_EFI_FILE_INFO);
+    NewInfo->Size = sizeof(Buffer);
+    CopyMem(NewInfo->FileName, STATS_OLD_NAME, sizeof(STATS_OLD_NAME));
+    return File->SetInfo(File, &gEfiFileInfoGuid, sizeof(Buffer), NewInfo);
+}
+
+/*
+ * Append this boot's record to the log, rotating it first if it is full
+ */
+EFI_STATUS StatsWrite(EFI_FILE_HANDLE Root, BOOT_STATS *Stats)
+{
+    CONST UINT64 Mode = EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE | EFI_FILE_MODE_CREATE;
+    UINT8 InfoBuffer[512];
+    UINTN InfoSize = sizeof(InfoBuffer);
+    EFI_FILE_HANDLE File;
+    EFI_STATUS status;
+    UINTN Len;
+
+    Len = FormatRecord(Stats);
+    status = Root->Open(Root, &File, STATS_PATH, Mode, 0);
+    if (EFI_ERROR(status))
+        return status;
+    status = File->GetInfo(File, &gEfiFileInfoGuid, &InfoSize, InfoBuffer);
+    if (EFI_ERROR(status))
+        goto out;
+
+    if (((EFI_FILE_INFO *)InfoBuffer)->FileSize + Len > STATS_MAX_SIZE) {
+        status = Rotate(Root, File, (EFI_FILE_INFO *)InfoBuffer);
+        File->Close(File);
+        if (EFI_ERROR(status))
+            return status;
+        status = Root->Open(Root, &File, STATS_PATH, Mode, 0);
+        if (EFI_ERROR(status))
+            return status;
+    }
+
+    /* All ones is end of file */
+    status = File->SetPosition(File, ~(UINT64)0);
+    if (!EFI_ERROR(status))
+        status = File->Write(File, &Len, Record);
+out:
+    File->Close(File);
+    return status;
+}
@@ -0,0 +1,100 @@
+/*
+ * Unified kernel images
+ *
+ * A UKI is a PE/COFF image, normally systemd's EFI stub, whose .linux,
+ * .initrd, .dtb and .cmdline sections carry the whole boot payload.
+ * The loader does not run the stub: it reads the file in one
+ * sequential pass and takes the payloads out of that buffer by their
+ * section offsets, so a single file read and a single digest cover
+ * everything that is booted.
+ */
+
+#include "loader.h"
+
+#define PE_HEADER_OFFSET   0x3c           /* e_lfanew in the DOS header */
+#define PE_SECTION_SIZE    40
+
+typedef struct {
+    UINT32 Signature;
+    UINT16 Machine;
+    UINT16 NumberOfSections;
+    UINT32 TimeDateStamp;
+    UINT32 PointerToSymbolTable;
+    UINT32 NumberOfSymbols;
+    UINT16 SizeOfOptionalHeader;
+    UINT16 Characteristics;
+} PE_HEADER;
+
+typedef struct {
+    char Name[8];
+    UINT32 VirtualSize;     /* Bytes of data, the raw size is padded */
+    UINT32 VirtualAddress;
+    UINT32 SizeOfRawData;
+    UINT32 PointerToRawData;
+    UINT32 PointerToRelocations;
+    UINT32 PointerToLinenumbers;
+    UINT16 NumberOfRelocations;
+    UINT16 NumberOfLinenumbers;
+    UINT32 Characteristics;
+} PE_SECTION;
+
+static CONST char *SectionNames[UKI_SECTIONS] = {
+    [UKI_LINUX]   = ".linux",
+    [UKI_INITRD]  = ".initrd",
+    [UKI_DTB]     = ".dtb",
+    [UKI_CMDLINE] = ".cmdline",
+};
+
+static BOOLEAN NameEq(CONST PE_SECTION *Section, CONST char *Name)
+{
+    UINTN i;
+
+    for (i = 0; i < sizeof(Section->Name) && Name[i]; i++) {
+        if (Section->Name[i] != Name[i])
+            return FALSE;
+    }
+    return i == sizeof(Section->Name) || Section->Name[i] == '\0';
+}
+
+/*
+ * Find the UKI sections of the Size-byte image at Image. Sections are
+ * described as payloads within the image with no pages of their own;
+ * those the image lacks are left with Size 0. Fails if there is no
+ * .linux section.
+ */
+EFI_STATUS UkiParse(CONST VOID *Image, UINTN Size, PAYLOAD *Sections)
+{
+    CONST UINT8 *Base = Image;
+    PE_HEADER Pe;
+    PE_SECTION Section;
+    UINT32 PeOffset, DataSize;
+    UINTN Offset, i, s;
+
+    ZeroMem(Sections, UKI_SECTIONS * sizeof(PAYLOAD));
+    if (Size < PE_HEADER_OFFSET + sizeof(PeOffset) || *(UINT16 *)Base != PE_DOS_MAGIC)
+        return EFI_LOAD_ERROR;
+    CopyMem(&PeOffset, (VOID *)(Base + PE_HEADER_OFFSET), sizeof(PeOffset));
+    if (PeOffset > Size - sizeof(Pe))
+        return EFI_LOAD_ERROR;
+    CopyMem(&Pe, (VOID *)(Base + PeOffset), sizeof(Pe));
+    if (Pe.Signature != PE_NT_MAGIC)
+        return EFI_LOAD_ERROR;
+
+    Offset = PeOffset + sizeof(Pe) + Pe.SizeOfOptionalHeader;
+    for (i = 0; i < Pe.NumberOfSections; i++, Offset += PE_SECTION_SIZE) {
+        if (Offset + PE_SECTION_SIZE > Size)
+            return EFI_LOAD_ERROR;
+        CopyMem(&Section, (VOID *)(Base + Offset), sizeof(Section));
+        DataSize = Section.VirtualSize && Section.VirtualSize < Section.SizeOfRawData ?
+                   Section.VirtualSize : Section.SizeOfRawData;
+        if (Section.PointerToRawData > Size || DataSize > Size - Section.PointerToRawData)
+            return EFI_LOAD_ERROR;
+        for (s = 0; s < UKI_SECTIONS; s++) {
+            if (!NameEq(&Section, SectionNames[s]) || Sections[s].Size)
+                continue;
+            Sections[s].Addr = (EFI_PHYSICAL_ADDRESS)(UINTN)(Base + Section.PointerToRawData);
+            Sections[s].Size = DataSize;
+        }
+    }
+    return Sections[UKI_LINUX].Size ? EFI_SUCCESS : EFI_NOT_FOUND;
+}
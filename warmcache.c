@@ -0,0 +1,166 @@
+/*
+ * Warm-boot payload cache
+ *
+ * Appliances tend to reboot into the same kernel and initrd, read from
+ * slow flash every time. With "warm-cache <addr> <size>" in
+ * loader.conf the loader keeps a copy of the last verified kernel
+ * image (after decompression) and initrd in a fixed region of RAM,
+ * whose contents survive a warm reset. Each copy is tagged with the
+ * file it came from (a CRC32 of its path, its size and modification
+ * time), the SHA-256 of that file as stored and a CRC32 of the copy.
+ * On the next boot a payload whose file still matches its tag is
+ * copied out of the region instead of being read.
+ *
+ * The region is allocated at its fixed address as reserved memory on
+ * every boot, and for flat kernels also covered by a /memreserve/
+ * entry, so neither later firmware allocations nor the kernel reuse
+ * it. After a cold boot, or if anything else wrote to it, the header
+ * or copy CRC no longer matches and the region is started afresh.
+ */
+
+#include "loader.h"
+
+#define WARM_MAGIC         0x4d52574c     /* "LWRM" */
+#define WARM_VERSION       1
+#define WARM_DATA_OFFSET   EFI_PAGE_SIZE  /* First page holds the header */
+
+typedef struct {
+    UINT64 Offset;          /* From the start of the region, 0 = empty */
+    UINT64 Size;
+    UINT32 DataCrc;         /* Of the copy */
+    UINT32 PathCrc;         /* Tag: the file the copy came from */
+    UINT64 FileSize;
+    EFI_TIME FileTime;
+    UINT8 Digest[SHA256_DIGEST_SIZE];   /* Of the file as stored */
+} WARM_SLOT;
+
+typedef struct {
+    UINT32 Magic;
+    UINT32 Version;
+    UINT64 RegionSize;
+    WARM_SLOT Slots[WARM_SLOTS];
+    UINT32 Crc32;           /* Of everything above */
+} WARM_HEADER;
+
+#define HEADER_CRC_SIZE    __builtin_offsetof(WARM_HEADER, Crc32)
+
+static WARM_HEADER *Header;
+
+static UINT32 Crc32(CONST VOID *Data, UINTN Size)
+{
+    UINT32 Crc = 0;
+
+    BS->CalculateCrc32((VOID *)Data, Size, &Crc);
+    return Crc;
+}
+
+static VOID Seal(VOID)
+{
+    Header->Crc32 = Crc32(Header, HEADER_CRC_SIZE);
+}
+
+/*
+ * Reserve the region at Addr and adopt its contents if they are a
+ * valid cache. Warm is set if they were.
+ */
+EFI_STATUS WarmCacheOpen(UINT64 Addr, UINT64 Size, BOOLEAN *Warm)
+{
+    EFI_PHYSICAL_ADDRESS Region = Addr;
+    EFI_STATUS status;
+
+    *Warm = FALSE;
+    if ((Addr | Size) & EFI_PAGE_MASK || Size <= WARM_DATA_OFFSET)
+        return EFI_INVALID_PARAMETER;
+    status = BS->AllocatePages(AllocateAddress, EfiReservedMemoryType,
+                               EFI_SIZE_TO_PAGES(Size), &Region);
+    if (EFI_ERROR(status))
+        return status;
+
+    Header = (WARM_HEADER *)Region;
+    *Warm = Header->Magic == WARM_MAGIC && Header->Version == WARM_VERSION &&
+            Header->RegionSize == Size &&
+            Header->Crc32 == Crc32(Header, HEADER_CRC_SIZE);
+    if (!*Warm) {
+        ZeroMem(Header, sizeof(*Header));
+        Header->Magic = WARM_MAGIC;
+        Header->Version = WARM_VERSION;
+        Header->RegionSize = Size;
+        Seal();
+    }
+    return EFI_SUCCESS;
+}
+
+/*
+ * Find the copy of the file at Path with the given size and time.
+ * On a hit Data points at the copy in the region and Digest is set to
+ * the SHA-256 the file had when it was verified.
+ */
+BOOLEAN WarmCacheLookup(UINTN Slot, CONST CHAR16 *Path, UINT64 FileSize, EFI_TIME *FileTime,
+                        VOID **Data, UINTN *Size, UINT8 *Digest)
+{
+    WARM_SLOT *s;
+
+    if (!Header)
+        return FALSE;
+    s = &Header->Slots[Slot];
+    if (!s->Offset || s->Offset + s->Size > Header->RegionSize ||
+        s->PathCrc != Crc32(Path, StrLen(Path) * sizeof(CHAR16)) ||
+        s->FileSize != FileSize ||
+        CompareMem(&s->FileTime, FileTime, sizeof(EFI_TIME)) != 0)
+        return FALSE;
+
+    *Data = (UINT8 *)Header + s->Offset;
+    *Size = s->Size;
+    if (s->DataCrc != Crc32(*Data, *Size))
+        return FALSE;
+    CopyMem(Digest, s->Digest, SHA256_DIGEST_SIZE);
+    return TRUE;
+}
+
+/*
+ * Keep a copy of a verified payload. The kernel goes first in the
+ * region and the initrd after it, so storing a different kernel may
+ * drop the initrd. Payloads that do not fit are not cached.
+ */
+VOID WarmCacheStore(UINTN Slot, CONST CHAR16 *Path, UINT64 FileSize, EFI_TIME *FileTime,
+                    CONST VOID *Data, UINTN Size, CONST UINT8 *Digest)
+{
+    WARM_SLOT *s, *Kernel, *Initrd;
+    UINT64 Offset = WARM_DATA_OFFSET;
+
+    if (!Header)
+        return;
+    s = &Header->Slots[Slot];
+    Kernel = &Header->Slots[WARM_KERNEL];
+    Initrd = &Header->Slots[WARM_INITRD];
+    if (Slot == WARM_INITRD && Kernel->Offset)
+        Offset = (Kernel->Offset + Kernel->Size + EFI_PAGE_MASK) & ~(UINT64)EFI_PAGE_MASK;
+
+    /* Invalidate before writing, so an interrupted store leaves nothing half valid */
+    ZeroMem(s, sizeof(*s));
+    if (Slot == WARM_KERNEL && Initrd->Offset && Initrd->Offset < Offset + Size)
+        ZeroMem(Initrd, sizeof(*Initrd));
+    Seal();
+    if (Offset + Size > Header->RegionSize)
+        return;
+
+    CopyMem((UINT8 *)Header + Offset, (VOID *)Data, Size);
+    s->Size = Size;
+    s->DataCrc = Crc32((UINT8 *)Header + Offset, Size);
+    s->PathCrc = Crc32(Path, StrLen(Path) * sizeof(CHAR16));
+    s->FileSize = FileSize;
+    s->FileTime = *FileTime;
+    CopyMem(s->Digest, (VOID *)Digest, SHA256_DIGEST_SIZE);
+    s->Offset = Offset;
+    Seal();
+}
+
+/*
+ * Keep a flat kernel off the region
+ */
+EFI_STATUS WarmCachePublish(VOID *Fdt)
+{
+    if (!Header)
+        return EFI_NOT_READY;
+    return FdtAddMemReserve(Fdt, (UINT64)Header, Header->RegionSize);
+}